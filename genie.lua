@@ -37,6 +37,7 @@ solution('clumsy')
     project('clumsy')
         language("C")
         files({'src/**.c', 'src/**.h'})
+        excludes({'src/cli.c', 'src/bench.c', 'src/accuracy.c'})
         links({'WinDivert', 'iup', 'comctl32', 'Winmm', 'ws2_32'}) 
         if string.match(_ACTION, '^vs') then -- only vs can include rc file in solution
             files({'./etc/clumsy.rc'})
@@ -165,3 +166,114 @@ solution('clumsy')
         set_bin(MINGW_ACTION, 'Release', "x32")
         set_bin(MINGW_ACTION, 'Release', "x64")
 
+    -- headless build, no iup. runs on linux against the mock backend as well
+    project('clumsy-cli')
+        language("C")
+        kind("ConsoleApp")
+        files({'src/**.c', 'src/**.h'})
+        excludes({'src/main.c', 'src/elevate.c', 'src/bench.c', 'src/accuracy.c'})
+        defines({'CLUMSY_HEADLESS'})
+        includedirs({LIB_DIVERT_VC11 .. '/include'})
+        targetdir(ROOT .. '/bin/cli')
+
+        configuration('Debug')
+            flags({'ExtraWarnings', 'Symbols'})
+            defines({'_DEBUG'})
+
+        configuration('Release')
+            flags({"Optimize", 'Symbols'})
+            defines({'NDEBUG'})
+
+        configuration('windows')
+            links({'WinDivert', 'Winmm', 'ws2_32'})
+
+        configuration("vs*")
+            defines({"_CRT_SECURE_NO_WARNINGS"})
+            flags({'NoManifest'})
+            buildoptions({'/wd"4214"'})
+            objdir('obj_vs')
+
+        configuration({'x32', 'windows'})
+            libdirs({LIB_DIVERT_VC11 .. '/x86'})
+
+        configuration({'x64', 'windows'})
+            libdirs({LIB_DIVERT_VC11 .. '/x64'})
+
+        configuration('linux')
+            links({'pthread', 'm'})
+            buildoptions({
+                '-Wno-missing-braces',
+                '-Wno-missing-field-initializers',
+                '--std=gnu99'
+            })
+            objdir('obj_linux')
+
+    -- module micro benchmark, prints json results. see src/bench.c
+    project('clumsy-bench')
+        language("C")
+        kind("ConsoleApp")
+        files({'src/**.c', 'src/**.h'})
+        excludes({'src/main.c', 'src/elevate.c', 'src/cli.c'})
+        defines({'CLUMSY_HEADLESS'})
+        includedirs({LIB_DIVERT_VC11 .. '/include'})
+        targetdir(ROOT .. '/bin/bench')
+
+        configuration('Debug')
+            flags({'ExtraWarnings', 'Symbols'})
+            defines({'_DEBUG'})
+
+        configuration('Release')
+            flags({"Optimize", 'Symbols'})
+            defines({'NDEBUG'})
+
+        configuration('windows')
+            links({'WinDivert', 'Winmm', 'ws2_32'})
+
+        configuration("vs*")
+            defines({"_CRT_SECURE_NO_WARNINGS"})
+            flags({'NoManifest'})
+            buildoptions({'/wd"4214"'})
+            objdir('obj_vs')
+
+        configuration({'x32', 'windows'})
+            libdirs({LIB_DIVERT_VC11 .. '/x86'})
+
+        configuration({'x64', 'windows'})
+            libdirs({LIB_DIVERT_VC11 .. '/x64'})
+
+        configuration('linux')
+            links({'pthread', 'm'})
+            buildoptions({
+                '-Wno-missing-braces',
+                '-Wno-missing-field-initializers',
+                '--std=gnu99'
+            })
+            objdir('obj_linux')
+
+    -- traffic generator and sink for stress tests, standalone. see scripts/loadgen.c
+    project('loadgen')
+        language("C")
+        kind("ConsoleApp")
+        files({'scripts/loadgen.c'})
+        targetdir(ROOT .. '/bin/loadgen')
+
+        configuration('Debug')
+            flags({'ExtraWarnings', 'Symbols'})
+            defines({'_DEBUG'})
+
+        configuration('Release')
+            flags({"Optimize", 'Symbols'})
+            defines({'NDEBUG'})
+
+        configuration('windows')
+            links({'ws2_32'})
+
+        configuration("vs*")
+            defines({"_CRT_SECURE_NO_WARNINGS"})
+            flags({'NoManifest'})
+            objdir('obj_vs')
+
+        configuration('linux')
+            links({'pthread'})
+            buildoptions({'--std=gnu99'})
+            objdir('obj_linux')
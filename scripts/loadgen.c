@@ -0,0 +1,660 @@
+// native traffic generator and sequence checking sink for stress testing
+// clumsy at rates send_udp_nums.py can't get near. built by the 'loadgen'
+// project in genie.lua, or directly:
+//   cc -O2 -o loadgen scripts/loadgen.c -lpthread
+//   cl /O2 scripts\loadgen.c ws2_32.lib
+// usage:
+//   loadgen recv [--proto udp|tcp] [--port 9111] [--duration s] [--idle s]
+//   loadgen send [--proto udp|tcp] [--host 127.0.0.1] [--port 9111]
+//                [--rate pps] [--size bytes] [--threads n] [--duration s]
+// every packet carries a stream id, a sequence number and the time it was
+// sent. the sink reports loss, duplicates, reordering, one way delay
+// percentiles and goodput every second and in total. delay is only meaningful
+// with both ends on one host, which is the point of running over loopback.
+// --rate is the total over all threads, 0 sends as fast as possible.
+#ifdef __linux__
+#define _GNU_SOURCE // recvmmsg
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <Ws2tcpip.h>
+#include <windows.h>
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Lock;
+#define THREAD_RET DWORD WINAPI
+#define lockInit(l) InitializeCriticalSection(l)
+#define lockTake(l) EnterCriticalSection(l)
+#define lockGive(l) LeaveCriticalSection(l)
+#define sleepMs(ms) Sleep(ms)
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+typedef int SOCKET;
+typedef pthread_t Thread;
+typedef pthread_mutex_t Lock;
+#define THREAD_RET void*
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#define lockInit(l) pthread_mutex_init(l, NULL)
+#define lockTake(l) pthread_mutex_lock(l)
+#define lockGive(l) pthread_mutex_unlock(l)
+#define sleepMs(ms) usleep((ms) * 1000)
+#endif
+
+#define LOAD_MAGIC 0x434C4D59 // "CLMY"
+#define LOAD_PORT_DEFAULT 9111
+#define LOAD_RATE_DEFAULT 100000
+#define LOAD_SIZE_DEFAULT 512
+#define LOAD_THREADS_DEFAULT 1
+#define LOAD_DURATION_DEFAULT 10
+#define LOAD_IDLE_DEFAULT 2
+#define LOAD_MAX_SIZE 65507
+#define LOAD_MAX_THREADS 64
+#define LOAD_MAX_STREAMS 256
+#define LOAD_RECV_TIMEOUT_MS 100
+#define LOAD_TCP_BUFSIZE (1024 * 1024)
+#define LOAD_RECV_BATCH 64
+// pacing sleeps while further than this ahead, spins closer to the deadline
+#define LOAD_SPIN_NS 200000
+// delay histogram, same bucketing as the engine's stats
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB * (64 - HIST_SUB_BITS + 1))
+
+typedef struct {
+    uint32_t magic;
+    uint32_t stream;
+    uint64_t seq;
+    uint64_t sentNs;
+    uint32_t size; // whole message, tcp reads by it
+    uint32_t reserved;
+} LoadHeader;
+
+typedef struct {
+    uint64_t count;
+    uint64_t buckets[HIST_BUCKETS];
+} Histogram;
+
+typedef struct {
+    int used;
+    uint32_t id;
+    uint64_t highest; // one past the highest seq seen
+    uint64_t unique, duplicates, reordered;
+    unsigned char *seen; // bitmap by seq
+    uint64_t seenBits;
+} Stream;
+
+static volatile int stopping;
+static int useTcp;
+static const char *host = "127.0.0.1";
+static int port = LOAD_PORT_DEFAULT;
+static uint64_t rate = LOAD_RATE_DEFAULT;
+static uint32_t size = LOAD_SIZE_DEFAULT;
+static int threads = LOAD_THREADS_DEFAULT;
+static double duration = LOAD_DURATION_DEFAULT, idle = LOAD_IDLE_DEFAULT;
+
+// sink state, behind sinkLock when tcp runs a thread per connection
+static Lock sinkLock;
+static Stream streams[LOAD_MAX_STREAMS];
+static Histogram delays, intervalDelays;
+static uint64_t received, receivedBytes, duplicates, reordered, strayPackets;
+static uint64_t firstNs, lastNs;
+
+static uint64_t nowNs() {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000
+        + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+#else
+    // monotonic is shared by every process on the host, so is QPC on windows
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static int startThread(Thread *thread, THREAD_RET (*fn)(void*), void *arg) {
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)fn, arg, 0, NULL);
+    return *thread != NULL;
+#else
+    return pthread_create(thread, NULL, fn, arg) == 0;
+#endif
+}
+
+static void joinThread(Thread thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+static void setRecvTimeout(SOCKET s, int ms) {
+#ifdef _WIN32
+    DWORD timeout = ms;
+#else
+    struct timeval timeout;
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_usec = (ms % 1000) * 1000;
+#endif
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+
+static void onSignal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static int highestBit(uint64_t value) {
+    int bit = 0;
+    while (value >>= 1) {
+        ++bit;
+    }
+    return bit;
+}
+
+static void histAdd(Histogram *hist, uint64_t value) {
+    int shift;
+    if (value < HIST_SUB) {
+        ++hist->buckets[value];
+    } else {
+        shift = highestBit(value) - HIST_SUB_BITS;
+        ++hist->buckets[HIST_SUB * (shift + 1) + (value >> shift) - HIST_SUB];
+    }
+    ++hist->count;
+}
+
+static double histPercentile(Histogram *hist, double percentile) {
+    uint64_t target = (uint64_t)(percentile / 100.0 * hist->count + 0.5), seen = 0;
+    int ix, shift;
+    if (hist->count == 0) {
+        return 0;
+    }
+    if (target == 0) {
+        target = 1;
+    }
+    for (ix = 0; ix < HIST_BUCKETS; ++ix) {
+        seen += hist->buckets[ix];
+        if (seen >= target) {
+            break;
+        }
+    }
+    if (ix < HIST_SUB) {
+        return ix;
+    }
+    shift = ix / HIST_SUB - 1;
+    return (double)((uint64_t)(ix % HIST_SUB + HIST_SUB) << shift) + ((uint64_t)1 << shift) / 2.0;
+}
+
+static Stream* findStream(uint32_t id) {
+    uint32_t ix, slot;
+    for (ix = 0; ix < LOAD_MAX_STREAMS; ++ix) {
+        slot = (id + ix) % LOAD_MAX_STREAMS;
+        if (!streams[slot].used) {
+            streams[slot].used = 1;
+            streams[slot].id = id;
+            return &streams[slot];
+        }
+        if (streams[slot].id == id) {
+            return &streams[slot];
+        }
+    }
+    return NULL;
+}
+
+// returns 0 for a duplicate
+static int markSeen(Stream *stream, uint64_t seq) {
+    unsigned char bit = (unsigned char)(1 << (seq % 8));
+    if (seq >= stream->seenBits) {
+        uint64_t bits = stream->seenBits ? stream->seenBits : 1 << 16;
+        unsigned char *grown;
+        while (bits <= seq) {
+            bits *= 2;
+        }
+        grown = (unsigned char*)realloc(stream->seen, (size_t)(bits / 8));
+        if (grown == NULL) {
+            return 1; // count it, just can't tell duplicates apart any more
+        }
+        memset(grown + stream->seenBits / 8, 0, (size_t)((bits - stream->seenBits) / 8));
+        stream->seen = grown;
+        stream->seenBits = bits;
+    }
+    if (stream->seen[seq / 8] & bit) {
+        return 0;
+    }
+    stream->seen[seq / 8] |= bit;
+    return 1;
+}
+
+// account one message, with sinkLock held
+static void sinkMessage(const char *data, uint32_t len, uint64_t now) {
+    LoadHeader header;
+    Stream *stream;
+    if (len < sizeof(LoadHeader)) {
+        ++strayPackets;
+        return;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != LOAD_MAGIC || (stream = findStream(header.stream)) == NULL) {
+        ++strayPackets;
+        return;
+    }
+    if (!markSeen(stream, header.seq)) {
+        ++stream->duplicates;
+        ++duplicates;
+        return;
+    }
+    if (header.seq + 1 < stream->highest) {
+        ++stream->reordered;
+        ++reordered;
+    } else {
+        stream->highest = header.seq + 1;
+    }
+    ++stream->unique;
+    ++received;
+    receivedBytes += len;
+    if (firstNs == 0) {
+        firstNs = now;
+    }
+    lastNs = now;
+    if (now > header.sentNs) {
+        histAdd(&delays, (now - header.sentNs) / 1000);
+        histAdd(&intervalDelays, (now - header.sentNs) / 1000);
+    }
+}
+
+static uint64_t totalLost() {
+    uint64_t lost = 0;
+    int ix;
+    for (ix = 0; ix < LOAD_MAX_STREAMS; ++ix) {
+        if (streams[ix].used) {
+            lost += streams[ix].highest - streams[ix].unique;
+        }
+    }
+    return lost;
+}
+
+#ifdef __linux__
+// one syscall and one lock for a whole batch of datagrams
+static THREAD_RET udpSinkLoop(void *arg) {
+    SOCKET s = *(SOCKET*)arg;
+    static char bufs[LOAD_RECV_BATCH][LOAD_MAX_SIZE];
+    static struct mmsghdr msgs[LOAD_RECV_BATCH];
+    static struct iovec iovs[LOAD_RECV_BATCH];
+    uint64_t now;
+    int count, ix;
+    for (ix = 0; ix < LOAD_RECV_BATCH; ++ix) {
+        iovs[ix].iov_base = bufs[ix];
+        iovs[ix].iov_len = LOAD_MAX_SIZE;
+        msgs[ix].msg_hdr.msg_iov = &iovs[ix];
+        msgs[ix].msg_hdr.msg_iovlen = 1;
+    }
+    while (!stopping) {
+        count = recvmmsg(s, msgs, LOAD_RECV_BATCH, MSG_WAITFORONE, NULL);
+        if (count <= 0) {
+            continue; // timeout, check for stopping
+        }
+        now = nowNs();
+        lockTake(&sinkLock);
+        for (ix = 0; ix < count; ++ix) {
+            sinkMessage(bufs[ix], msgs[ix].msg_len, now);
+        }
+        lockGive(&sinkLock);
+    }
+    return 0;
+}
+#else
+static THREAD_RET udpSinkLoop(void *arg) {
+    SOCKET s = *(SOCKET*)arg;
+    static char buf[LOAD_MAX_SIZE];
+    int len;
+    while (!stopping) {
+        len = recv(s, buf, sizeof(buf), 0);
+        if (len <= 0) {
+            continue; // timeout, check for stopping
+        }
+        lockTake(&sinkLock);
+        sinkMessage(buf, (uint32_t)len, nowNs());
+        lockGive(&sinkLock);
+    }
+    return 0;
+}
+#endif
+
+// a tcp connection is a byte stream, cut it into messages by their size
+static THREAD_RET tcpSinkLoop(void *arg) {
+    SOCKET s = (SOCKET)(intptr_t)arg;
+    char *buf = (char*)malloc(LOAD_TCP_BUFSIZE);
+    size_t have = 0, at;
+    int len;
+    LoadHeader header;
+    uint64_t now;
+
+    while (buf && !stopping) {
+        len = recv(s, buf + have, (int)(LOAD_TCP_BUFSIZE - have), 0);
+        if (len == 0) {
+            break;
+        } else if (len < 0) {
+            continue;
+        }
+        have += len;
+        now = nowNs();
+        at = 0;
+        lockTake(&sinkLock);
+        while (have - at >= sizeof(LoadHeader)) {
+            memcpy(&header, buf + at, sizeof(header));
+            if (header.magic != LOAD_MAGIC || header.size < sizeof(LoadHeader) || header.size > LOAD_MAX_SIZE) {
+                // only this connection goes, the sink stays up for the others
+                fprintf(stderr, "tcp stream out of sync, dropping connection\n");
+                lockGive(&sinkLock);
+                goto DONE;
+            }
+            if (have - at < header.size) {
+                break;
+            }
+            sinkMessage(buf + at, header.size, now);
+            at += header.size;
+        }
+        lockGive(&sinkLock);
+        memmove(buf, buf + at, have - at);
+        have -= at;
+    }
+DONE:
+    closesocket(s);
+    free(buf);
+    return 0;
+}
+
+static THREAD_RET tcpAcceptLoop(void *arg) {
+    SOCKET listener = *(SOCKET*)arg, s;
+    Thread thread;
+    while (!stopping) {
+        s = accept(listener, NULL, NULL);
+        if (s == INVALID_SOCKET) {
+            continue;
+        }
+        setRecvTimeout(s, LOAD_RECV_TIMEOUT_MS);
+        if (!startThread(&thread, tcpSinkLoop, (void*)(intptr_t)s)) {
+            closesocket(s);
+            continue;
+        }
+#ifdef _WIN32
+        CloseHandle(thread);
+#else
+        pthread_detach(thread);
+#endif
+    }
+    return 0;
+}
+
+static void printInterval(double elapsed, uint64_t packets, uint64_t bytes) {
+    printf("[%7.1fs] %9llu pkt/s %9.2f Mbit/s | loss %llu dup %llu reorder %llu | delay p50 %.0f us p99 %.0f us\n",
+        elapsed, (unsigned long long)packets, bytes * 8 / 1e6,
+        (unsigned long long)totalLost(), (unsigned long long)duplicates, (unsigned long long)reordered,
+        histPercentile(&intervalDelays, 50), histPercentile(&intervalDelays, 99));
+    fflush(stdout);
+}
+
+static int runSink() {
+    struct sockaddr_in addr;
+    SOCKET s;
+    Thread thread;
+    uint64_t start = nowNs(), lastReport = start, now, lastPackets = 0, lastBytes = 0, expected;
+    double seconds;
+    int on = 1;
+
+    lockInit(&sinkLock);
+    s = socket(AF_INET, useTcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (s == INVALID_SOCKET) {
+        fprintf(stderr, "failed to create socket\n");
+        return 1;
+    }
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+    if (!useTcp) {
+        int bufSize = 64 * 1024 * 1024;
+        setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char*)&bufSize, sizeof(bufSize));
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0 || (useTcp && listen(s, LOAD_MAX_THREADS) != 0)) {
+        fprintf(stderr, "failed to listen on port %d\n", port);
+        return 1;
+    }
+    setRecvTimeout(s, LOAD_RECV_TIMEOUT_MS);
+    if (!startThread(&thread, useTcp ? tcpAcceptLoop : udpSinkLoop, &s)) {
+        fprintf(stderr, "failed to start sink thread\n");
+        return 1;
+    }
+    printf("sink listening on %s port %d\n", useTcp ? "tcp" : "udp", port);
+    fflush(stdout);
+
+    while (!stopping) {
+        sleepMs(LOAD_RECV_TIMEOUT_MS);
+        now = nowNs();
+        lockTake(&sinkLock);
+        if (now - lastReport >= 1000000000) {
+            if (received > lastPackets) {
+                printInterval((now - start) / 1e9, received - lastPackets, receivedBytes - lastBytes);
+            }
+            lastPackets = received;
+            lastBytes = receivedBytes;
+            memset(&intervalDelays, 0, sizeof(intervalDelays));
+            lastReport = now;
+        }
+        if ((duration > 0 && now - start >= duration * 1e9)
+            || (received && idle > 0 && now - lastNs >= idle * 1e9)) {
+            stopping = 1;
+        }
+        lockGive(&sinkLock);
+    }
+    joinThread(thread);
+    closesocket(s);
+
+    expected = received + totalLost();
+    seconds = lastNs > firstNs ? (lastNs - firstNs) / 1e9 : 0;
+    printf("--- total\n"
+        "received: %llu packets, %llu bytes, stray: %llu\n"
+        "lost: %llu (%.4f%%), duplicated: %llu, reordered: %llu (%.4f%%)\n"
+        "delay: p50 %.0f us, p90 %.0f us, p99 %.0f us, p99.9 %.0f us, max %.0f us\n"
+        "goodput: %.2f Mbit/s, %.0f pkt/s\n",
+        (unsigned long long)received, (unsigned long long)receivedBytes, (unsigned long long)strayPackets,
+        (unsigned long long)totalLost(), expected ? 100.0 * totalLost() / expected : 0.0,
+        (unsigned long long)duplicates, (unsigned long long)reordered,
+        received ? 100.0 * reordered / received : 0.0,
+        histPercentile(&delays, 50), histPercentile(&delays, 90), histPercentile(&delays, 99),
+        histPercentile(&delays, 99.9), histPercentile(&delays, 100),
+        seconds > 0 ? receivedBytes * 8 / seconds / 1e6 : 0.0,
+        seconds > 0 ? received / seconds : 0.0);
+    return 0;
+}
+
+typedef struct {
+    uint32_t stream;
+    uint64_t sent, failed;
+} Sender;
+
+static int sendAll(SOCKET s, const char *buf, int len) {
+    int sent;
+    while (len > 0) {
+        sent = send(s, buf, len, 0);
+        if (sent <= 0) {
+            return 0;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return 1;
+}
+
+static THREAD_RET senderLoop(void *arg) {
+    Sender *sender = (Sender*)arg;
+    struct sockaddr_in addr;
+    char *buf = (char*)calloc(1, size);
+    LoadHeader header;
+    SOCKET s;
+    uint64_t start, end, now, due, intervalNs = rate ? (uint64_t)threads * 1000000000 / rate : 0;
+    int on = 1, ok;
+
+    s = socket(AF_INET, useTcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    inet_pton(AF_INET, host, &addr.sin_addr);
+    if (buf == NULL || s == INVALID_SOCKET || connect(s, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "stream %u failed to connect to %s:%d\n", sender->stream, host, port);
+        free(buf);
+        return 0;
+    }
+    if (useTcp) {
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = LOAD_MAGIC;
+    header.stream = sender->stream;
+    header.size = size;
+
+    start = due = nowNs();
+    end = start + (uint64_t)(duration * 1e9);
+    while (!stopping) {
+        now = nowNs();
+        if (duration > 0 && now >= end) {
+            break;
+        }
+        if (intervalNs) {
+            if (due > now + LOAD_SPIN_NS) {
+                sleepMs(due - now > 2000000 ? 1 : 0);
+                continue;
+            }
+            if (due > now) {
+                continue;
+            }
+            due += intervalNs;
+        }
+        header.seq = sender->sent;
+        header.sentNs = now;
+        memcpy(buf, &header, sizeof(header));
+        ok = useTcp ? sendAll(s, buf, (int)size) : send(s, buf, (int)size, 0) == (int)size;
+        if (ok) {
+            ++sender->sent;
+        } else {
+            ++sender->failed;
+            if (useTcp) {
+                break;
+            }
+        }
+    }
+    closesocket(s);
+    free(buf);
+    return 0;
+}
+
+static int runSenders() {
+    Thread workers[LOAD_MAX_THREADS];
+    Sender senders[LOAD_MAX_THREADS];
+    uint64_t start = nowNs(), sent = 0, failed = 0;
+    uint32_t base = (uint32_t)(start / 1000) * LOAD_MAX_THREADS;
+    double seconds;
+    int ix, started;
+
+    for (started = 0; started < threads; ++started) {
+        memset(&senders[started], 0, sizeof(Sender));
+        senders[started].stream = base + started;
+        if (!startThread(&workers[started], senderLoop, &senders[started])) {
+            fprintf(stderr, "failed to start sender thread\n");
+            stopping = 1;
+            break;
+        }
+    }
+    for (ix = 0; ix < started; ++ix) {
+        joinThread(workers[ix]);
+        sent += senders[ix].sent;
+        failed += senders[ix].failed;
+    }
+    seconds = (nowNs() - start) / 1e9;
+    printf("sent: %llu packets (%.0f pkt/s, %.2f Mbit/s), failed: %llu\n",
+        (unsigned long long)sent, seconds > 0 ? sent / seconds : 0.0,
+        seconds > 0 ? sent * size * 8 / seconds / 1e6 : 0.0, (unsigned long long)failed);
+    return 0;
+}
+
+static void usage() {
+    fprintf(stderr, "usage:\n"
+        "  loadgen recv [--proto udp|tcp] [--port %d] [--duration s] [--idle %d]\n"
+        "  loadgen send [--proto udp|tcp] [--host 127.0.0.1] [--port %d]\n"
+        "               [--rate %d] [--size %d] [--threads %d] [--duration %d]\n",
+        LOAD_PORT_DEFAULT, LOAD_IDLE_DEFAULT, LOAD_PORT_DEFAULT,
+        LOAD_RATE_DEFAULT, LOAD_SIZE_DEFAULT, LOAD_THREADS_DEFAULT, LOAD_DURATION_DEFAULT);
+}
+
+int main(int argc, char *argv[]) {
+    int ix, sink, result;
+#ifdef _WIN32
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+    if (argc < 2 || (strcmp(argv[1], "recv") != 0 && strcmp(argv[1], "send") != 0)) {
+        usage();
+        return 1;
+    }
+    sink = strcmp(argv[1], "recv") == 0;
+    // the sink runs until idle by default
+    if (sink) {
+        duration = 0;
+    }
+    for (ix = 2; ix + 1 < argc; ix += 2) {
+        const char *key = argv[ix], *value = argv[ix + 1];
+        if (strcmp(key, "--proto") == 0) {
+            useTcp = strcmp(value, "tcp") == 0;
+        } else if (strcmp(key, "--host") == 0) {
+            host = value;
+        } else if (strcmp(key, "--port") == 0) {
+            port = atoi(value);
+        } else if (strcmp(key, "--rate") == 0) {
+            rate = strtoull(value, NULL, 10);
+        } else if (strcmp(key, "--size") == 0) {
+            size = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(key, "--threads") == 0) {
+            threads = atoi(value);
+        } else if (strcmp(key, "--duration") == 0) {
+            duration = atof(value);
+        } else if (strcmp(key, "--idle") == 0) {
+            idle = atof(value);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (ix != argc || size < sizeof(LoadHeader) || size > LOAD_MAX_SIZE
+        || threads < 1 || threads > LOAD_MAX_THREADS) {
+        usage();
+        return 1;
+    }
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    result = sink ? runSink() : runSenders();
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return result;
+}
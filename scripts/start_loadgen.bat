@@ -0,0 +1,5 @@
+@echo off
+REM udp at 200k pps over 4 threads through whatever clumsy is doing to loopback,
+REM the sink window prints loss, reordering and delay every second
+start loadgen recv --port 9911
+loadgen send --port 9911 --rate 200000 --threads 4 --duration 30
@@ -0,0 +1,246 @@
+// timing accuracy harness, run with clumsy-bench --bench-mode accuracy.
+// replays mock traffic through the running engine once per case and compares
+// what came out with what was configured, failing past the tolerances:
+//   lag        delay percentiles against --accuracy-lag ms, default 100
+//   drop       loss rate against --accuracy-drop percent, default 10
+//   bandwidth  throughput after the first second against --accuracy-bandwidth
+//              KB/s, default 64
+// every case also checks that nothing was reordered. tolerances:
+//   --tolerance-delay  ms late the p99 delay may be, default CLOCK_WAITMS + TIMER_RESOLUTION
+//   --tolerance-loss   percentage points, default 2
+//   --tolerance-rate   percent of the configured throughput, default 15
+// traffic is --accuracy-seconds long, default 3, shaped by the usual mock
+// options. --clock virtual runs the same cases on the virtual clock.
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+#include "common.h"
+
+#define ACCURACY_SECONDS_DEFAULT 3
+#define ACCURACY_RATE_DEFAULT 1000 // same as the mock backend's
+#define ACCURACY_LAG_DEFAULT 100
+#define ACCURACY_DROP_DEFAULT 10
+#define ACCURACY_BANDWIDTH_DEFAULT 64
+#define ACCURACY_TOLERANCE_DELAY_DEFAULT (CLOCK_WAITMS + TIMER_RESOLUTION)
+#define ACCURACY_TOLERANCE_LOSS_DEFAULT 2.0
+#define ACCURACY_TOLERANCE_RATE_DEFAULT 15.0
+#define ACCURACY_SEQ_OFFSET (sizeof(WINDIVERT_IPHDR) + sizeof(WINDIVERT_UDPHDR))
+#define ACCURACY_POLL_MS 10
+// bandwidth's rate window, the limiter lets everything through until it's full
+#define ACCURACY_WINDOW_US 1000000
+
+// what the sink saw, indexed by the sequence number mock puts in the payload
+static UINT64 packetCount, generated, received, reordered, seqMax;
+static UINT32 *delaysUs;
+static BOOL *seen;
+// throughput is taken from the end of the first window to the end of the
+// traffic, the limiter lets whole bursts through as its window clears
+static UINT64 windowBytes, trafficUs;
+static LONGLONG firstSendTick;
+
+static double argOrDouble(const char *key, double defaultValue) {
+    const char *value = getArg(key);
+    return value ? atof(value) : defaultValue;
+}
+
+// mock traffic cut off after packetCount, with every reinjection recorded
+static BOOL sinkOpen(const char *filter, char buf[]) {
+    return mockBackend.open(filter, buf);
+}
+
+static int sinkRecv(char *buf, UINT bufLen, UINT *readLen, WINDIVERT_ADDRESS *addr) {
+    int status;
+    if (generated >= packetCount) {
+        return RECV_STATUS_EOF;
+    }
+    status = mockBackend.recv(buf, bufLen, readLen, addr);
+    if (status == RECV_STATUS_OK) {
+        ++generated;
+    }
+    return status;
+}
+
+static short sinkSend(PacketNode *pnode) {
+    LONGLONG now = clockTicks();
+    UINT64 sinceFirst;
+    UINT32 seq;
+    if (pnode->packetLen < ACCURACY_SEQ_OFFSET + sizeof(UINT32)) {
+        return SEND_STATUS_SEND;
+    }
+    memcpy(&seq, pnode->packet + ACCURACY_SEQ_OFFSET, sizeof(UINT32));
+    seq = ntohl(seq);
+    if (seq >= packetCount || seen[seq]) {
+        return SEND_STATUS_SEND;
+    }
+    seen[seq] = TRUE;
+    if (received > 0 && seq < seqMax) {
+        ++reordered;
+    }
+    if (seq > seqMax || received == 0) {
+        seqMax = seq;
+    }
+    delaysUs[received++] = (UINT32)statsTicksToUs(now - pnode->recvTick);
+    if (firstSendTick == 0) {
+        firstSendTick = now;
+    }
+    sinceFirst = statsTicksToUs(now - firstSendTick);
+    if (sinceFirst >= ACCURACY_WINDOW_US && sinceFirst < trafficUs) {
+        windowBytes += pnode->packetLen;
+    }
+    return SEND_STATUS_SEND;
+}
+
+static void sinkClose() {
+    mockBackend.close();
+}
+
+static Backend sinkBackend = {
+    "accuracy",
+    sinkOpen,
+    sinkRecv,
+    sinkSend,
+    sinkClose,
+    1,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+static int compareDelay(const void *a, const void *b) {
+    UINT32 x = *(const UINT32*)a, y = *(const UINT32*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentileMs(double p) {
+    UINT64 ix;
+    if (received == 0) {
+        return 0;
+    }
+    ix = (UINT64)(p / 100.0 * (received - 1) + 0.5);
+    return delaysUs[ix] / 1000.0;
+}
+
+// run the engine over one batch of traffic with only the given settings on
+static BOOL runCase(const char *moduleKey, const char *paramKey, const char *paramValue) {
+    char buf[MSG_BUFSIZE];
+    int ix;
+    BOOL busy;
+
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        *(modules[ix]->enabledFlag) = 0;
+    }
+    MODULES_CHANGED();
+    setByKey(moduleKey, "on");
+    if (paramKey && !setByKey(paramKey, paramValue)) {
+        fprintf(stderr, "failed to set %s %s\n", paramKey, paramValue);
+        return FALSE;
+    }
+    memset(seen, 0, sizeof(BOOL) * (size_t)packetCount);
+    generated = received = reordered = seqMax = windowBytes = 0;
+    firstSendTick = 0;
+
+    if (!divertStart("true", buf)) {
+        fprintf(stderr, "%s\n", buf);
+        return FALSE;
+    }
+    do {
+        Sleep(ACCURACY_POLL_MS);
+        busy = !divertInputDone();
+        for (ix = 0; ix < MODULE_CNT && !busy; ++ix) {
+            busy = modules[ix]->buffered != 0;
+        }
+    } while (busy);
+    divertStop();
+    qsort(delaysUs, (size_t)received, sizeof(UINT32), compareDelay);
+    return TRUE;
+}
+
+static void printCase(const char *name, double configured, double achieved, double error,
+                      double tolerance, BOOL pass, BOOL last) {
+    printf("    {\"case\": \"%s\", \"configured\": %.3f, \"achieved\": %.3f, \"error\": %.3f, \"tolerance\": %.3f, "
+        "\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, "
+        "\"loss\": %.5f, \"reorder\": %.5f, \"pass\": %s}%s\n",
+        name, configured, achieved, error, tolerance,
+        percentileMs(50), percentileMs(90), percentileMs(99), percentileMs(100),
+        packetCount ? 1.0 - (double)received / packetCount : 0.0,
+        received ? (double)reordered / received : 0.0,
+        pass ? "true" : "false", last ? "" : ",");
+}
+
+int accuracyRun() {
+    UINT seconds = (UINT)argOrDouble("accuracy-seconds", ACCURACY_SECONDS_DEFAULT);
+    UINT rate = (UINT)argOrDouble("mock-rate", ACCURACY_RATE_DEFAULT);
+    double lagMs = argOrDouble("accuracy-lag", ACCURACY_LAG_DEFAULT);
+    double dropPct = argOrDouble("accuracy-drop", ACCURACY_DROP_DEFAULT);
+    double limitKBs = argOrDouble("accuracy-bandwidth", ACCURACY_BANDWIDTH_DEFAULT);
+    double tolDelayMs = argOrDouble("tolerance-delay", ACCURACY_TOLERANCE_DELAY_DEFAULT);
+    double tolLoss = argOrDouble("tolerance-loss", ACCURACY_TOLERANCE_LOSS_DEFAULT);
+    double tolRate = argOrDouble("tolerance-rate", ACCURACY_TOLERANCE_RATE_DEFAULT);
+    double achieved, error, elapsed;
+    char value[NAME_SIZE];
+    BOOL pass, allPass = TRUE;
+
+    packetCount = (UINT64)seconds * rate;
+    trafficUs = (UINT64)seconds * 1000000;
+    if (packetCount == 0 || trafficUs <= ACCURACY_WINDOW_US) {
+        fprintf(stderr, "accuracy needs --accuracy-seconds above 1 and --mock-rate above 0\n");
+        return 1;
+    }
+    delaysUs = (UINT32*)malloc(sizeof(UINT32) * (size_t)packetCount);
+    seen = (BOOL*)malloc(sizeof(BOOL) * (size_t)packetCount);
+    if (delaysUs == NULL || seen == NULL) {
+        fprintf(stderr, "failed to allocate for %llu packets\n", (unsigned long long)packetCount);
+        return 1;
+    }
+    divertUseBackend(&sinkBackend);
+    printf("{\n  \"seconds\": %u, \"rate\": %u, \"clock\": \"%s\",\n  \"results\": [\n",
+        seconds, rate, getArg("clock") ? getArg("clock") : "real");
+
+    // lag, the p99 may be late by the tolerance but nothing may leave early,
+    // give or take the millisecond resolution modules keep time in
+    sprintf(value, "%d", (int)lagMs);
+    if (!runCase("lag", "lag-time", value)) {
+        return 1;
+    }
+    achieved = percentileMs(99);
+    error = achieved - lagMs;
+    pass = received == packetCount && reordered == 0 && percentileMs(0) >= lagMs - 1 && error <= tolDelayMs;
+    allPass &= pass;
+    printCase("lag", lagMs, achieved, error, tolDelayMs, pass, FALSE);
+
+    sprintf(value, "%.2f", dropPct);
+    if (!runCase("drop", "drop-chance", value)) {
+        return 1;
+    }
+    achieved = 100.0 * (1.0 - (double)received / packetCount);
+    error = achieved - dropPct;
+    pass = reordered == 0 && (error < 0 ? -error : error) <= tolLoss;
+    allPass &= pass;
+    printCase("drop", dropPct, achieved, error, tolLoss, pass, FALSE);
+
+    // steady state, once the limiter's window has filled up
+    sprintf(value, "%d", (int)limitKBs);
+    if (!runCase("bandwidth", "bandwidth-bandwidth", value)) {
+        return 1;
+    }
+    elapsed = (double)(trafficUs - ACCURACY_WINDOW_US) / 1e6;
+    achieved = elapsed > 0 ? windowBytes / 1024.0 / elapsed : 0;
+    error = limitKBs > 0 ? 100.0 * (achieved - limitKBs) / limitKBs : 0;
+    pass = reordered == 0 && (error < 0 ? -error : error) <= tolRate;
+    allPass &= pass;
+    printCase("bandwidth", limitKBs, achieved, error, tolRate, pass, TRUE);
+
+    printf("  ],\n  \"pass\": %s\n}\n", allPass ? "true" : "false");
+    free(delaysUs);
+    free(seen);
+    return allPass ? 0 : 1;
+}
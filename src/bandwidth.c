@@ -1,15 +1,21 @@
 // bandwidth cap module
+// besides the static limit, each direction can follow a link trace in the
+// mahimahi format: one line per packet delivery opportunity, holding the
+// millisecond it happens at. every opportunity delivers up to TRACE_MTU
+// bytes of queued packets and the trace repeats once it runs out.
+//   --bandwidth-uplink-trace    trace for outbound packets
+//   --bandwidth-downlink-trace  trace for inbound packets
+// traces are memory mapped and read as time goes, so they can be long
 #include <stdlib.h>
-#include <Windows.h>
 #include <stdint.h>
 
-#include "iup.h"
 #include "common.h"
 
 #define NAME "bandwidth"
 #define BANDWIDTH_MIN  "0"
 #define BANDWIDTH_MAX  "99999"
 #define BANDWIDTH_DEFAULT 10
+#define TRACE_MTU 1500
 
 //---------------------------------------------------------------------
 // rate stats
@@ -43,14 +49,32 @@ int32_t crate_stats_calculate(CRateStats *rate, uint32_t now_ts);
 //---------------------------------------------------------------------
 // configuration
 //---------------------------------------------------------------------
-static Ihandle *inboundCheckbox, *outboundCheckbox, *bandwidthInput;
-
 static volatile short bandwidthEnabled = 0,
-    bandwidthInbound = 1, bandwidthOutbound = 1;
+    bandwidthInbound = 1, bandwidthOutbound = 1,
+    // queued for a trace and over the memory budget, see budget.c
+    bandwidthBudget = BUDGET_TAIL_DROP;
 
 static volatile LONG bandwidthLimit = BANDWIDTH_DEFAULT; 
 static CRateStats *rateStats = NULL;
 
+typedef struct {
+    const char *name;
+    const char *data, *pos, *end; // mapped trace, NULL when not following one
+    size_t len;
+    DWORD period; // last timestamp, the trace starts over after it
+    DWORD base; // when the current pass over the trace started
+    DWORD next; // when the next opportunity is
+    PacketNode headNode, tailNode;
+    PacketNode *bufHead, *bufTail;
+    int bufSize;
+    UINT headSent; // bytes of the first queued packet already delivered
+} TraceLink;
+
+static TraceLink uplink = {"bandwidth-uplink-trace"}, downlink = {"bandwidth-downlink-trace"};
+
+
+#ifndef CLUMSY_HEADLESS
+static Ihandle *inboundCheckbox, *outboundCheckbox, *bandwidthInput;
 
 static Ihandle* bandwidthSetupUI() {
     Ihandle *bandwidthControlsBox = IupHbox(
@@ -84,18 +108,173 @@ static Ihandle* bandwidthSetupUI() {
 
     return bandwidthControlsBox;
 }
+#endif
+
+//---------------------------------------------------------------------
+// link trace
+//---------------------------------------------------------------------
+// read the next timestamp, skipping anything that isn't a number
+static BOOL traceReadNext(TraceLink *link, DWORD *ts) {
+    const char *p = link->pos;
+    DWORD value;
+    for (;;) {
+        while (p < link->end && (*p < '0' || *p > '9')) {
+            ++p;
+        }
+        if (p == link->end) {
+            link->pos = p;
+            return FALSE;
+        }
+        value = 0;
+        while (p < link->end && *p >= '0' && *p <= '9') {
+            value = value * 10 + (*p++ - '0');
+        }
+        // only take whole lines
+        if (p == link->end || *p == '\r' || *p == '\n' || *p == ' ' || *p == '\t') {
+            link->pos = p;
+            *ts = value;
+            return TRUE;
+        }
+        while (p < link->end && *p != '\n') {
+            ++p;
+        }
+    }
+}
+
+static void traceAdvance(TraceLink *link) {
+    DWORD ts;
+    if (!traceReadNext(link, &ts)) {
+        link->base += link->period;
+        link->pos = link->data;
+        traceReadNext(link, &ts);
+    }
+    link->next = link->base + ts;
+}
+
+static void traceOpen(TraceLink *link, DWORD now) {
+    const char *path = getArg(link->name), *p;
+    link->bufHead = &link->headNode;
+    link->bufTail = &link->tailNode;
+    link->bufHead->next = link->bufTail;
+    link->bufTail->prev = link->bufHead;
+    link->bufSize = 0;
+    link->headSent = 0;
+    link->data = NULL;
+    if (path == NULL) {
+        return;
+    }
+    link->data = mapFileRead(path, &link->len);
+    if (link->data == NULL) {
+        LOG("failed to map trace %s, using static limit", path);
+        return;
+    }
+    link->end = link->data + link->len;
+    // period is the last timestamp, read backwards so the trace isn't scanned
+    for (p = link->end; p > link->data && (p[-1] < '0' || p[-1] > '9'); --p);
+    for (; p > link->data && p[-1] >= '0' && p[-1] <= '9'; --p);
+    link->pos = p;
+    if (!traceReadNext(link, &link->period) || link->period == 0) {
+        LOG("trace %s has no usable timestamps, using static limit", path);
+        unmapFile(link->data, link->len);
+        link->data = NULL;
+        return;
+    }
+    link->pos = link->data;
+    link->base = now;
+    traceAdvance(link);
+    LOG("following trace %s, period %lu ms", path, (unsigned long)link->period);
+}
+
+static void traceClose(TraceLink *link, PacketNode *tail) {
+    PacketNode *pac, *at = tail;
+    if (link->data == NULL) {
+        return;
+    }
+    // queued packets go out in order, the list sends from the tail so each
+    // goes in ahead of the one before it
+    while (link->bufHead->next != link->bufTail) {
+        pac = popNode(link->bufHead->next);
+        budgetRefund(&bandwidthModule, pac);
+        insertBefore(pac, at);
+        at = pac;
+    }
+    link->bufSize = 0;
+    unmapFile(link->data, link->len);
+    link->data = NULL;
+}
+
+// deliver queued packets for every opportunity that is due
+static void traceRun(TraceLink *link, PacketNode *head, DWORD now) {
+    PacketNode *pac;
+    UINT budget, remain;
+    while ((LONG)(link->next - now) <= 0) {
+        budget = TRACE_MTU;
+        while (budget > 0 && link->bufSize > 0) {
+            pac = link->bufHead->next;
+            remain = pac->packetLen - link->headSent;
+            if (remain > budget) {
+                // rest goes with the next opportunity
+                link->headSent += budget;
+                break;
+            }
+            budget -= remain;
+            link->headSent = 0;
+            // the trace meant it to leave with this opportunity
+            if ((LONG)(link->next - pac->timestamp) > 0) {
+                pac->intendedUs += (link->next - pac->timestamp) * 1000;
+            }
+            budgetRefund(&bandwidthModule, pac);
+            insertAfter(popNode(pac), head);
+            --link->bufSize;
+        }
+        traceAdvance(link);
+    }
+    if (link->bufSize > 0) {
+        clockWakeAt(link->next);
+    }
+}
+
+// over the memory budget, give up packets from the longer queue until back
+// under. returns how many were dropped
+static int traceShed(PacketNode *head) {
+    TraceLink *link;
+    PacketNode *pac;
+    int dropped = 0;
+    while (budgetExceeded() && uplink.bufSize + downlink.bufSize > 0) {
+        link = uplink.bufSize >= downlink.bufSize ? &uplink : &downlink;
+        pac = bandwidthBudget == BUDGET_TAIL_DROP ? link->bufTail->prev : link->bufHead->next;
+        if (pac == link->bufHead->next) {
+            link->headSent = 0;
+        }
+        budgetRefund(&bandwidthModule, pac);
+        popNode(pac);
+        --link->bufSize;
+        if (bandwidthBudget == BUDGET_RELEASE) {
+            insertAfter(pac, head);
+        } else {
+            dropNode(pac);
+            ++dropped;
+        }
+    }
+    return dropped;
+}
 
 static void bandwidthStartUp() {
+    DWORD now = clockMs();
 	if (rateStats) crate_stats_delete(rateStats);
 	rateStats = crate_stats_new(1000, 1000);
+    traceOpen(&uplink, now);
+    traceOpen(&downlink, now);
     LOG("bandwidth enabled");
 }
 
 static void bandwidthCloseDown(PacketNode *head, PacketNode *tail) {
     UNREFERENCED_PARAMETER(head);
-    UNREFERENCED_PARAMETER(tail);
 	if (rateStats) crate_stats_delete(rateStats);
 	rateStats = NULL;
+    traceClose(&uplink, tail);
+    traceClose(&downlink, tail);
+    STATS_BUFFERED(bandwidthModule, 0);
     LOG("bandwidth disabled");
 }
 
@@ -105,21 +284,51 @@ static void bandwidthCloseDown(PacketNode *head, PacketNode *tail) {
 //---------------------------------------------------------------------
 static short bandwidthProcess(PacketNode *head, PacketNode* tail) {
     int dropped = 0;
-	DWORD now_ts = timeGetTime();
+	DWORD now_ts = clockMs();
 	int limit = bandwidthLimit * 1024;
 
+    // packets of traced directions are queued and leave as the trace allows
+    if (uplink.data || downlink.data) {
+        PacketNode *pac = head->next;
+        while (pac != tail) {
+            TraceLink *link = pac->addr.Outbound ? &uplink : &downlink;
+            PacketNode *next = pac->next;
+            if (link->data && checkDirection(pac->addr.Outbound, bandwidthInbound, bandwidthOutbound)) {
+                STATS_SEEN(bandwidthModule, pac);
+                PACKET_NOTE(pac, NOTE_DELAYED);
+                pac->timestamp = now_ts;
+                budgetCharge(&bandwidthModule, pac);
+                insertBefore(popNode(pac), link->bufTail);
+                ++link->bufSize;
+                STATS_ADD(bandwidthModule, delayed, 1);
+            }
+            pac = next;
+        }
+        if (uplink.data) {
+            traceRun(&uplink, head, now_ts);
+        }
+        if (downlink.data) {
+            traceRun(&downlink, head, now_ts);
+        }
+        dropped += traceShed(head);
+        STATS_BUFFERED(bandwidthModule, uplink.bufSize + downlink.bufSize);
+    }
+
 	//	allow 0 limit which should drop all
 	if (limit < 0 || rateStats == NULL) {
-		return 0;
+        STATS_ADD(bandwidthModule, dropped, dropped);
+		return dropped > 0 || uplink.bufSize + downlink.bufSize > 0;
 	}
 
     while (head->next != tail) {
         PacketNode *pac = head->next;
 		int discard = 0;
-        // chance in range of [0, 10000]
-        if (checkDirection(pac->addr.Outbound, bandwidthInbound, bandwidthOutbound)) {
+        // traced directions were handled above
+        if ((pac->addr.Outbound ? uplink.data : downlink.data) == NULL
+            && checkDirection(pac->addr.Outbound, bandwidthInbound, bandwidthOutbound)) {
 			int rate = crate_stats_calculate(rateStats, now_ts);
 			int size = pac->packetLen;
+			STATS_SEEN(bandwidthModule, pac);
 			if (rate + size > limit) {
 				LOG("dropped with bandwidth %dKB/s, direction %s",
 					(int)bandwidthLimit, pac->addr.Outbound ? "OUTBOUND" : "INBOUND");
@@ -130,30 +339,40 @@ static short bandwidthProcess(PacketNode *head, PacketNode* tail) {
 			}
 		}
 		if (discard) {
-            freeNode(popNode(pac));
+            dropNode(popNode(pac));
             ++dropped;
         } else {
             head = head->next;
         }
     }
 
-    return dropped > 0;
+    STATS_ADD(bandwidthModule, dropped, dropped);
+    return dropped > 0 || uplink.bufSize + downlink.bufSize > 0;
 }
 
 
 //---------------------------------------------------------------------
 // module
 //---------------------------------------------------------------------
+static ModuleParam bandwidthParams[] = {
+    {"inbound", PARAM_TOGGLE, &bandwidthInbound, NULL, NULL},
+    {"outbound", PARAM_TOGGLE, &bandwidthOutbound, NULL, NULL},
+    {"bandwidth", PARAM_INT32, &bandwidthLimit, BANDWIDTH_MIN, BANDWIDTH_MAX},
+    {"budget", PARAM_CHOICE, &bandwidthBudget, BUDGET_POLICIES, NULL},
+    {NULL}
+};
+
 Module bandwidthModule = {
     "Bandwidth",
     NAME,
     (short*)&bandwidthEnabled,
-    bandwidthSetupUI,
+    MODULE_UI(bandwidthSetupUI),
     bandwidthStartUp,
     bandwidthCloseDown,
     bandwidthProcess,
+    bandwidthParams,
     // runtime fields
-    0, 0, NULL
+    0, 0, NULL, NULL, 0, 0
 };
 
 
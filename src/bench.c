@@ -0,0 +1,327 @@
+// module micro benchmark. runs batches of synthetic packets through each
+// module's process() on its own, then through the whole engine step, and
+// prints the results as json so builds can be compared. options:
+//   --bench-batch     packets put on the list per step, default 64
+//   --bench-steps     steps per case, default 20000
+//   --bench-sizes     ip packet sizes as size:weight,..., default 64:50,576:25,1500:25
+//   --bench-flows     distinct flows, even ones udp and odd ones tcp, default 16
+//   --bench-inbound   percentage of inbound packets, default 50
+//   --bench-step-us   virtual time between steps, default 1000
+//   --bench-case      run only this module, or "engine"
+//   --bench-mode      "accuracy" runs the timing accuracy harness instead,
+//                     see accuracy.c
+// module options apply as usual, e.g. --lag-time 5 --drop-chance 50. each
+// module case turns its module on. the engine case runs the modules turned
+// on by the options, or all of them when none is, in --module-order.
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+#include "common.h"
+
+#define BENCH_BATCH_DEFAULT 64
+#define BENCH_STEPS_DEFAULT 20000
+#define BENCH_SIZES_DEFAULT "64:50,576:25,1500:25"
+#define BENCH_FLOWS_DEFAULT 16
+#define BENCH_INBOUND_DEFAULT 50
+#define BENCH_STEP_US_DEFAULT 1000
+#define BENCH_MAX_SIZES 16
+#define BENCH_MIN_SIZE 40 // ip and tcp header
+// packets are taken round robin from a fixed pattern so every case sees the
+// same traffic without spending time on random numbers
+#define BENCH_PATTERN_LEN 4096
+
+typedef struct {
+    UINT len;
+    WINDIVERT_ADDRESS addr;
+    char *packet;
+} BenchPacket;
+
+typedef struct {
+    const char *name;
+    UINT64 packets, released, allocs;
+    LONGLONG ticks;
+} BenchResult;
+
+extern PacketNode * const head;
+extern PacketNode * const tail;
+
+static UINT batch, steps, flows, inbound, stepUs;
+static UINT sizes[BENCH_MAX_SIZES], weights[BENCH_MAX_SIZES], sizeCount, weightSum;
+static const char *sizesText;
+static BenchPacket pattern[BENCH_PATTERN_LEN];
+static LONGLONG frequency;
+
+static UINT argOr(const char *key, UINT defaultValue) {
+    const char *value = getArg(key);
+    return value ? (UINT)strtoul(value, NULL, 10) : defaultValue;
+}
+
+static BOOL parseSizes(const char *text) {
+    const char *p = text;
+    char *end;
+    sizeCount = weightSum = 0;
+    while (*p && sizeCount < BENCH_MAX_SIZES) {
+        UINT size = (UINT)strtoul(p, &end, 10), weight = 1;
+        if (end == p || size < BENCH_MIN_SIZE || size > MAX_PACKETSIZE) {
+            return FALSE;
+        }
+        p = end;
+        if (*p == ':') {
+            weight = (UINT)strtoul(p + 1, &end, 10);
+            if (end == p + 1) {
+                return FALSE;
+            }
+            p = end;
+        }
+        sizes[sizeCount] = size;
+        weights[sizeCount++] = weight;
+        weightSum += weight;
+        if (*p == ',') {
+            ++p;
+        } else if (*p) {
+            return FALSE;
+        }
+    }
+    return sizeCount > 0 && weightSum > 0 && *p == '\0';
+}
+
+static void buildPacket(BenchPacket *bp, UINT len, UINT flow, BOOL isInbound) {
+    PWINDIVERT_IPHDR ip;
+    UINT32 local = htonl(0x0A000001), remote = htonl(0x0A000002 + flow / 2);
+    UINT16 localPort = htons((UINT16)(5000 + flow)), remotePort = htons(80);
+    BOOL tcp = flow % 2;
+
+    bp->packet = (char*)calloc(1, len);
+    bp->len = len;
+    ip = (PWINDIVERT_IPHDR)bp->packet;
+    ip->Version = 4;
+    ip->HdrLength = sizeof(WINDIVERT_IPHDR) / 4;
+    ip->Length = htons((UINT16)len);
+    ip->TTL = 64;
+    ip->Protocol = tcp ? 6 : 17;
+    ip->SrcAddr = isInbound ? remote : local;
+    ip->DstAddr = isInbound ? local : remote;
+    if (tcp) {
+        PWINDIVERT_TCPHDR th = (PWINDIVERT_TCPHDR)(bp->packet + sizeof(WINDIVERT_IPHDR));
+        th->SrcPort = isInbound ? remotePort : localPort;
+        th->DstPort = isInbound ? localPort : remotePort;
+        th->HdrLength = sizeof(WINDIVERT_TCPHDR) / 4;
+        th->Ack = 1;
+        th->Window = htons(0xFFFF);
+    } else {
+        PWINDIVERT_UDPHDR uh = (PWINDIVERT_UDPHDR)(bp->packet + sizeof(WINDIVERT_IPHDR));
+        uh->SrcPort = isInbound ? remotePort : localPort;
+        uh->DstPort = isInbound ? localPort : remotePort;
+        uh->Length = htons((UINT16)(len - sizeof(WINDIVERT_IPHDR)));
+    }
+    WinDivertHelperCalcChecksums(bp->packet, len, NULL, 0);
+    memset(&bp->addr, 0, sizeof(WINDIVERT_ADDRESS));
+    bp->addr.Outbound = !isInbound;
+}
+
+// lcg of its own, rand() belongs to the modules
+static void buildPattern() {
+    UINT32 seed = 1;
+    UINT ix, jx, pick;
+    for (ix = 0; ix < BENCH_PATTERN_LEN; ++ix) {
+        seed = seed * 1103515245 + 12345;
+        pick = (seed >> 8) % weightSum;
+        for (jx = 0; pick >= weights[jx]; ++jx) {
+            pick -= weights[jx];
+        }
+        seed = seed * 1103515245 + 12345;
+        buildPacket(&pattern[ix], sizes[jx], ix % flows, (seed >> 8) % 100 < inbound);
+    }
+}
+
+static UINT fillList(UINT next) {
+    UINT ix;
+    for (ix = 0; ix < batch; ++ix) {
+        BenchPacket *bp = &pattern[next++ % BENCH_PATTERN_LEN];
+        appendNode(createNode(bp->packet, bp->len, &bp->addr));
+    }
+    return next;
+}
+
+static UINT64 drainList() {
+    UINT64 count = 0;
+    while (!isListEmpty()) {
+        freeNode(popNode(head->next));
+        ++count;
+    }
+    return count;
+}
+
+static void resetEngine() {
+    int ix;
+    drainList();
+    clockStart(TRUE);
+    statsInit();
+    budgetReset();
+    statsRegisterThread();
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        modules[ix]->lastEnabled = 0;
+    }
+    MODULES_CHANGED();
+}
+
+static void benchModule(int moduleIx, BenchResult *result) {
+    Module *module = modules[moduleIx];
+    UINT step, next = 0;
+    UINT64 allocs;
+    LARGE_INTEGER start, end;
+
+    resetEngine();
+    memset(result, 0, sizeof(BenchResult));
+    result->name = module->shortName;
+    noteModuleIx = moduleIx;
+    module->startUp();
+    for (step = 0; step < steps; ++step) {
+        next = fillList(next);
+        allocs = packetAllocs;
+        QueryPerformanceCounter(&start);
+        module->process(head, tail);
+        QueryPerformanceCounter(&end);
+        result->ticks += end.QuadPart - start.QuadPart;
+        result->allocs += packetAllocs - allocs;
+        result->released += drainList();
+        clockAdvance(clockVirtualUs() + stepUs);
+    }
+    module->closeDown(head, tail);
+    result->released += drainList();
+    result->packets = (UINT64)steps * batch;
+}
+
+static void benchEngine(BenchResult *result) {
+    short enabled[MODULE_CNT];
+    UINT step, next = 0;
+    UINT64 allocs;
+    LARGE_INTEGER start, end;
+    EngineStats stats;
+    int ix, enabledCount = 0;
+
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        enabled[ix] = *(modules[ix]->enabledFlag);
+        enabledCount += enabled[ix] != 0;
+    }
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        *(modules[ix]->enabledFlag) = enabledCount ? enabled[ix] : 1;
+    }
+    MODULES_CHANGED();
+
+    resetEngine();
+    memset(result, 0, sizeof(BenchResult));
+    result->name = "engine";
+    divertSetBackend("mock");
+    divertReadStats(&stats);
+    result->released = stats.sentPackets;
+    for (step = 0; step < steps; ++step) {
+        next = fillList(next);
+        allocs = packetAllocs;
+        QueryPerformanceCounter(&start);
+        divertBenchStep();
+        QueryPerformanceCounter(&end);
+        result->ticks += end.QuadPart - start.QuadPart;
+        result->allocs += packetAllocs - allocs;
+        clockAdvance(clockVirtualUs() + stepUs);
+    }
+    // turning everything off lets the next step flush what is held
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        *(modules[ix]->enabledFlag) = 0;
+    }
+    MODULES_CHANGED();
+    divertBenchStep();
+    divertReadStats(&stats);
+    result->released = stats.sentPackets - result->released;
+    result->packets = (UINT64)steps * batch;
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        *(modules[ix]->enabledFlag) = enabled[ix];
+    }
+    MODULES_CHANGED();
+}
+
+static void printResult(BenchResult *result, BOOL last) {
+    double seconds = (double)result->ticks / frequency;
+    printf("    {\"case\": \"%s\", \"packets\": %llu, \"released\": %llu, \"seconds\": %.6f, "
+        "\"packets_per_s\": %.0f, \"ns_per_packet\": %.2f, \"allocs_per_packet\": %.3f}%s\n",
+        result->name,
+        (unsigned long long)result->packets,
+        (unsigned long long)result->released,
+        seconds,
+        seconds > 0 ? result->packets / seconds : 0.0,
+        result->packets ? seconds * 1e9 / result->packets : 0.0,
+        result->packets ? (double)result->allocs / result->packets : 0.0,
+        last ? "" : ",");
+}
+
+int main(int argc, char* argv[]) {
+    const char *only, *value;
+    char buf[MSG_BUFSIZE];
+    BenchResult result;
+    LARGE_INTEGER tick;
+    int ix, count = 0, total;
+
+    if (argc > 1 && !parseArgs(argc, argv)) {
+        fprintf(stderr, "usage: clumsy-bench [--key value]..., see bench.c for options\n");
+        return 1;
+    }
+    batch = argOr("bench-batch", BENCH_BATCH_DEFAULT);
+    steps = argOr("bench-steps", BENCH_STEPS_DEFAULT);
+    flows = argOr("bench-flows", BENCH_FLOWS_DEFAULT);
+    inbound = argOr("bench-inbound", BENCH_INBOUND_DEFAULT);
+    stepUs = argOr("bench-step-us", BENCH_STEP_US_DEFAULT);
+    sizesText = getArg("bench-sizes");
+    if (sizesText == NULL) {
+        sizesText = BENCH_SIZES_DEFAULT;
+    }
+    if (batch == 0 || flows == 0 || !parseSizes(sizesText)) {
+        fprintf(stderr, "invalid bench options\n");
+        return 1;
+    }
+    only = getArg("bench-case");
+    if (only && strcmp(only, "engine") != 0 && findModule(only) == NULL) {
+        fprintf(stderr, "unknown bench case %s\n", only);
+        return 1;
+    }
+    value = getArg("module-order");
+    if (value && !setModuleOrder(value, buf)) {
+        fprintf(stderr, "%s\n", buf);
+        return 1;
+    }
+    applyArgs();
+    srand(1);
+    value = getArg("bench-mode");
+    if (value && strcmp(value, "accuracy") == 0) {
+        return accuracyRun();
+    }
+    QueryPerformanceFrequency(&tick);
+    frequency = tick.QuadPart;
+    initPacketNodeList();
+    buildPattern();
+
+    total = only ? 1 : MODULE_CNT + 1;
+    printf("{\n  \"version\": \"%s\", \"batch\": %u, \"steps\": %u, \"sizes\": \"%s\", "
+        "\"flows\": %u, \"inbound\": %u, \"step_us\": %u,\n  \"results\": [\n",
+        CLUMSY_VERSION, batch, steps, sizesText, flows, inbound, stepUs);
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        short wasEnabled = *(modules[ix]->enabledFlag);
+        if (only && strcmp(only, modules[ix]->shortName) != 0) {
+            continue;
+        }
+        *(modules[ix]->enabledFlag) = 1;
+        benchModule(ix, &result);
+        *(modules[ix]->enabledFlag) = wasEnabled;
+        printResult(&result, ++count == total);
+    }
+    if (only == NULL || strcmp(only, "engine") == 0) {
+        benchEngine(&result);
+        printResult(&result, ++count == total);
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,43 @@
+// engine wide memory budget for held packets. modules that hold packets
+// charge their bytes against one budget of --memory-budget MB, 0 for none,
+// and once it's exceeded each gives up its own packets by its budget param:
+//   tail-drop  drop the newest packets it holds
+//   head-drop  drop the oldest
+//   release    send the oldest on early
+// payloads in the spill store aren't on the heap and don't count against it,
+// their module still counts them as buffered
+// only touched under the engine lock, the counts are read without it for display
+#include <stdlib.h>
+#include "common.h"
+
+static UINT64 budgetBytes, usedBytes;
+
+void budgetReset() {
+    const char *value = getArg("memory-budget");
+    budgetBytes = (UINT64)(value ? strtoul(value, NULL, 10) : MEMORY_BUDGET_DEFAULT) << 20;
+    usedBytes = 0;
+}
+
+void budgetCharge(Module *module, PacketNode *pac) {
+    if (!pac->spilled) {
+        usedBytes += pac->packetLen;
+    }
+    module->bufferedBytes += pac->packetLen;
+}
+
+void budgetRefund(Module *module, PacketNode *pac) {
+    if (!pac->spilled) {
+        assert(usedBytes >= pac->packetLen);
+        usedBytes -= pac->packetLen;
+    }
+    module->bufferedBytes -= pac->packetLen;
+}
+
+BOOL budgetExceeded() {
+    return budgetBytes > 0 && usedBytes > budgetBytes;
+}
+
+void budgetRead(UINT64 *used, UINT64 *budget) {
+    *used = usedBytes;
+    *budget = budgetBytes;
+}
@@ -0,0 +1,347 @@
+// pcapng capture of what goes in and out of the engine, for seeing what the
+// modules actually did. three interfaces are written:
+//   0 ingress  packets as captured, tapped in the read loop
+//   1 egress   packets as reinjected, tapped when sending
+//   2 dropped  packets a module dropped, tapped in dropNode()
+// each record carries the packet direction in epb_flags and a comment listing
+// which module delayed, dropped, duplicated or modified it.
+// taps only copy into a ring buffer and a writer thread drains it to disk, so
+// capturing never blocks the packet path. when the ring is full the record is
+// dropped and counted, never the packet.
+//   --capture           pcapng file to write
+//   --capture-snaplen   bytes kept per packet, default whole packets
+//   --capture-buffer    ring size in MB, default 16
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+
+#define CAPTURE_BUFFER_DEFAULT_MB 16
+#define CAPTURE_IDLE_MS 10
+#define CAPTURE_FILE_BUFSIZE (1024 * 1024)
+#define CAPTURE_COMMENT_SIZE 256
+// marks the unused end of the ring, reader skips to the start
+#define CAPTURE_PAD 0xFFFF
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+// pcapng block types, options and link type
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_OPT_COMMENT 1
+#define PCAPNG_SHB_USERAPPL 4
+#define PCAPNG_IF_NAME 2
+#define PCAPNG_IF_TSRESOL 9
+#define PCAPNG_EPB_FLAGS 2
+#define PCAPNG_FLAG_INBOUND 1
+#define PCAPNG_FLAG_OUTBOUND 2
+#define LINKTYPE_RAW 101
+
+typedef struct {
+    UINT32 size; // whole record with header, 8 byte aligned
+    UINT16 iface;
+    UINT16 outbound;
+    UINT32 capLen, origLen;
+    LONGLONG tick;
+    UINT64 notes;
+} CaptureRecord;
+
+volatile short captureOn = 0;
+
+// single producer ring: taps run with the engine lock held so they never race
+// each other, only the writer thread reads concurrently
+static char *ring;
+static UINT32 ringSize, ringMask;
+static volatile LONG ringWritePos, ringReadPos;
+static volatile LONG droppedRecords;
+
+static FILE *captureFile;
+static HANDLE writerThread;
+static volatile short writerStopping;
+static UINT32 snapLen;
+static LONGLONG startTick;
+static UINT64 startWallUs;
+
+static const char *ifaceNames[] = {"ingress", "egress", "dropped"};
+static const char *noteNames[] = {"delayed", "dropped", "duplicated", "modified"};
+
+static UINT64 wallClockUs() {
+#ifdef _WIN32
+    FILETIME ft;
+    ULARGE_INTEGER t;
+    GetSystemTimeAsFileTime(&ft);
+    t.LowPart = ft.dwLowDateTime;
+    t.HighPart = ft.dwHighDateTime;
+    // 100ns since 1601 to us since 1970
+    return (t.QuadPart - 116444736000000000ULL) / 10;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (UINT64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void captureTap(int iface, PacketNode *pnode) {
+    UINT32 capLen = pnode->packetLen < snapLen ? pnode->packetLen : snapLen;
+    UINT32 need = ALIGN_UP((UINT32)sizeof(CaptureRecord) + capLen, 8);
+    UINT32 w = (UINT32)ringWritePos, r = (UINT32)InterlockedExchangeAdd(&ringReadPos, 0);
+    UINT32 toEnd = ringSize - (w & ringMask), pad = toEnd < need ? toEnd : 0;
+    CaptureRecord *rec;
+
+    // no live traffic to hold up on the virtual clock, wait for the writer
+    while (ringSize - (w - r) < pad + need && clockIsVirtual() && !writerStopping) {
+        Sleep(1);
+        r = (UINT32)InterlockedExchangeAdd(&ringReadPos, 0);
+    }
+    if (ringSize - (w - r) < pad + need) {
+        InterlockedIncrement(&droppedRecords);
+        return;
+    }
+    if (pad >= sizeof(CaptureRecord)) {
+        rec = (CaptureRecord*)(ring + (w & ringMask));
+        rec->size = pad;
+        rec->iface = CAPTURE_PAD;
+    }
+    rec = (CaptureRecord*)(ring + ((w + pad) & ringMask));
+    rec->size = need;
+    rec->iface = (UINT16)iface;
+    rec->outbound = (UINT16)pnode->addr.Outbound;
+    rec->capLen = capLen;
+    rec->origLen = pnode->packetLen;
+    rec->notes = pnode->notes;
+    if (iface == CAPTURE_INGRESS && pnode->recvTick) {
+        rec->tick = pnode->recvTick;
+    } else {
+        rec->tick = clockTicks();
+    }
+    memcpy(rec + 1, pnode->packet, capLen);
+    // publish after the record is fully written
+    InterlockedExchange(&ringWritePos, (LONG)(w + pad + need));
+}
+
+static void writeOption(UINT16 code, const void *value, UINT16 len) {
+    static const char zeros[4] = {0};
+    fwrite(&code, 2, 1, captureFile);
+    fwrite(&len, 2, 1, captureFile);
+    fwrite(value, 1, len, captureFile);
+    fwrite(zeros, 1, ALIGN_UP(len, 4) - len, captureFile);
+}
+
+// opt_endofopt, code and length both 0
+static void writeOptionEnd() {
+    static const char end[4] = {0};
+    fwrite(end, 1, sizeof(end), captureFile);
+}
+
+static UINT32 optionSize(UINT32 len) {
+    return 4 + ALIGN_UP(len, 4);
+}
+
+static void writeHeaders() {
+    const char *appl = "clumsy " CLUMSY_VERSION;
+    UINT32 word, len, ix;
+    INT64 sectionLen = -1;
+    UINT8 tsresol = 6; // microseconds
+    UINT16 major = 1, minor = 0;
+
+    len = 28 + optionSize((UINT32)strlen(appl)) + 4;
+    word = PCAPNG_SHB;
+    fwrite(&word, 4, 1, captureFile);
+    fwrite(&len, 4, 1, captureFile);
+    word = PCAPNG_BYTE_ORDER_MAGIC;
+    fwrite(&word, 4, 1, captureFile);
+    fwrite(&major, 2, 1, captureFile);
+    fwrite(&minor, 2, 1, captureFile);
+    fwrite(&sectionLen, 8, 1, captureFile);
+    writeOption(PCAPNG_SHB_USERAPPL, appl, (UINT16)strlen(appl));
+    writeOptionEnd();
+    fwrite(&len, 4, 1, captureFile);
+
+    for (ix = 0; ix < sizeof(ifaceNames) / sizeof(ifaceNames[0]); ++ix) {
+        UINT16 linkType = LINKTYPE_RAW, reserved = 0;
+        len = 16 + optionSize((UINT32)strlen(ifaceNames[ix])) + optionSize(1) + 4 + 4;
+        word = PCAPNG_IDB;
+        fwrite(&word, 4, 1, captureFile);
+        fwrite(&len, 4, 1, captureFile);
+        fwrite(&linkType, 2, 1, captureFile);
+        fwrite(&reserved, 2, 1, captureFile);
+        fwrite(&snapLen, 4, 1, captureFile);
+        writeOption(PCAPNG_IF_NAME, ifaceNames[ix], (UINT16)strlen(ifaceNames[ix]));
+        writeOption(PCAPNG_IF_TSRESOL, &tsresol, 1);
+        writeOptionEnd();
+        fwrite(&len, 4, 1, captureFile);
+    }
+}
+
+// "lag: delayed; tamper: modified" from the per module note bits
+static UINT32 formatNotes(UINT64 notes, char *buf, size_t bufLen) {
+    size_t len = 0;
+    int ix, note;
+    buf[0] = '\0';
+    for (ix = 0; ix < MODULE_CNT && len < bufLen; ++ix) {
+        UINT64 bits = (notes >> (ix * NOTE_BITS)) & ((1 << NOTE_BITS) - 1);
+        if (bits == 0) {
+            continue;
+        }
+        len += snprintf(buf + len, bufLen - len, "%s%s:", len ? "; " : "", modules[ix]->shortName);
+        for (note = 0; note < NOTE_BITS && len < bufLen; ++note) {
+            if (bits & ((UINT64)1 << note)) {
+                len += snprintf(buf + len, bufLen - len, " %s", noteNames[note]);
+            }
+        }
+    }
+    return (UINT32)(len < bufLen ? len : bufLen - 1);
+}
+
+static void writeRecord(CaptureRecord *rec) {
+    static const char zeros[4] = {0};
+    char comment[CAPTURE_COMMENT_SIZE];
+    UINT32 commentLen = formatNotes(rec->notes, comment, sizeof(comment));
+    UINT32 flags = rec->outbound ? PCAPNG_FLAG_OUTBOUND : PCAPNG_FLAG_INBOUND;
+    UINT32 word, len, iface = rec->iface, tsHigh, tsLow;
+    UINT64 ts = startWallUs;
+
+    if (rec->tick > startTick) {
+        ts += statsTicksToUs(rec->tick - startTick);
+    }
+    tsHigh = (UINT32)(ts >> 32);
+    tsLow = (UINT32)ts;
+    len = 28 + ALIGN_UP(rec->capLen, 4) + optionSize(4)
+        + (commentLen ? optionSize(commentLen) : 0) + 4 + 4;
+
+    word = PCAPNG_EPB;
+    fwrite(&word, 4, 1, captureFile);
+    fwrite(&len, 4, 1, captureFile);
+    fwrite(&iface, 4, 1, captureFile);
+    fwrite(&tsHigh, 4, 1, captureFile);
+    fwrite(&tsLow, 4, 1, captureFile);
+    fwrite(&rec->capLen, 4, 1, captureFile);
+    fwrite(&rec->origLen, 4, 1, captureFile);
+    fwrite(rec + 1, 1, rec->capLen, captureFile);
+    fwrite(zeros, 1, ALIGN_UP(rec->capLen, 4) - rec->capLen, captureFile);
+    writeOption(PCAPNG_EPB_FLAGS, &flags, 4);
+    if (commentLen) {
+        writeOption(PCAPNG_OPT_COMMENT, comment, (UINT16)commentLen);
+    }
+    writeOptionEnd();
+    fwrite(&len, 4, 1, captureFile);
+}
+
+// write out everything published so far, returns records written
+static int drainRing() {
+    UINT32 r = (UINT32)ringReadPos, w = (UINT32)InterlockedExchangeAdd(&ringWritePos, 0);
+    UINT32 toEnd;
+    CaptureRecord *rec;
+    int cnt = 0;
+    while (r != w) {
+        toEnd = ringSize - (r & ringMask);
+        if (toEnd < sizeof(CaptureRecord)) {
+            r += toEnd;
+            continue;
+        }
+        rec = (CaptureRecord*)(ring + (r & ringMask));
+        if (rec->iface != CAPTURE_PAD) {
+            writeRecord(rec);
+            ++cnt;
+        }
+        r += rec->size;
+    }
+    InterlockedExchange(&ringReadPos, (LONG)r);
+    return cnt;
+}
+
+static DWORD captureWriterLoop(LPVOID arg) {
+    BOOL dirty = FALSE;
+    UNREFERENCED_PARAMETER(arg);
+    for (;;) {
+        if (drainRing() > 0) {
+            dirty = TRUE;
+            continue;
+        }
+        if (writerStopping) {
+            break;
+        }
+        // flush when traffic pauses so the file is readable while running
+        if (dirty) {
+            fflush(captureFile);
+            dirty = FALSE;
+        }
+        Sleep(CAPTURE_IDLE_MS);
+    }
+    return 0;
+}
+
+BOOL captureStart(char buf[]) {
+    const char *path = getArg("capture"), *value;
+    UINT32 mb = CAPTURE_BUFFER_DEFAULT_MB;
+
+    if (path == NULL) {
+        return TRUE;
+    }
+    snapLen = MAX_PACKETSIZE;
+    value = getArg("capture-snaplen");
+    if (value && atoi(value) > 0 && atoi(value) < MAX_PACKETSIZE) {
+        snapLen = (UINT32)atoi(value);
+    }
+    value = getArg("capture-buffer");
+    if (value && atoi(value) > 0 && atoi(value) <= 1024) {
+        mb = (UINT32)atoi(value);
+    }
+    // ring size has to be a power of two for the masks
+    for (ringSize = 1024 * 1024; ringSize < mb * 1024 * 1024; ringSize <<= 1);
+    ringMask = ringSize - 1;
+
+    captureFile = fopen(path, "wb");
+    if (captureFile == NULL) {
+        sprintf(buf, "Failed to open capture file %.200s", path);
+        return FALSE;
+    }
+    setvbuf(captureFile, NULL, _IOFBF, CAPTURE_FILE_BUFSIZE);
+    ring = (char*)malloc(ringSize);
+    if (ring == NULL) {
+        sprintf(buf, "Failed to allocate %u bytes for capture", ringSize);
+        fclose(captureFile);
+        return FALSE;
+    }
+    ringWritePos = ringReadPos = 0;
+    droppedRecords = 0;
+    writeHeaders();
+
+    startTick = clockTicks();
+    startWallUs = wallClockUs();
+
+    writerStopping = 0;
+    writerThread = CreateThread(NULL, 1, (LPTHREAD_START_ROUTINE)captureWriterLoop, NULL, 0, NULL);
+    if (writerThread == NULL) {
+        sprintf(buf, "Failed to create capture thread (%lu)", (unsigned long)GetLastError());
+        fclose(captureFile);
+        free(ring);
+        return FALSE;
+    }
+    InterlockedExchange16(&captureOn, 1);
+    LOG("Capturing to %s, ring %u bytes", path, ringSize);
+    return TRUE;
+}
+
+// call once the engine threads are gone so no tap is running
+void captureStop() {
+    if (!captureOn) {
+        return;
+    }
+    InterlockedExchange16(&captureOn, 0);
+    InterlockedExchange16(&writerStopping, 1);
+    WaitForSingleObject(writerThread, INFINITE);
+    CloseHandle(writerThread);
+    writerThread = NULL;
+    fclose(captureFile);
+    captureFile = NULL;
+    free(ring);
+    ring = NULL;
+    LOG("Capture stopped, %ld records dropped", (long)droppedRecords);
+}
+
+UINT64 captureDroppedRecords() {
+    return (UINT64)droppedRecords;
+}
@@ -0,0 +1,241 @@
+// headless frontend, runs the packet engine and modules without iup.
+// takes the same "--key value" options as the gui, e.g.
+//   clumsy-cli --filter "outbound and loopback" --lag on --lag-time 200
+// options can also be put into a profile file given by --profile, one
+// "key: value" per line. engine throughput and latency is printed every
+// --stats-interval ms until --timeout seconds pass, ctrl-c is hit or the
+// backend's input runs out and modules have released everything.
+// with --control, settings can be changed while running, see control.c
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <signal.h>
+#endif
+#include "common.h"
+
+#define STATS_INTERVAL_DEFAULT 1000
+#define DEFAULT_FILTER "outbound and loopback"
+
+static volatile short stopRequested = 0;
+
+#ifdef _WIN32
+static BOOL WINAPI consoleCtrlHandler(DWORD ctrlType) {
+    UNREFERENCED_PARAMETER(ctrlType);
+    InterlockedIncrement16(&stopRequested);
+    return TRUE;
+}
+#else
+static void signalHandler(int sig) {
+    UNREFERENCED_PARAMETER(sig);
+    stopRequested = 1;
+}
+#endif
+
+static void usage() {
+    int ix;
+    ModuleParam *param;
+    fprintf(stderr, "clumsy-cli " CLUMSY_VERSION "\n"
+        "usage: clumsy-cli [--key value]...\n"
+        "  --filter <text>          capture filter, default \"" DEFAULT_FILTER "\"\n"
+        "  --backend <name>         windivert, mock, pcap, nfq, tun or xdp, default %s\n"
+        "  --pcap-in <file>         process a pcap offline, see pcap.c\n"
+        "  --nfq-queue <n>          linux netfilter queue to bind with --backend nfq, see nfq.c\n"
+        "  --tun-a, --tun-b <name>  tun interfaces to forward between with --backend tun, see tun.c\n"
+        "  --xdp-a, --xdp-b <name>  interfaces to bridge over af_xdp with --backend xdp, see xdp.c\n"
+        "  --clock <real|virtual>   virtual jumps between events, needs mock or pcap\n"
+        "  --seed <n>               random seed, default from the time\n"
+        "  --profile <file>         read options from file, \"key: value\" per line\n"
+        "  --stats-interval <ms>    print stats every ms, 0 to disable, default %d\n"
+        "  --timeout <seconds>      stop after seconds\n"
+        "  --scenario <file>        run timed parameter changes from file, see scenario.c\n"
+        "  --scenario-log <file>    log applied scenario steps to file instead of stdout\n"
+        "  --capture <file>         write pcapng of ingress, egress and dropped packets, see capture.c\n"
+        "  --control <name>         accept commands on a named pipe (windows) or unix socket path\n"
+        "  --module-order <a,b,..>  order modules process packets in, default lag,drop,throttle,duplicate,ood,tamper,reset,bandwidth,link\n"
+        "  --overload-budget <us>   step time before it counts as overloaded, 0 disables, default %d\n"
+        "  --overload-strikes <n>   steps in a row over budget to start bypassing, default %d\n"
+        "  --overload-hold <ms>     how long to bypass modules when overloaded, default %d\n"
+        "  --memory-budget <MB>     bytes all modules may hold packets for, 0 for no limit, default %d, see budget.c\n"
+        "  --spill-dir <dir>        keep lagged payloads in mapped files there, off the heap and the memory budget, see spill.c\n"
+        "  --compress-min <bytes>   lz4 compress held payloads at least this big on a helper thread, see compress.c\n"
+        "module options:\n",
+#ifdef _WIN32
+        "windivert",
+#else
+        "mock",
+#endif
+        STATS_INTERVAL_DEFAULT, OVERLOAD_BUDGET_DEFAULT, OVERLOAD_STRIKES_DEFAULT, OVERLOAD_HOLD_DEFAULT,
+        MEMORY_BUDGET_DEFAULT);
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        fprintf(stderr, "  --%s on|off\n", modules[ix]->shortName);
+        for (param = modules[ix]->params; param && param->name; ++param) {
+            fprintf(stderr, "    --%s-%s\n", modules[ix]->shortName, param->name);
+        }
+    }
+}
+
+static BOOL anyBuffered() {
+    int ix;
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        if (modules[ix]->buffered) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void printStatsLine(DWORD elapsedMs, DWORD intervalMs, EngineStats *last, EngineStats *now) {
+    double seconds = intervalMs / 1000.0;
+    UINT64 latencyCount = now->latencyCount - last->latencyCount;
+    int ix;
+    printf("[%8.1fs] recv %8.0f pkt/s %8.2f Mbit/s | sent %8.0f pkt/s %8.2f Mbit/s | latency avg %7.2f ms max %7.2f ms",
+        elapsedMs / 1000.0,
+        (now->recvPackets - last->recvPackets) / seconds,
+        (now->recvBytes - last->recvBytes) * 8 / seconds / 1e6,
+        (now->sentPackets - last->sentPackets) / seconds,
+        (now->sentBytes - last->sentBytes) * 8 / seconds / 1e6,
+        latencyCount ? (now->latencyUs - last->latencyUs) / 1000.0 / latencyCount : 0.0,
+        now->latencyMaxUs / 1000.0);
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        if (modules[ix]->buffered) {
+            printf(" | %s buf %ld", modules[ix]->shortName, (long)modules[ix]->buffered);
+        }
+    }
+    if (now->memoryUsed) {
+        printf(" | mem %.1f MB", now->memoryUsed / 1048576.0);
+    }
+    if (now->bypassing) {
+        printf(" | BYPASS");
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    char buf[MSG_BUFSIZE];
+    const char *value, *filter;
+    DWORD statsInterval = STATS_INTERVAL_DEFAULT, timeoutMs = 0, startTick, lastPrint, now;
+    EngineStats lastStats, stats;
+    int ix;
+
+    if (argc < 2 || !parseArgs(argc, argv)) {
+        usage();
+        return 1;
+    }
+    value = getArg("profile");
+    if (value && !loadProfile(value)) {
+        fprintf(stderr, "failed to read profile %s\n", value);
+        return 1;
+    }
+    value = getArg("backend");
+    if (value == NULL && getArg("pcap-in")) {
+        value = "pcap";
+    }
+    if (value && !divertSetBackend(value)) {
+        fprintf(stderr, "unknown backend %s\n", value);
+        return 1;
+    }
+    value = getArg("stats-interval");
+    if (value) {
+        statsInterval = (DWORD)strtoul(value, NULL, 10);
+    }
+    value = getArg("timeout");
+    if (value) {
+        timeoutMs = (DWORD)strtoul(value, NULL, 10) * 1000;
+    }
+    filter = getArg("filter");
+    if (filter == NULL) {
+        filter = DEFAULT_FILTER;
+    }
+    value = getArg("module-order");
+    if (value && !setModuleOrder(value, buf)) {
+        fprintf(stderr, "%s\n", buf);
+        return 1;
+    }
+    applyArgs();
+    value = getArg("scenario");
+    if (value && !scenarioLoad(value, buf)) {
+        fprintf(stderr, "%s\n", buf);
+        return 1;
+    }
+
+#ifdef _WIN32
+    SetConsoleCtrlHandler(consoleCtrlHandler, TRUE);
+#else
+    signal(SIGINT, signalHandler);
+    signal(SIGTERM, signalHandler);
+#endif
+    // a fixed seed with the virtual clock repeats a run exactly
+    value = getArg("seed");
+    srand(value ? (unsigned int)strtoul(value, NULL, 10) : (unsigned int)time(NULL));
+
+    if (!divertStart(filter, buf)) {
+        fprintf(stderr, "%s\n", buf);
+        return 1;
+    }
+    value = getArg("control");
+    if (value && !controlStart(value, buf)) {
+        fprintf(stderr, "%s\n", buf);
+        divertStop();
+        return 1;
+    }
+    printf("started filtering \"%s\"\n", filter);
+    fflush(stdout);
+
+    memset(&lastStats, 0, sizeof(lastStats));
+    startTick = lastPrint = GetTickCount();
+    while (!stopRequested) {
+        Sleep(50);
+        now = GetTickCount();
+        if (statsInterval && now - lastPrint >= statsInterval) {
+            divertReadStats(&stats);
+            printStatsLine(now - startTick, now - lastPrint, &lastStats, &stats);
+            lastStats = stats;
+            lastPrint = now;
+        }
+        if (timeoutMs && now - startTick >= timeoutMs) {
+            break;
+        }
+        // finite input, e.g. a pcap, stops once modules let everything out
+        if (divertInputDone() && !anyBuffered()) {
+            break;
+        }
+    }
+
+    controlStop();
+    divertStop();
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        if (*(modules[ix]->enabledFlag)) {
+            statsFormat(modules[ix], buf, MSG_BUFSIZE);
+            printf("--- %s\n%s\n", modules[ix]->shortName, buf);
+        }
+    }
+    divertReadStats(&stats);
+    printf("--- total\nrecv: %llu packets, sent: %llu packets, send failed: %llu\n",
+        (unsigned long long)stats.recvPackets, (unsigned long long)stats.sentPackets,
+        (unsigned long long)stats.sendFailed);
+    for (ix = 0; ix < 2; ++ix) {
+        printf("%s overhead: p50 %.1f us, p99 %.1f us, p99.9 %.1f us over %llu packets\n",
+            ix ? "outbound" : "inbound", stats.overheadP50Us[ix], stats.overheadP99Us[ix],
+            stats.overheadP999Us[ix], (unsigned long long)stats.overheadCount[ix]);
+    }
+    printf("fast path: %llu packets reinjected without going through modules\n",
+        (unsigned long long)stats.fastPathPackets);
+    printf("overload bypass: %llu episodes, %llu packets passed straight through\n",
+        (unsigned long long)stats.bypassEpisodes, (unsigned long long)stats.bypassPackets);
+    if (stats.compressIn) {
+        printf("compression: %llu bytes held as %llu, ratio %.3f, %.1f ms helper cpu\n",
+            (unsigned long long)stats.compressIn, (unsigned long long)stats.compressOut,
+            (double)stats.compressOut / stats.compressIn, stats.compressCpuUs / 1000.0);
+    }
+    if (getArg("capture")) {
+        printf("capture records dropped: %llu\n", (unsigned long long)stats.captureDropped);
+    }
+    divertBackendStats(buf, MSG_BUFSIZE);
+    if (buf[0]) {
+        printf("backend: %s\n", buf);
+    }
+    return 0;
+}
@@ -1,14 +1,24 @@
 #pragma once
 #include <stdio.h>
 #include <assert.h>
-#include "iup.h"
+#ifdef _WIN32
 #include "windivert.h"
+#else
+#include "posix.h"
+#endif
+#ifndef CLUMSY_HEADLESS
+#include "iup.h"
+#else
+// headless build doesn't link iup, module ui entries are left out
+typedef struct Ihandle_ Ihandle;
+#endif
 
 #define CLUMSY_VERSION "0.3"
 #define MSG_BUFSIZE 512
 #define FILTER_BUFSIZE 1024
+#define MAX_PACKETSIZE 0xFFFF
 #define NAME_SIZE 16
-#define MODULE_CNT 8
+#define MODULE_CNT 9
 #define ICON_UPDATE_MS 200
 
 #define CONTROLS_HANDLE "__CONTROLS_HANDLE"
@@ -30,6 +40,15 @@
 #define INLINE_FUNCTION __inline
 #endif
 
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#define ALIGNED(n) __declspec(align(n))
+#else
+#define THREAD_LOCAL __thread
+#define ALIGNED(n) __attribute__((aligned(n)))
+#endif
+#define CACHE_LINE_SIZE 64
+
 
 // my mingw seems missing some of the functions
 // undef all mingw linked interlock* and use __atomic gcc builtins
@@ -61,7 +80,7 @@
 
 #ifdef _DEBUG
 #define ABORT() assert(0)
-#ifdef __MINGW32__
+#if defined(__MINGW32__) || !defined(_WIN32)
 #define LOG(fmt, ...) (printf("%s: " fmt "\n", __FUNCTION__, ##__VA_ARGS__))
 #else
 static void VsLog(const char* pFmt, ...)
@@ -97,18 +116,37 @@ typedef struct _NODE {
     char *packet;
     UINT packetLen;
     WINDIVERT_ADDRESS addr;
-    DWORD timestamp; // ! timestamp isn't filled when creating node since it's only needed for lag
+    DWORD timestamp; // ! timestamp isn't filled when creating node since it's only needed by modules holding packets
+    LONGLONG recvTick; // QueryPerformanceCounter when captured, 0 for packets made up by modules
+    UINT32 intendedUs; // delay modules meant to add, the rest of the latency is overhead
+    UINT64 notes; // what modules did to it, see PACKET_NOTE
+    short frame; // packet is a frame lent by the backend's recvFrame, not malloced
+    short spilled; // packet lives in the spill store, see spill.c
+    volatile LONG packed; // packet is or may become lz4, see compress.c
+    UINT packedLen, packSlot;
     struct _NODE *prev, *next;
 } PacketNode;
 
+// per packet notes for capture, NOTE_BITS per module by its index in modules[]
+#define NOTE_DELAYED 0x1
+#define NOTE_DROPPED 0x2
+#define NOTE_DUPLICATED 0x4
+#define NOTE_MODIFIED 0x8
+#define NOTE_BITS 4
+extern int noteModuleIx; // module being processed, set by the engine
+#define PACKET_NOTE(pac, note) ((pac)->notes |= (UINT64)(note) << (noteModuleIx * NOTE_BITS))
+
 void initPacketNodeList();
 PacketNode* createNode(char* buf, UINT len, WINDIVERT_ADDRESS *addr);
+PacketNode* createFrameNode(char *frame, UINT len, WINDIVERT_ADDRESS *addr); // takes the frame, no copy
 void freeNode(PacketNode *node);
+void dropNode(PacketNode *node); // free a packet a module decided to drop
 PacketNode* popNode(PacketNode *node);
 PacketNode* insertBefore(PacketNode *node, PacketNode *target);
 PacketNode* insertAfter(PacketNode *node, PacketNode *target);
 PacketNode* appendNode(PacketNode *node);
 short isListEmpty();
+extern UINT64 packetAllocs; // mallocs made for nodes so far, read by the benchmark
 
 // shared ui handlers
 int uiSyncChance(Ihandle *ih);
@@ -117,6 +155,36 @@ int uiSyncInteger(Ihandle *ih);
 int uiSyncFixed(Ihandle *ih);
 int uiSyncInt32(Ihandle *ih);
 
+// module parameters, so they can be set without going through the ui widgets.
+// full key of a parameter is "<shortName>-<name>", same as the command line option
+#define PARAM_TOGGLE 0 // short, on/off
+#define PARAM_CHANCE 1 // short, [0-10000] set as percentage
+#define PARAM_SHORT 2 // short, clamped into [min, max]
+#define PARAM_INT32 3 // LONG, clamped into [min, max]
+#define PARAM_CHOICE 4 // short, index of one of the '|' separated names in minValue
+typedef struct {
+    const char *name;
+    short type;
+    volatile void *value;
+    const char *minValue, *maxValue; // same string macros ui uses
+} ModuleParam;
+
+
+// hot path counters, one cache line per thread slot so the threads never share a line.
+// only the owning thread writes a slot, readers sum up all slots. see stats.c
+// slot 0 is shared, then one each for the read loop, the engine, the
+// compression helper, the capture writer and scenario and control threads
+#define STATS_THREAD_SLOTS 8
+typedef struct {
+    UINT64 seen; // packets the module looked at
+    UINT64 bytes; // bytes of the seen packets
+    UINT64 dropped;
+    UINT64 delayed;
+    UINT64 duplicated;
+    UINT64 tampered;
+    UINT64 reset;
+    UINT64 cpuTicks; // QueryPerformanceCounter ticks spent in process()
+} ModuleCounters;
 
 // module
 typedef struct {
@@ -130,12 +198,16 @@ typedef struct {
     void (*startUp)(); // called when starting up the module
     void (*closeDown)(PacketNode *head, PacketNode *tail); // called when starting up the module
     short (*process)(PacketNode *head, PacketNode *tail);
+    ModuleParam *params; // terminated by a NULL name
     /*
      * Flags used during program excution. Need to be re initialized on each run
      */
     short lastEnabled; // if it is enabled on last run
     short processTriggered; // whether this module has been triggered in last step 
     Ihandle *iconHandle; // store the icon to be updated
+    ModuleCounters *counters; // per thread counter slots, assigned by statsInit()
+    volatile LONG buffered; // packets currently held by the module
+    volatile LONG bufferedBytes; // bytes of them, the heap ones charged against the memory budget
 } Module;
 
 extern Module lagModule;
@@ -146,7 +218,12 @@ extern Module dupModule;
 extern Module tamperModule;
 extern Module resetModule;
 extern Module bandwidthModule;
-extern Module* modules[MODULE_CNT]; // all modules in a list
+extern Module linkModule;
+extern Module* modules[MODULE_CNT]; // all modules in a list, in processing order
+// bumped whenever a module or direction toggle changes, the engine rebuilds
+// its table of active modules on the next step
+extern volatile LONG modulesChanged;
+#define MODULES_CHANGED() InterlockedIncrement(&modulesChanged)
 
 // status for sending packets, 
 #define SEND_STATUS_NONE 0
@@ -154,13 +231,189 @@ extern Module* modules[MODULE_CNT]; // all modules in a list
 #define SEND_STATUS_FAIL -1
 extern volatile short sendState;
 
+// module ui entry, left out on headless builds
+#ifdef CLUMSY_HEADLESS
+#define MODULE_UI(f) NULL
+#else
+#define MODULE_UI(f) f
+#endif
+
+// params
+Module* findModule(const char *shortName);
+BOOL setModuleOrder(const char *order, char buf[]); // only while the engine is stopped
+ModuleParam* findParam(Module *module, const char *name);
+BOOL paramParse(ModuleParam *param, const char *value, LONG *out);
+void paramStore(ModuleParam *param, LONG value);
+BOOL paramSet(ModuleParam *param, const char *value);
+void paramFormat(ModuleParam *param, char *buf, size_t bufLen);
+BOOL resolveKey(const char *key, ModuleParam *out);
+BOOL setByKey(const char *key, const char *value);
+void applyArgs();
+
+
+// stats
+typedef struct {
+    UINT64 seen, bytes, dropped, delayed, duplicated, tampered, reset;
+    UINT64 cpuUs; // microseconds spent in process()
+    LONG buffered, bufferedBytes;
+} ModuleStats;
+
+extern THREAD_LOCAL int statsSlot;
+#define STATS_ADD(module, counter, n) ((module).counters[statsSlot].counter += (n))
+#define STATS_SEEN(module, pac) (STATS_ADD(module, seen, 1), STATS_ADD(module, bytes, (pac)->packetLen))
+#define STATS_BUFFERED(module, n) ((module).buffered = (n))
+void statsInit();
+void statsRegisterThread();
+void statsRead(Module *module, ModuleStats *out);
+void statsFormat(Module *module, char *buf, size_t bufLen);
+UINT64 statsTicksToUs(LONGLONG ticks);
+
+// hdr style histogram, values are bucketed by their highest bit with
+// STATS_HIST_SUB linear steps below it, about 3% relative error
+#define STATS_HIST_SUB_BITS 5
+#define STATS_HIST_SUB (1 << STATS_HIST_SUB_BITS)
+#define STATS_HIST_BUCKETS (STATS_HIST_SUB * (64 - STATS_HIST_SUB_BITS + 1))
+typedef struct {
+    UINT64 count;
+    UINT64 buckets[STATS_HIST_BUCKETS];
+} StatsHistogram;
+void statsHistogramAdd(StatsHistogram *hist, UINT64 value);
+double statsHistogramPercentile(StatsHistogram *hist, double percentile);
 
 // Iup GUI
 void showStatus(const char* line);
 
+// packet backend, where packets are captured from and reinjected to
+#define RECV_STATUS_OK 0
+#define RECV_STATUS_RETRY 1 // nothing read this time
+#define RECV_STATUS_CLOSED 2 // backend has been closed, stop reading
+#define RECV_STATUS_EOF 3 // input ran out, stop reading but keep sending what's buffered
+typedef struct {
+    const char *name;
+    BOOL (*open)(const char *filter, char buf[]); // fill buf with the error on failure
+    int (*recv)(char *buf, UINT bufLen, UINT *readLen, WINDIVERT_ADDRESS *addr);
+    short (*send)(PacketNode *pnode); // returns SEND_STATUS_*
+    void (*close)(); // must make a blocking recv return RECV_STATUS_CLOSED
+    short timed; // addr.Timestamp is the packet's time in microseconds, needed by the virtual clock
+    short lockFree; // send may run outside the engine lock, needed by the fast path
+    void (*drop)(PacketNode *pnode); // a module dropped the packet, NULL if there's nothing to do
+    void (*flush)(); // after each batch of sends, NULL if sends go out right away
+    // recv that may lend out a frame of its own instead of copying into buf,
+    // NULL to use recv. a lent frame comes back through release, under the
+    // engine lock unless the backend is lockFree
+    int (*recvFrame)(char *buf, UINT bufLen, char **frame, UINT *readLen, WINDIVERT_ADDRESS *addr);
+    void (*release)(char *frame);
+    void (*stats)(char *buf, size_t bufLen); // its own counters as key=value pairs, NULL if none
+    // capture with a new filter while running, the old one keeps feeding the
+    // engine until it's drained. NULL if the backend can't
+    BOOL (*switchFilter)(const char *filter, char buf[]);
+} Backend;
+
+#ifdef _WIN32
+extern Backend windivertBackend;
+#endif
+extern Backend mockBackend;
+extern Backend pcapBackend;
+#ifdef __linux__
+extern Backend nfqBackend;
+extern Backend tunBackend;
+extern Backend xdpBackend;
+#endif
+
+// overload protection, steps slower than the budget this many times in a row
+// put the engine in bypass for the hold time
+#define OVERLOAD_BUDGET_DEFAULT (CLOCK_WAITMS / 2 * 1000) // us
+#define OVERLOAD_STRIKES_DEFAULT 3
+#define OVERLOAD_HOLD_DEFAULT 1000 // ms
+
+// memory budget of packets held by all modules, see budget.c. only call with
+// the engine lock held
+#define MEMORY_BUDGET_DEFAULT 256 // MB
+#define BUDGET_TAIL_DROP 0
+#define BUDGET_HEAD_DROP 1
+#define BUDGET_RELEASE 2
+#define BUDGET_POLICIES "tail-drop|head-drop|release" // PARAM_CHOICE names of the above
+void budgetReset(); // reads --memory-budget, on each start
+void budgetCharge(Module *module, PacketNode *pac); // module now holds pac, spill it first
+void budgetRefund(Module *module, PacketNode *pac); // and no longer does
+BOOL budgetExceeded();
+void budgetRead(UINT64 *used, UINT64 *budget);
+
+// spill store for payloads held long, see spill.c. only call with the engine
+// lock held
+void spillStart(); // reads --spill-dir, on each start
+void spillStop(); // once every node is freed
+BOOL spillStore(PacketNode *pac); // FALSE if pac stays where it is
+void spillFree(PacketNode *pac); // called by freeNode
+void spillRead(UINT64 *bytes, int *segmentsMapped);
+
+// compression of held payloads on a helper thread, see compress.c. queue and
+// take only with the engine lock held
+BOOL compressStart(char buf[]); // reads --compress-min, on each start
+void compressStop(); // once every packet is taken back
+void compressQueue(PacketNode *pac); // pac is to be held a while
+void compressTake(PacketNode *pac); // plain payload again, before pac leaves
+void compressDrop(PacketNode *pac); // freeing pac, packed or not
+void compressRead(UINT64 *in, UINT64 *out, UINT64 *cpuUs);
+
+// engine throughput and latency, latency is from capture to reinjection
+typedef struct {
+    UINT64 recvPackets, recvBytes;
+    UINT64 sentPackets, sentBytes, sendFailed;
+    UINT64 latencyCount, latencyUs, latencyMaxUs;
+    UINT64 captureDropped; // capture records lost to a full ring
+    // overload protection, see divert.c
+    UINT64 bypassEpisodes, bypassPackets;
+    BOOL bypassing;
+    UINT64 fastPathPackets; // reinjected as read, no module selected them
+    UINT64 memoryUsed, memoryBudget; // heap bytes of held packets, budget 0 if unlimited
+    UINT64 spilledBytes; // held in the spill store besides
+    int spillSegments;
+    UINT64 compressIn, compressOut, compressCpuUs; // payload bytes before and after, helper cpu
+    // latency clumsy adds beyond what modules meant to, 0 inbound and 1 outbound
+    UINT64 overheadCount[2];
+    double overheadP50Us[2], overheadP99Us[2], overheadP999Us[2];
+} EngineStats;
+
 // WinDivert
+BOOL divertSetBackend(const char *name);
+void divertUseBackend(Backend *custom); // for harnesses wrapping a backend
 int divertStart(const char * filter, char buf[]);
 void divertStop();
+BOOL divertSwitchFilter(const char *filter, char buf[]); // no gap in capture, modules keep what they hold
+void divertReadStats(EngineStats *out);
+BOOL divertInputDone(); // backend has no more packets to give
+BOOL divertBypassing(); // overloaded, modules are skipped for now
+void divertDropped(PacketNode *pnode); // tells the backend, called by dropNode
+void divertReleaseFrame(char *frame); // gives a lent frame back, called by freeNode
+void divertBackendStats(char *buf, size_t bufLen); // empty if the backend keeps none
+BOOL divertLock();
+void divertUnlock();
+void divertBenchStep(); // one step on the list as it is, no threads or lock
+
+// timing accuracy harness of clumsy-bench, returns the exit code
+int accuracyRun();
+
+// pcapng capture taps, only call with the engine lock held
+#define CAPTURE_INGRESS 0
+#define CAPTURE_EGRESS 1
+#define CAPTURE_DROPPED 2
+extern volatile short captureOn;
+BOOL captureStart(char buf[]);
+void captureStop();
+void captureTap(int iface, PacketNode *pnode);
+UINT64 captureDroppedRecords();
+#define CAPTURE_TAP(iface, pnode) (captureOn ? captureTap(iface, pnode) : (void)0)
+
+// timed parameter changes, started and stopped along with capture
+BOOL scenarioLoad(const char *path, char buf[]);
+void scenarioStart();
+void scenarioStop();
+BOOL scenarioTick(UINT64 nowUs, UINT64 *dueUs);
+
+// control channel, named pipe on windows and unix socket elsewhere
+BOOL controlStart(const char *name, char buf[]);
+void controlStop();
 
 // utils
 // STR to convert int macro to string
@@ -181,10 +434,27 @@ BOOL checkDirection(BOOL outboundPacket, short handleInbound, short handleOutbou
 void startTimePeriod();
 void endTimePeriod();
 
+// engine clock, modules read time through here instead of timeGetTime and
+// QueryPerformanceCounter. the virtual clock is driven by the engine from one
+// event to the next, see divertVirtualLoop
+// real clock step interval
+// FIXME does this need to be larger then the time to process the list?
+#define CLOCK_WAITMS 40
+void clockStart(BOOL virtualClock);
+BOOL clockIsVirtual();
+DWORD clockMs();
+LONGLONG clockTicks(); // QueryPerformanceCounter units
+UINT64 clockVirtualUs();
+void clockAdvance(UINT64 us);
+void clockWakeAt(DWORD ms);
+BOOL clockTakeWake(UINT64 *us);
+
 // elevate
+#ifdef _WIN32
 BOOL IsElevated();
 BOOL IsRunAsAdmin();
 BOOL tryElevate(HWND hWnd, BOOL silent);
+#endif
 
 // icons
 extern const unsigned char icon8x8[8*8];
@@ -193,4 +463,8 @@ extern const unsigned char icon8x8[8*8];
 extern BOOL parameterized;
 void setFromParameter(Ihandle *ih, const char *field, const char *key);
 BOOL parseArgs(int argc, char* argv[]);
+const char* getArg(const char *key);
+BOOL loadProfile(const char *path);
+const char* mapFileRead(const char *path, size_t *len);
+void unmapFile(const char *data, size_t len);
 
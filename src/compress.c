@@ -0,0 +1,160 @@
+// payload compression for packets lag and throttle hold. with --compress-min
+// set, payloads of at least that many bytes are handed to a helper thread as
+// they're queued, which swaps them for an lz4 block (see lz4.c) when that
+// saves an eighth or more. they're decompressed as they're released. a packet
+// the helper hasn't got to yet is simply taken back, so release deadlines
+// never wait on compression, only on the one packet being compressed.
+// queue and take are only called with the engine lock held
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "common.h"
+
+// in flight packets, more than this and new ones stay as they are
+#define COMPRESS_RING 4096
+#define COMPRESS_IDLE_MS 1
+#define LZ4_BOUND(len) ((len) + (len) / 255 + 16)
+
+#define PACK_NONE 0
+#define PACK_QUEUED 1 // in the ring or being compressed, the helper owns the payload
+#define PACK_DONE 2 // packet holds packedLen bytes of lz4
+
+// written by the engine and cleared by whoever claims the packet first
+static PacketNode * volatile ring[COMPRESS_RING];
+static volatile LONG ringHead, ringTail;
+static volatile short stopping;
+static HANDLE helperThread;
+static UINT compressMin;
+// helper thread only, read without lock for display
+static UINT64 bytesIn, bytesOut, cpuTicks;
+
+int lz4Compress(const char *src, int srcLen, char *dst, int dstCap);
+int lz4Decompress(const char *src, int srcLen, char *dst, int dstLen);
+
+static void compressNode(PacketNode *pac) {
+    static char buf[LZ4_BOUND(MAX_PACKETSIZE)];
+    LARGE_INTEGER start, end;
+    char *packed = NULL;
+    int len;
+
+    QueryPerformanceCounter(&start);
+    len = lz4Compress(pac->packet, (int)pac->packetLen, buf, (int)(pac->packetLen - pac->packetLen / 8));
+    if (len > 0 && (packed = (char*)malloc(len)) != NULL) {
+        memcpy(packed, buf, len);
+        free(pac->packet);
+        pac->packet = packed;
+        pac->packedLen = (UINT)len;
+    }
+    QueryPerformanceCounter(&end);
+    bytesIn += pac->packetLen;
+    bytesOut += packed ? (UINT)len : pac->packetLen;
+    cpuTicks += end.QuadPart - start.QuadPart;
+    // publishes the payload swap to the engine
+    InterlockedExchange(&pac->packed, packed ? PACK_DONE : PACK_NONE);
+}
+
+static DWORD compressLoop(LPVOID arg) {
+    PacketNode *pac;
+    UNREFERENCED_PARAMETER(arg);
+    while (!stopping) {
+        if (ringHead == ringTail) {
+            Sleep(COMPRESS_IDLE_MS);
+            continue;
+        }
+        // the engine clears the slot when it takes a packet back first
+        pac = (PacketNode*)InterlockedExchangePointer((void * volatile*)&ring[(UINT)ringHead % COMPRESS_RING], NULL);
+        if (pac) {
+            compressNode(pac);
+        }
+        InterlockedIncrement(&ringHead);
+    }
+    return 0;
+}
+
+BOOL compressStart(char buf[]) {
+    const char *value = getArg("compress-min");
+    compressMin = value ? (UINT)strtoul(value, NULL, 10) : 0;
+    ringHead = ringTail = 0;
+    bytesIn = bytesOut = cpuTicks = 0;
+    stopping = 0;
+    if (compressMin == 0) {
+        return TRUE;
+    }
+    helperThread = CreateThread(NULL, 1, (LPTHREAD_START_ROUTINE)compressLoop, NULL, 0, NULL);
+    if (helperThread == NULL) {
+        sprintf(buf, "Failed to create compression thread (%lu)", (unsigned long)GetLastError());
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// once every packet has been taken back
+void compressStop() {
+    if (helperThread == NULL) {
+        return;
+    }
+    InterlockedIncrement16(&stopping);
+    WaitForSingleObject(helperThread, INFINITE);
+    CloseHandle(helperThread);
+    helperThread = NULL;
+}
+
+void compressQueue(PacketNode *pac) {
+    UINT slot = (UINT)ringTail;
+    // lent frames and spilled payloads aren't the heap's to free
+    if (helperThread == NULL || pac->packetLen < compressMin || pac->frame || pac->spilled) {
+        return;
+    }
+    if (slot - (UINT)ringHead >= COMPRESS_RING) {
+        return;
+    }
+    pac->packed = PACK_QUEUED;
+    pac->packSlot = slot % COMPRESS_RING;
+    ring[pac->packSlot] = pac;
+    InterlockedIncrement(&ringTail);
+}
+
+// gets the packet off the helper, TRUE if it holds lz4
+static BOOL claim(PacketNode *pac) {
+    // still waiting in the ring, the helper skips the slot
+    if (InterlockedCompareExchangePointer((void * volatile*)&ring[pac->packSlot], NULL, pac) == pac) {
+        pac->packed = PACK_NONE;
+        return FALSE;
+    }
+    while (pac->packed == PACK_QUEUED) {
+        Sleep(0);
+    }
+    return pac->packed == PACK_DONE;
+}
+
+// back to a plain payload, before the packet is sent or looked at
+void compressTake(PacketNode *pac) {
+    char *plain;
+    if (pac->packed == PACK_NONE) {
+        return;
+    }
+    if (claim(pac)) {
+        plain = (char*)malloc(pac->packetLen);
+        if (lz4Decompress(pac->packet, (int)pac->packedLen, plain, (int)pac->packetLen) != (int)pac->packetLen) {
+            LOG("Fatal: failed to decompress a held packet.");
+            ABORT();
+        }
+        free(pac->packet);
+        pac->packet = plain;
+        pac->packed = PACK_NONE;
+    }
+}
+
+// the packet is being freed, the lz4 buffer goes like a plain one
+void compressDrop(PacketNode *pac) {
+    if (pac->packed != PACK_NONE) {
+        claim(pac);
+        pac->packed = PACK_NONE;
+    }
+}
+
+void compressRead(UINT64 *in, UINT64 *out, UINT64 *cpuUs) {
+    *in = bytesIn;
+    *out = bytesOut;
+    *cpuUs = statsTicksToUs((LONGLONG)cpuTicks);
+}
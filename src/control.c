@@ -0,0 +1,430 @@
+// control channel to drive modules while capture keeps running.
+// listens on a named pipe on windows (\\.\pipe\<name>) and a unix socket
+// elsewhere, one client at a time. line based, one reply line per request:
+//   ping                          -> ok
+//   get <key>                     -> ok <value>
+//   set <key> <value> [<key> <value>...] -> ok
+//   stats [<shortName>]           -> ok <name>=<value>...
+// failures reply "err <reason>". keys are the same as command line options.
+// all pairs of one set land between two engine steps, and stats are read
+// with the engine held so counters are consistent with each other.
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "common.h"
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#define CONTROL_LINE_SIZE 1024
+#define CONTROL_REPLY_SIZE 4096
+#define CONTROL_MAX_PAIRS 32
+
+static HANDLE controlThread;
+static volatile short controlStopping;
+#ifdef _WIN32
+typedef HANDLE Conn;
+static char pipeName[MSG_BUFSIZE];
+static HANDLE firstPipe;
+#else
+typedef int Conn;
+static char socketPath[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static int listenFd = -1;
+static volatile int clientFd = -1;
+#endif
+
+static int splitWords(char *line, char *words[], int maxWords) {
+    int cnt = 0;
+    char *p = line;
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == '\r') {
+            *p++ = '\0';
+        }
+        if (*p == '\0' || cnt == maxWords) {
+            return *p == '\0' ? cnt : -1;
+        }
+        words[cnt++] = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r') {
+            ++p;
+        }
+    }
+}
+
+static void cmdSet(char *words[], int cnt, char *reply, size_t replyLen) {
+    ModuleParam params[CONTROL_MAX_PAIRS];
+    LONG values[CONTROL_MAX_PAIRS];
+    int ix, pairs = (cnt - 1) / 2;
+    BOOL locked;
+
+    if (cnt < 3 || (cnt - 1) % 2 != 0) {
+        snprintf(reply, replyLen, "err usage: set <key> <value> [<key> <value>...]");
+        return;
+    }
+    // validate everything first so a bad pair leaves nothing half applied
+    for (ix = 0; ix < pairs; ++ix) {
+        const char *key = words[1 + ix * 2], *value = words[2 + ix * 2];
+        if (!resolveKey(key, &params[ix])) {
+            snprintf(reply, replyLen, "err unknown key %s", key);
+            return;
+        }
+        if (!paramParse(&params[ix], value, &values[ix])) {
+            snprintf(reply, replyLen, "err invalid value for %s: %s", key, value);
+            return;
+        }
+    }
+    locked = divertLock();
+    for (ix = 0; ix < pairs; ++ix) {
+        paramStore(&params[ix], values[ix]);
+    }
+    if (locked) {
+        divertUnlock();
+    }
+    for (ix = 0; ix < pairs; ++ix) {
+        LOG("control: %s set to %s", words[1 + ix * 2], words[2 + ix * 2]);
+    }
+    snprintf(reply, replyLen, "ok");
+}
+
+static void cmdGet(char *words[], int cnt, char *reply, size_t replyLen) {
+    ModuleParam param;
+    char value[NAME_SIZE];
+    if (cnt != 2) {
+        snprintf(reply, replyLen, "err usage: get <key>");
+        return;
+    }
+    if (!resolveKey(words[1], &param)) {
+        snprintf(reply, replyLen, "err unknown key %s", words[1]);
+        return;
+    }
+    paramFormat(&param, value, sizeof(value));
+    snprintf(reply, replyLen, "ok %s", value);
+}
+
+static size_t appendModuleStats(Module *module, BOOL prefixed, char *buf, size_t bufLen) {
+    ModuleStats stats;
+    const char *prefix = prefixed ? module->shortName : "";
+    const char *dot = prefixed ? "." : "";
+    statsRead(module, &stats);
+    return snprintf(buf, bufLen,
+        " %s%senabled=%d %s%sseen=%llu %s%sbytes=%llu %s%sdropped=%llu %s%sdelayed=%llu"
+        " %s%sduplicated=%llu %s%stampered=%llu %s%sreset=%llu %s%sbuffered=%ld %s%sbuffered_bytes=%ld"
+        " %s%scpu_us=%llu",
+        prefix, dot, *(module->enabledFlag) ? 1 : 0,
+        prefix, dot, (unsigned long long)stats.seen,
+        prefix, dot, (unsigned long long)stats.bytes,
+        prefix, dot, (unsigned long long)stats.dropped,
+        prefix, dot, (unsigned long long)stats.delayed,
+        prefix, dot, (unsigned long long)stats.duplicated,
+        prefix, dot, (unsigned long long)stats.tampered,
+        prefix, dot, (unsigned long long)stats.reset,
+        prefix, dot, (long)stats.buffered,
+        prefix, dot, (long)stats.bufferedBytes,
+        prefix, dot, (unsigned long long)stats.cpuUs);
+}
+
+static void cmdStats(char *words[], int cnt, char *reply, size_t replyLen) {
+    EngineStats engine;
+    char backendStats[MSG_BUFSIZE];
+    Module *module = NULL;
+    size_t len;
+    BOOL locked;
+    int ix;
+
+    if (cnt > 2) {
+        snprintf(reply, replyLen, "err usage: stats [<shortName>]");
+        return;
+    }
+    if (cnt == 2 && (module = findModule(words[1])) == NULL) {
+        snprintf(reply, replyLen, "err unknown module %s", words[1]);
+        return;
+    }
+
+    len = snprintf(reply, replyLen, "ok");
+    locked = divertLock();
+    if (module) {
+        len += appendModuleStats(module, FALSE, reply + len, replyLen - len);
+    } else {
+        divertReadStats(&engine);
+        len += snprintf(reply + len, replyLen - len,
+            " recv_packets=%llu recv_bytes=%llu sent_packets=%llu sent_bytes=%llu send_failed=%llu"
+            " latency_avg_us=%llu latency_max_us=%llu"
+            " overhead_in_p50_us=%.1f overhead_in_p99_us=%.1f overhead_in_p999_us=%.1f"
+            " overhead_out_p50_us=%.1f overhead_out_p99_us=%.1f overhead_out_p999_us=%.1f"
+            " bypass_episodes=%llu bypass_packets=%llu bypassing=%d fast_path_packets=%llu"
+            " memory_used_bytes=%llu memory_budget_bytes=%llu spilled_bytes=%llu spill_segments=%d"
+            " compress_in_bytes=%llu compress_out_bytes=%llu compress_cpu_us=%llu",
+            (unsigned long long)engine.recvPackets, (unsigned long long)engine.recvBytes,
+            (unsigned long long)engine.sentPackets, (unsigned long long)engine.sentBytes,
+            (unsigned long long)engine.sendFailed,
+            (unsigned long long)(engine.latencyCount ? engine.latencyUs / engine.latencyCount : 0),
+            (unsigned long long)engine.latencyMaxUs,
+            engine.overheadP50Us[0], engine.overheadP99Us[0], engine.overheadP999Us[0],
+            engine.overheadP50Us[1], engine.overheadP99Us[1], engine.overheadP999Us[1],
+            (unsigned long long)engine.bypassEpisodes, (unsigned long long)engine.bypassPackets,
+            engine.bypassing ? 1 : 0, (unsigned long long)engine.fastPathPackets,
+            (unsigned long long)engine.memoryUsed, (unsigned long long)engine.memoryBudget,
+            (unsigned long long)engine.spilledBytes, engine.spillSegments,
+            (unsigned long long)engine.compressIn, (unsigned long long)engine.compressOut,
+            (unsigned long long)engine.compressCpuUs);
+        divertBackendStats(backendStats, MSG_BUFSIZE);
+        if (backendStats[0] && len < replyLen) {
+            len += snprintf(reply + len, replyLen - len, " %s", backendStats);
+        }
+        for (ix = 0; ix < MODULE_CNT && len < replyLen; ++ix) {
+            len += appendModuleStats(modules[ix], TRUE, reply + len, replyLen - len);
+        }
+    }
+    if (locked) {
+        divertUnlock();
+    }
+}
+
+// run one request line, reply is written without the trailing newline
+static void controlExecute(char *line, char *reply, size_t replyLen) {
+    char *words[CONTROL_MAX_PAIRS * 2 + 1];
+    int cnt = splitWords(line, words, sizeof(words) / sizeof(words[0]));
+
+    if (cnt < 0) {
+        snprintf(reply, replyLen, "err too many arguments");
+    } else if (cnt == 0) {
+        snprintf(reply, replyLen, "err empty request");
+    } else if (strcmp(words[0], "ping") == 0) {
+        snprintf(reply, replyLen, "ok");
+    } else if (strcmp(words[0], "set") == 0) {
+        cmdSet(words, cnt, reply, replyLen);
+    } else if (strcmp(words[0], "get") == 0) {
+        cmdGet(words, cnt, reply, replyLen);
+    } else if (strcmp(words[0], "stats") == 0) {
+        cmdStats(words, cnt, reply, replyLen);
+    } else {
+        snprintf(reply, replyLen, "err unknown command %s", words[0]);
+    }
+}
+
+#ifdef _WIN32
+static int connRead(Conn conn, char *buf, int len) {
+    DWORD readLen;
+    if (!ReadFile(conn, buf, len, &readLen, NULL)) {
+        return -1;
+    }
+    return (int)readLen;
+}
+
+static BOOL connWrite(Conn conn, const char *buf, int len) {
+    DWORD written;
+    return WriteFile(conn, buf, len, &written, NULL) && (int)written == len;
+}
+#else
+static int connRead(Conn conn, char *buf, int len) {
+    int readLen;
+    do {
+        readLen = (int)read(conn, buf, len);
+    } while (readLen < 0 && errno == EINTR);
+    return readLen;
+}
+
+static BOOL connWrite(Conn conn, const char *buf, int len) {
+    int written;
+    while (len > 0) {
+        written = (int)send(conn, buf, len, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written <= 0) {
+            return FALSE;
+        }
+        buf += written;
+        len -= written;
+    }
+    return TRUE;
+}
+#endif
+
+// read requests until the client goes away
+static void serveClient(Conn conn) {
+    char line[CONTROL_LINE_SIZE], reply[CONTROL_REPLY_SIZE];
+    int lineLen = 0, readLen, ix, start;
+    BOOL overflow = FALSE;
+
+    while (!controlStopping) {
+        readLen = connRead(conn, line + lineLen, CONTROL_LINE_SIZE - lineLen);
+        if (readLen <= 0) {
+            return;
+        }
+        readLen += lineLen;
+        for (ix = lineLen, start = 0; ix < readLen; ++ix) {
+            if (line[ix] != '\n') {
+                continue;
+            }
+            line[ix] = '\0';
+            if (overflow) {
+                snprintf(reply, sizeof(reply), "err request too long");
+                overflow = FALSE;
+            } else {
+                controlExecute(line + start, reply, sizeof(reply) - 1);
+            }
+            strcat(reply, "\n");
+            if (!connWrite(conn, reply, (int)strlen(reply))) {
+                return;
+            }
+            start = ix + 1;
+        }
+        lineLen = readLen - start;
+        memmove(line, line + start, lineLen);
+        if (lineLen == CONTROL_LINE_SIZE) {
+            // drop the rest of an overlong line and reply once it ends
+            overflow = TRUE;
+            lineLen = 0;
+        }
+    }
+}
+
+#ifdef _WIN32
+static HANDLE createPipe() {
+    return CreateNamedPipeA(pipeName, PIPE_ACCESS_DUPLEX,
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        1, CONTROL_REPLY_SIZE, CONTROL_LINE_SIZE, 0, NULL);
+}
+
+static DWORD controlLoop(LPVOID arg) {
+    HANDLE pipe = firstPipe;
+    UNREFERENCED_PARAMETER(arg);
+
+    while (!controlStopping) {
+        if (pipe == INVALID_HANDLE_VALUE) {
+            pipe = createPipe();
+            if (pipe == INVALID_HANDLE_VALUE) {
+                LOG("Failed to create control pipe (%lu)", (unsigned long)GetLastError());
+                return 1;
+            }
+        }
+        if (ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED) {
+            serveClient(pipe);
+            DisconnectNamedPipe(pipe);
+        }
+        CloseHandle(pipe);
+        pipe = INVALID_HANDLE_VALUE;
+    }
+    return 0;
+}
+
+BOOL controlStart(const char *name, char buf[]) {
+    if (strncmp(name, "\\\\", 2) == 0) {
+        snprintf(pipeName, sizeof(pipeName), "%s", name);
+    } else {
+        snprintf(pipeName, sizeof(pipeName), "\\\\.\\pipe\\%s", name);
+    }
+    // first instance is created here so name clashes are reported to the caller
+    firstPipe = createPipe();
+    if (firstPipe == INVALID_HANDLE_VALUE) {
+        sprintf(buf, "Failed to create control pipe %s (%lu)", pipeName, (unsigned long)GetLastError());
+        return FALSE;
+    }
+    controlStopping = 0;
+    controlThread = CreateThread(NULL, 1, (LPTHREAD_START_ROUTINE)controlLoop, NULL, 0, NULL);
+    if (controlThread == NULL) {
+        sprintf(buf, "Failed to create control thread (%lu)", (unsigned long)GetLastError());
+        CloseHandle(firstPipe);
+        return FALSE;
+    }
+    LOG("Control channel listening on %s", pipeName);
+    return TRUE;
+}
+
+void controlStop() {
+    if (controlThread == NULL) {
+        return;
+    }
+    InterlockedExchange16(&controlStopping, 1);
+    // the loop is blocked in pipe io most of the time, keep kicking it until it exits
+    do {
+        CancelSynchronousIo(controlThread);
+    } while (WaitForSingleObject(controlThread, 50) == WAIT_TIMEOUT);
+    CloseHandle(controlThread);
+    controlThread = NULL;
+}
+#else
+static DWORD controlLoop(LPVOID arg) {
+    int fd;
+    UNREFERENCED_PARAMETER(arg);
+
+    while (!controlStopping) {
+        fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (!controlStopping) {
+                LOG("Failed to accept on control socket (%d)", errno);
+            }
+            return 1;
+        }
+        clientFd = fd;
+        if (!controlStopping) {
+            serveClient(fd);
+        }
+        clientFd = -1;
+        close(fd);
+    }
+    return 0;
+}
+
+BOOL controlStart(const char *name, char buf[]) {
+    struct sockaddr_un addr;
+
+    if (strlen(name) >= sizeof(addr.sun_path)) {
+        sprintf(buf, "Control socket path is too long: %s", name);
+        return FALSE;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, name);
+    strcpy(socketPath, name);
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        sprintf(buf, "Failed to create control socket (%d)", errno);
+        return FALSE;
+    }
+    // a stale socket file from a previous run would fail the bind
+    unlink(socketPath);
+    if (bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 4) < 0) {
+        sprintf(buf, "Failed to listen on control socket %s (%d)", socketPath, errno);
+        close(listenFd);
+        listenFd = -1;
+        return FALSE;
+    }
+    controlStopping = 0;
+    controlThread = CreateThread(NULL, 1, (LPTHREAD_START_ROUTINE)controlLoop, NULL, 0, NULL);
+    if (controlThread == NULL) {
+        sprintf(buf, "Failed to create control thread (%lu)", (unsigned long)GetLastError());
+        close(listenFd);
+        listenFd = -1;
+        return FALSE;
+    }
+    LOG("Control channel listening on %s", socketPath);
+    return TRUE;
+}
+
+void controlStop() {
+    int fd;
+    if (controlThread == NULL) {
+        return;
+    }
+    InterlockedExchange16(&controlStopping, 1);
+    // shutdown wakes up blocking accept and read
+    shutdown(listenFd, SHUT_RDWR);
+    fd = clientFd;
+    if (fd >= 0) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    WaitForSingleObject(controlThread, INFINITE);
+    CloseHandle(controlThread);
+    controlThread = NULL;
+    close(listenFd);
+    listenFd = -1;
+    unlink(socketPath);
+}
+#endif
@@ -1,22 +1,79 @@
 #include <stdlib.h>
 #include <memory.h>
+#ifdef _WIN32
 #include <winsock2.h>
 #include <Ws2tcpip.h>
-#include "windivert.h"
+#else
+#include <arpa/inet.h>
+#endif
 #include "common.h"
 #define DIVERT_PRIORITY 0
-#define MAX_PACKETSIZE 0xFFFF
 #define READ_TIME_PER_STEP 3
-// FIXME does this need to be larger then the time to process the list?
-#define CLOCK_WAITMS 40
 #define QUEUE_LEN 2 << 10
 #define QUEUE_TIME 2 << 9 
 
-static HANDLE divertHandle;
+// ! the order decides which module get processed first
+Module* modules[MODULE_CNT] = {
+    &lagModule,
+    &dropModule,
+    &throttleModule,
+    &dupModule,
+    &oodModule,
+    &tamperModule,
+    &resetModule,
+	&bandwidthModule,
+    &linkModule,
+};
+
+volatile short sendState = SEND_STATUS_NONE;
+int noteModuleIx = 0;
+volatile LONG modulesChanged;
+
+static Backend *backends[] = {
+#ifdef _WIN32
+    &windivertBackend,
+#endif
+    &mockBackend,
+    &pcapBackend,
+#ifdef __linux__
+    &nfqBackend,
+    &tunBackend,
+    &xdpBackend,
+#endif
+    NULL
+};
+#ifdef _WIN32
+static Backend *backend = &windivertBackend;
+#else
+static Backend *backend = &mockBackend;
+#endif
+
+// only touched in critical region, read without lock for display
+static EngineStats engineStats;
+static LONGLONG latencyTicks, latencyMaxTicks;
+static StatsHistogram overhead[2];
+// while bypassing, packets are reinjected as read and modules are shut down
+static LONGLONG overloadBudgetTicks, overloadHoldTicks, bypassUntil;
+static int overloadStrikes, overloadStrikesMax;
+static volatile short bypassing;
+// fast path, packets no module would touch skip the list and the lock. the
+// counters are only written by the read loop
+static volatile short *directionFlags[MODULE_CNT][2];
+static UINT64 fastPackets, fastBytes, fastFailed, fastSentBytes;
+// modules a step runs, in order, with their index in modules[]. rebuilt by
+// the first step after modulesChanged moves, not polled every step
+static Module *activeModules[MODULE_CNT];
+static int activeIx[MODULE_CNT], activeCount;
+static LONG builtChanges;
+// any active module selects inbound (0) or outbound (1) packets
+static volatile short directionTaken[2];
+
 static volatile short stopLooping;
+static volatile short inputDone;
 static HANDLE loopThread, clockThread, mutex;
 
 static DWORD divertReadLoop(LPVOID arg);
+static DWORD divertVirtualLoop(LPVOID arg);
 static DWORD divertClockLoop(LPVOID arg);
 
 // not to put these in common.h since modules shouldn't see these
@@ -77,11 +134,15 @@ void dumpPacket(char *buf, int len, PWINDIVERT_ADDRESS paddr) {
 #define dumpPacket(x, y, z)
 #endif
 
-int divertStart(const char *filter, char buf[]) {
-    int ix;
+#ifdef _WIN32
+// a filter switch leaves the replaced handle draining, the read loop takes
+// what was queued on it before moving on to divertHandle
+static HANDLE volatile divertHandle, drainHandle;
+static INT16 divertPriority;
 
-    divertHandle = WinDivertOpen(filter, WINDIVERT_LAYER_NETWORK, DIVERT_PRIORITY, 0);
-    if (divertHandle == INVALID_HANDLE_VALUE) {
+static HANDLE windivertOpenHandle(const char *filter, INT16 priority, char buf[]) {
+    HANDLE handle = WinDivertOpen(filter, WINDIVERT_LAYER_NETWORK, priority, 0);
+    if (handle == INVALID_HANDLE_VALUE) {
         DWORD lastError = GetLastError();
         if (lastError == ERROR_INVALID_PARAMETER) {
             strcpy(buf, "Failed to start filtering : filter syntax error.");
@@ -89,13 +150,219 @@ int divertStart(const char *filter, char buf[]) {
             sprintf(buf, "Failed to start filtering : failed to open device (code:%lu).\n"
                 "Make sure you run clumsy as Administrator.", lastError);
         }
-        return FALSE;
+        return handle;
     }
-    LOG("Divert opened handle.");
+    LOG("Divert opened handle at priority %d.", (int)priority);
 
-    WinDivertSetParam(divertHandle, WINDIVERT_PARAM_QUEUE_LENGTH, QUEUE_LEN);
-    WinDivertSetParam(divertHandle, WINDIVERT_PARAM_QUEUE_TIME, QUEUE_TIME);
+    WinDivertSetParam(handle, WINDIVERT_PARAM_QUEUE_LENGTH, QUEUE_LEN);
+    WinDivertSetParam(handle, WINDIVERT_PARAM_QUEUE_TIME, QUEUE_TIME);
     LOG("WinDivert internal queue Len: %d, queue time: %d", QUEUE_LEN, QUEUE_TIME);
+    return handle;
+}
+
+static BOOL windivertOpen(const char *filter, char buf[]) {
+    divertPriority = DIVERT_PRIORITY;
+    drainHandle = NULL;
+    divertHandle = windivertOpenHandle(filter, divertPriority, buf);
+    return divertHandle != INVALID_HANDLE_VALUE;
+}
+
+// make before break. the new handle opens one priority above the old one so
+// it gets every packet first, then the old handle stops receiving and the read
+// loop empties its queue and closes it. there's no gap, but for the short
+// while both handles are open, packets the new one reinjects go on to the old
+// one and are impaired twice
+static BOOL windivertSwitchFilter(const char *filter, char buf[]) {
+    HANDLE handle, oldHandle;
+    if (drainHandle != NULL) {
+        strcpy(buf, "Still draining the last filter, try again in a moment.");
+        return FALSE;
+    }
+    if (divertPriority >= WINDIVERT_PRIORITY_HIGHEST) {
+        strcpy(buf, "Out of WinDivert priorities, stop and start again to switch filters.");
+        return FALSE;
+    }
+    handle = windivertOpenHandle(filter, divertPriority + 1, buf);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+    ++divertPriority;
+    oldHandle = divertHandle;
+    drainHandle = oldHandle;
+    divertHandle = handle;
+    if (!WinDivertShutdown(oldHandle, WINDIVERT_SHUTDOWN_RECV)) {
+        LOG("Failed to shut down old handle (%lu), closing it.", (unsigned long)GetLastError());
+        if (InterlockedExchangePointer(&drainHandle, NULL) == oldHandle) {
+            WinDivertClose(oldHandle);
+        }
+    }
+    return TRUE;
+}
+
+static int windivertRecv(char *buf, UINT bufLen, UINT *readLen, WINDIVERT_ADDRESS *addr) {
+    HANDLE handle = drainHandle ? drainHandle : divertHandle;
+    if (!WinDivertRecv(handle, buf, bufLen, readLen, addr)) {
+        DWORD lastError = GetLastError();
+        if (handle != divertHandle && lastError == ERROR_NO_DATA) {
+            // shut down and emptied, whoever swaps it out closes it
+            LOG("Old filter drained, reading the new one.");
+            if (InterlockedExchangePointer(&drainHandle, NULL) == handle) {
+                WinDivertClose(handle);
+            }
+            return RECV_STATUS_RETRY;
+        }
+        if (lastError == ERROR_INVALID_HANDLE || lastError == ERROR_OPERATION_ABORTED) {
+            // treat closing handle as quit
+            LOG("Handle died or operation aborted. Exit loop.");
+            return RECV_STATUS_CLOSED;
+        }
+        LOG("Failed to recv a packet. (%lu)", (unsigned long)GetLastError());
+        return RECV_STATUS_RETRY;
+    }
+    return RECV_STATUS_OK;
+}
+
+static short windivertSend(PacketNode *pnode) {
+    UINT sendLen = 0;
+    // FIXME inbound injection on any kind of packet is failing with a very high percentage
+    //       need to contact windivert auther and wait for next release
+    if (!WinDivertSend(divertHandle, pnode->packet, pnode->packetLen, &sendLen, &(pnode->addr))) {
+        PWINDIVERT_ICMPHDR icmp_header;
+        PWINDIVERT_ICMPV6HDR icmpv6_header;
+        PWINDIVERT_IPHDR ip_header;
+        PWINDIVERT_IPV6HDR ipv6_header;
+        LOG("Failed to send a packet. (%lu)", (unsigned long)GetLastError());
+        dumpPacket(pnode->packet, pnode->packetLen, &(pnode->addr));
+        // as noted in windivert help, reinject inbound icmp packets some times would fail
+        // workaround this by resend them as outbound
+        // TODO not sure is this even working as can't find a way to test
+        //      need to document about this
+        WinDivertHelperParsePacket(pnode->packet, pnode->packetLen, &ip_header, &ipv6_header, NULL,
+            &icmp_header, &icmpv6_header, NULL, NULL, NULL, NULL, NULL, NULL);
+        if ((icmp_header || icmpv6_header) && !pnode->addr.Outbound) {
+            BOOL resent;
+            pnode->addr.Outbound = TRUE;
+            if (ip_header) {
+                UINT32 tmp = ip_header->SrcAddr;
+                ip_header->SrcAddr = ip_header->DstAddr;
+                ip_header->DstAddr = tmp;
+            } else if (ipv6_header) {
+                UINT32 tmpArr[4];
+                memcpy(tmpArr, ipv6_header->SrcAddr, sizeof(tmpArr));
+                memcpy(ipv6_header->SrcAddr, ipv6_header->DstAddr, sizeof(tmpArr));
+                memcpy(ipv6_header->DstAddr, tmpArr, sizeof(tmpArr));
+            }
+            resent = WinDivertSend(divertHandle, pnode->packet, pnode->packetLen, &sendLen, &(pnode->addr));
+            LOG("Resend failed inbound ICMP packets as outbound: %s", resent ? "SUCCESS" : "FAIL");
+            return SEND_STATUS_SEND;
+        } else {
+            return SEND_STATUS_FAIL;
+        }
+    } else {
+        if (sendLen < pnode->packetLen) {
+            // TODO don't know how this can happen, or it needs to be resent like good old UDP packet
+            LOG("Internal Error: DivertSend truncated send packet.");
+            return SEND_STATUS_FAIL;
+        } else {
+            return SEND_STATUS_SEND;
+        }
+    }
+}
+
+static void windivertClose() {
+    HANDLE draining = InterlockedExchangePointer(&drainHandle, NULL);
+    BOOL closed;
+    if (draining != NULL) {
+        WinDivertClose(draining);
+    }
+    closed = WinDivertClose(divertHandle);
+    assert(closed);
+    UNREFERENCED_PARAMETER(closed);
+}
+
+Backend windivertBackend = {
+    "windivert",
+    windivertOpen,
+    windivertRecv,
+    windivertSend,
+    windivertClose,
+    0,
+    1,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    windivertSwitchFilter
+};
+#endif
+
+BOOL divertSetBackend(const char *name) {
+    int ix;
+    for (ix = 0; backends[ix]; ++ix) {
+        if (strcmp(backends[ix]->name, name) == 0) {
+            backend = backends[ix];
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+void divertUseBackend(Backend *custom) {
+    backend = custom;
+}
+
+// --overload-budget us a step may take, 0 turns protection off
+// --overload-strikes steps in a row over the budget before bypassing
+// --overload-hold ms to bypass before modules get another go
+// nothing to protect on the virtual clock, and a bypass would make runs differ
+static BOOL overloadSetup(BOOL virtualClock, char buf[]) {
+    const char *budget = getArg("overload-budget"), *strikes = getArg("overload-strikes");
+    const char *hold = getArg("overload-hold");
+    LARGE_INTEGER frequency;
+    double budgetUs = budget ? atof(budget) : OVERLOAD_BUDGET_DEFAULT;
+
+    overloadStrikesMax = strikes ? atoi(strikes) : OVERLOAD_STRIKES_DEFAULT;
+    if (budgetUs < 0 || overloadStrikesMax < 1 || (hold && atoi(hold) < 0)) {
+        sprintf(buf, "Invalid overload option, budget and hold can't be negative and strikes must be 1 or more");
+        return FALSE;
+    }
+    QueryPerformanceFrequency(&frequency);
+    overloadBudgetTicks = virtualClock ? 0 : (LONGLONG)(budgetUs * frequency.QuadPart / 1000000);
+    overloadHoldTicks = (LONGLONG)(hold ? atoi(hold) : OVERLOAD_HOLD_DEFAULT) * frequency.QuadPart / 1000;
+    overloadStrikes = 0;
+    bypassing = 0;
+    return TRUE;
+}
+
+int divertStart(const char *filter, char buf[]) {
+    int ix;
+    const char *clockName = getArg("clock");
+    BOOL virtualClock = clockName && strcmp(clockName, "virtual") == 0;
+
+    if (clockName && !virtualClock && strcmp(clockName, "real") != 0) {
+        sprintf(buf, "Unknown clock %.64s, use real or virtual", clockName);
+        return FALSE;
+    }
+    if (virtualClock && !backend->timed) {
+        sprintf(buf, "Virtual clock needs a backend with packet timestamps, like mock or pcap");
+        return FALSE;
+    }
+    // everything below reads time through the engine clock
+    clockStart(virtualClock);
+    if (!overloadSetup(virtualClock, buf)) {
+        return FALSE;
+    }
+
+    if (!captureStart(buf)) {
+        return FALSE;
+    }
+    budgetReset();
+    spillStart();
+    if (!backend->open(filter, buf)) {
+        captureStop();
+        return FALSE;
+    }
 
     // init package link list
     initPacketNodeList();
@@ -104,24 +371,50 @@ int divertStart(const char *filter, char buf[]) {
     for (ix = 0; ix < MODULE_CNT; ++ix) {
         modules[ix]->lastEnabled = 0;
     }
+    statsInit();
+    memset(&engineStats, 0, sizeof(engineStats));
+    fastPackets = fastBytes = fastFailed = fastSentBytes = 0;
+    builtChanges = modulesChanged - 1;
+    // every module has them, a module without counts as taking both ways
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        ModuleParam *param = findParam(modules[ix], "inbound");
+        directionFlags[ix][0] = param ? (volatile short*)param->value : NULL;
+        param = findParam(modules[ix], "outbound");
+        directionFlags[ix][1] = param ? (volatile short*)param->value : NULL;
+    }
+    latencyTicks = latencyMaxTicks = 0;
+    memset(overhead, 0, sizeof(overhead));
 
     // kick off the loop
     LOG("Creating threads and mutex...");
     stopLooping = FALSE;
-    mutex = CreateMutex(NULL, FALSE, NULL);
+    inputDone = FALSE;
+    // kept across restarts, the control channel may be holding it
+    if (mutex == NULL) {
+        mutex = CreateMutex(NULL, FALSE, NULL);
+    }
     if (mutex == NULL) {
-        sprintf(buf, "Failed to create mutex (%lu)", GetLastError());
+        sprintf(buf, "Failed to create mutex (%lu)", (unsigned long)GetLastError());
         return FALSE;
     }
 
-    loopThread = CreateThread(NULL, 1, (LPTHREAD_START_ROUTINE)divertReadLoop, NULL, 0, NULL);
+    if (!compressStart(buf)) {
+        backend->close();
+        spillStop();
+        captureStop();
+        return FALSE;
+    }
+    // ahead of the threads, the virtual clock driver runs it from its first event
+    scenarioStart();
+    loopThread = CreateThread(NULL, 1,
+        (LPTHREAD_START_ROUTINE)(virtualClock ? divertVirtualLoop : divertReadLoop), NULL, 0, NULL);
     if (loopThread == NULL) {
-        sprintf(buf, "Failed to create recv loop thread (%lu)", GetLastError());
+        sprintf(buf, "Failed to create recv loop thread (%lu)", (unsigned long)GetLastError());
         return FALSE;
     }
     clockThread = CreateThread(NULL, 1, (LPTHREAD_START_ROUTINE)divertClockLoop, NULL, 0, NULL);
     if (clockThread == NULL) {
-        sprintf(buf, "Failed to create clock loop thread (%lu)", GetLastError());
+        sprintf(buf, "Failed to create clock loop thread (%lu)", (unsigned long)GetLastError());
         return FALSE;
     }
 
@@ -133,7 +426,8 @@ int divertStart(const char *filter, char buf[]) {
 static int sendAllListPackets() {
     // send packet from tail to head and remove sent ones
     int sendCount = 0;
-    UINT sendLen;
+    short status;
+    LONGLONG now;
     PacketNode *pnode;
 #ifdef _DEBUG
     // check the list is good
@@ -145,102 +439,311 @@ static int sendAllListPackets() {
     assert(p == tail);
 #endif
 
+    now = clockTicks();
     while (!isListEmpty()) {
         pnode = popNode(tail->prev);
-        sendLen = 0;
         assert(pnode != head);
-        // FIXME inbound injection on any kind of packet is failing with a very high percentage
-        //       need to contact windivert auther and wait for next release
-        if (!WinDivertSend(divertHandle, pnode->packet, pnode->packetLen, &sendLen, &(pnode->addr))) {
-            PWINDIVERT_ICMPHDR icmp_header;
-            PWINDIVERT_ICMPV6HDR icmpv6_header;
-            PWINDIVERT_IPHDR ip_header;
-            PWINDIVERT_IPV6HDR ipv6_header;
-            LOG("Failed to send a packet. (%lu)", GetLastError());
-            dumpPacket(pnode->packet, pnode->packetLen, &(pnode->addr));
-            // as noted in windivert help, reinject inbound icmp packets some times would fail
-            // workaround this by resend them as outbound
-            // TODO not sure is this even working as can't find a way to test
-            //      need to document about this
-            WinDivertHelperParsePacket(pnode->packet, pnode->packetLen, &ip_header, &ipv6_header, NULL,
-                &icmp_header, &icmpv6_header, NULL, NULL, NULL, NULL, NULL, NULL);
-            if ((icmp_header || icmpv6_header) && !pnode->addr.Outbound) {
-                BOOL resent;
-                pnode->addr.Outbound = TRUE;
-                if (ip_header) {
-                    UINT32 tmp = ip_header->SrcAddr;
-                    ip_header->SrcAddr = ip_header->DstAddr;
-                    ip_header->DstAddr = tmp;
-                } else if (ipv6_header) {
-                    UINT32 tmpArr[4];
-                    memcpy(tmpArr, ipv6_header->SrcAddr, sizeof(tmpArr));
-                    memcpy(ipv6_header->SrcAddr, ipv6_header->DstAddr, sizeof(tmpArr));
-                    memcpy(ipv6_header->DstAddr, tmpArr, sizeof(tmpArr));
+        compressTake(pnode);
+        status = backend->send(pnode);
+        InterlockedExchange16(&sendState, status);
+        if (status == SEND_STATUS_SEND) {
+            CAPTURE_TAP(CAPTURE_EGRESS, pnode);
+            ++engineStats.sentPackets;
+            engineStats.sentBytes += pnode->packetLen;
+            if (pnode->recvTick) {
+                LONGLONG dt = now - pnode->recvTick;
+                UINT64 us = statsTicksToUs(dt);
+                ++engineStats.latencyCount;
+                latencyTicks += dt;
+                if (dt > latencyMaxTicks) {
+                    latencyMaxTicks = dt;
                 }
-                resent = WinDivertSend(divertHandle, pnode->packet, pnode->packetLen, &sendLen, &(pnode->addr));
-                LOG("Resend failed inbound ICMP packets as outbound: %s", resent ? "SUCCESS" : "FAIL");
-                InterlockedExchange16(&sendState, SEND_STATUS_SEND);
-            } else {
-                InterlockedExchange16(&sendState, SEND_STATUS_FAIL);
+                // modules release on millisecond clocks, early is no overhead
+                statsHistogramAdd(&overhead[pnode->addr.Outbound ? 1 : 0],
+                    us > pnode->intendedUs ? us - pnode->intendedUs : 0);
             }
         } else {
-            if (sendLen < pnode->packetLen) {
-                // TODO don't know how this can happen, or it needs to be resent like good old UDP packet
-                LOG("Internal Error: DivertSend truncated send packet.");
-                InterlockedExchange16(&sendState, SEND_STATUS_FAIL);
-            } else {
-                InterlockedExchange16(&sendState, SEND_STATUS_SEND);
-            }
+            ++engineStats.sendFailed;
         }
 
-
         freeNode(pnode);
         ++sendCount;
     }
     assert(isListEmpty()); // all packets should be sent by now
+    if (backend->flush) {
+        backend->flush();
+    }
 
     return sendCount;
 }
 
-// step function to let module process and consume all packets on the list
-static void divertConsumeStep() {
-#ifdef _DEBUG
-    DWORD startTick = GetTickCount(), dt;
-#endif
-    int ix, cnt;
-    // use lastEnabled to keep track of module starting up and closing down
+void divertReadStats(EngineStats *out) {
+    int ix;
+    *out = engineStats;
+    out->latencyUs = statsTicksToUs(latencyTicks);
+    out->latencyMaxUs = statsTicksToUs(latencyMaxTicks);
+    out->captureDropped = captureDroppedRecords();
+    out->bypassing = bypassing;
+    // fast path packets never went through the list, add them in here
+    out->fastPathPackets = fastPackets;
+    out->recvPackets += fastPackets;
+    out->recvBytes += fastBytes;
+    out->sentPackets += fastPackets - fastFailed;
+    out->sentBytes += fastSentBytes;
+    out->sendFailed += fastFailed;
+    budgetRead(&out->memoryUsed, &out->memoryBudget);
+    spillRead(&out->spilledBytes, &out->spillSegments);
+    compressRead(&out->compressIn, &out->compressOut, &out->compressCpuUs);
+    for (ix = 0; ix < 2; ++ix) {
+        out->overheadCount[ix] = overhead[ix].count;
+        out->overheadP50Us[ix] = statsHistogramPercentile(&overhead[ix], 50);
+        out->overheadP99Us[ix] = statsHistogramPercentile(&overhead[ix], 99);
+        out->overheadP999Us[ix] = statsHistogramPercentile(&overhead[ix], 99.9);
+    }
+}
+
+BOOL divertInputDone() {
+    return inputDone;
+}
+
+void divertDropped(PacketNode *pnode) {
+    if (backend->drop) {
+        backend->drop(pnode);
+    }
+}
+
+void divertReleaseFrame(char *frame) {
+    backend->release(frame);
+}
+
+void divertBackendStats(char *buf, size_t bufLen) {
+    buf[0] = '\0';
+    if (backend->stats) {
+        backend->stats(buf, bufLen);
+    }
+}
+
+// move capture over to a new filter while running. sends are held off while
+// the backend swaps handles, what modules hold carries over and goes out as
+// usual
+BOOL divertSwitchFilter(const char *filter, char buf[]) {
+    BOOL switched;
+    if (!backend->switchFilter) {
+        sprintf(buf, "The %s backend can't switch filters while running, stop and start again.", backend->name);
+        return FALSE;
+    }
+    if (!divertLock()) {
+        strcpy(buf, "Not filtering yet, click Start.");
+        return FALSE;
+    }
+    switched = backend->switchFilter(filter, buf);
+    divertUnlock();
+    return switched;
+}
+
+BOOL divertBypassing() {
+    return bypassing;
+}
+
+// step ran over budget too often, shut modules down the way disabling them
+// would and pass packets straight through for a while. they start up again
+// on the first step after the bypass
+static void overloadEnter() {
+    LARGE_INTEGER now;
+    int ix;
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        if (modules[ix]->lastEnabled) {
+            modules[ix]->closeDown(head, tail);
+            modules[ix]->lastEnabled = 0;
+        }
+    }
+    sendAllListPackets();
+    // the next step starts them up again
+    builtChanges = modulesChanged - 1;
+    QueryPerformanceCounter(&now);
+    bypassUntil = now.QuadPart + overloadHoldTicks;
+    ++engineStats.bypassEpisodes;
+    InterlockedExchange16(&bypassing, 1);
+    LOG("Overload: %d steps in a row over budget, bypassing modules (episode %llu)",
+        overloadStrikesMax, (unsigned long long)engineStats.bypassEpisodes);
+}
+
+// TRUE while bypassing, ends the bypass once its hold time is up
+static BOOL overloadBypass() {
+    LARGE_INTEGER now;
+    if (!bypassing) {
+        return FALSE;
+    }
+    QueryPerformanceCounter(&now);
+    if (now.QuadPart < bypassUntil) {
+        return TRUE;
+    }
+    InterlockedExchange16(&bypassing, 0);
+    LOG("Overload: bypass over, resuming modules");
+    return FALSE;
+}
+
+// TRUE when no active module selects this direction, so the packet would
+// come out of a step untouched. read without the lock, any toggle since the
+// table was built sends packets through a step until it's rebuilt. packets
+// a module held before its direction got turned off can be overtaken
+static BOOL fastPathClear(BOOL outbound) {
+    if (!backend->lockFree || captureOn || bypassing || stopLooping || builtChanges != modulesChanged) {
+        return FALSE;
+    }
+    return !directionTaken[outbound ? 1 : 0];
+}
+
+static BOOL anyModuleBuffered() {
+    int ix;
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        if (modules[ix]->buffered) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// reinject straight from the read buffer, no node and no lock
+static void fastPathSend(char *packet, UINT packetLen, WINDIVERT_ADDRESS *addr) {
+    PacketNode node;
+    short status;
+    memset(&node, 0, sizeof(node));
+    node.packet = packet;
+    node.packetLen = packetLen;
+    node.addr = *addr;
+    status = backend->send(&node);
+    InterlockedExchange16(&sendState, status);
+    ++fastPackets;
+    fastBytes += packetLen;
+    if (status == SEND_STATUS_SEND) {
+        fastSentBytes += packetLen;
+    } else {
+        ++fastFailed;
+    }
+}
+
+// reinject a packet as read, without a node or the modules
+static void bypassSend(char *packet, UINT packetLen, WINDIVERT_ADDRESS *addr) {
+    PacketNode node;
+    short status;
+    memset(&node, 0, sizeof(node));
+    node.packet = packet;
+    node.packetLen = packetLen;
+    node.addr = *addr;
+    CAPTURE_TAP(CAPTURE_INGRESS, &node);
+    status = backend->send(&node);
+    InterlockedExchange16(&sendState, status);
+    if (status == SEND_STATUS_SEND) {
+        CAPTURE_TAP(CAPTURE_EGRESS, &node);
+        ++engineStats.sentPackets;
+        engineStats.sentBytes += packetLen;
+        ++engineStats.bypassPackets;
+    } else {
+        ++engineStats.sendFailed;
+    }
+    if (backend->flush) {
+        backend->flush();
+    }
+}
+
+// hold off both loops so a batch of changes lands between two steps.
+// FALSE if the engine has never been started, nothing to hold then
+BOOL divertLock() {
+    if (mutex == NULL) {
+        return FALSE;
+    }
+    return WaitForSingleObject(mutex, INFINITE) == WAIT_OBJECT_0;
+}
+
+void divertUnlock() {
+    ReleaseMutex(mutex);
+}
+
+// apply modules switched on and off since the last build, in module order,
+// and lay out the ones on for the steps to run
+static void buildDispatch() {
+    LONG changes = modulesChanged;
+    Module *module;
+    int ix;
+    activeCount = 0;
+    directionTaken[0] = directionTaken[1] = 0;
     for (ix = 0; ix < MODULE_CNT; ++ix) {
-        Module *module = modules[ix];
+        module = modules[ix];
+        noteModuleIx = ix;
         if (*(module->enabledFlag)) {
             if (!module->lastEnabled) {
                 module->startUp();
                 module->lastEnabled = 1;
             }
-            if (module->process(head, tail)) {
-                InterlockedIncrement16(&(module->processTriggered));
+            activeModules[activeCount] = module;
+            activeIx[activeCount++] = ix;
+            if (directionFlags[ix][0] == NULL || *directionFlags[ix][0]) {
+                directionTaken[0] = 1;
             }
-        } else {
-            if (module->lastEnabled) {
-                module->closeDown(head, tail);
-                module->lastEnabled = 0;
+            if (directionFlags[ix][1] == NULL || *directionFlags[ix][1]) {
+                directionTaken[1] = 1;
             }
+        } else if (module->lastEnabled) {
+            module->closeDown(head, tail);
+            module->lastEnabled = 0;
         }
     }
+    // a change landing meanwhile leaves this behind, the next step builds again
+    builtChanges = changes;
+}
+
+// step function to let module process and consume all packets on the list
+static void divertConsumeStep() {
+#ifdef _DEBUG
+    DWORD startTick = GetTickCount(), dt;
+#endif
+    int ix, cnt;
+    LARGE_INTEGER processStart, processEnd, stepStart;
+    QueryPerformanceCounter(&stepStart);
+    if (builtChanges != modulesChanged) {
+        buildDispatch();
+    }
+    for (ix = 0; ix < activeCount; ++ix) {
+        Module *module = activeModules[ix];
+        noteModuleIx = activeIx[ix];
+        QueryPerformanceCounter(&processStart);
+        if (module->process(head, tail)) {
+            InterlockedIncrement16(&(module->processTriggered));
+        }
+        QueryPerformanceCounter(&processEnd);
+        STATS_ADD(*module, cpuTicks, processEnd.QuadPart - processStart.QuadPart);
+    }
     cnt = sendAllListPackets();
+    if (overloadBudgetTicks) {
+        QueryPerformanceCounter(&processEnd);
+        if (processEnd.QuadPart - stepStart.QuadPart <= overloadBudgetTicks) {
+            overloadStrikes = 0;
+        } else if (++overloadStrikes >= overloadStrikesMax) {
+            overloadStrikes = 0;
+            overloadEnter();
+        }
+    }
 #ifdef _DEBUG
     dt =  GetTickCount() - startTick;
     if (dt > CLOCK_WAITMS / 2) {
-        LOG("Costy consume step: %lu ms, sent %d packets", GetTickCount() - startTick, cnt);
+        LOG("Costy consume step: %lu ms, sent %d packets", (unsigned long)(GetTickCount() - startTick), cnt);
     }
 #endif
 }
 
+// lets bench.c time the whole step on its own thread
+void divertBenchStep() {
+    divertConsumeStep();
+}
+
 // periodically try to consume packets to keep the network responsive and not blocked by recv
 static DWORD divertClockLoop(LPVOID arg) {
     DWORD startTick, stepTick, waitResult;
     int ix;
 
     UNREFERENCED_PARAMETER(arg);
+    statsRegisterThread();
 
     for(;;) {
         // use acquire as wait for yielding thread
@@ -249,11 +752,14 @@ static DWORD divertClockLoop(LPVOID arg) {
         switch(waitResult) {
             case WAIT_OBJECT_0:
                 /***************** enter critical region ************************/
-                divertConsumeStep();
+                // virtual time only moves with the driver, which takes all the steps
+                if (!clockIsVirtual() && !overloadBypass()) {
+                    divertConsumeStep();
+                }
                 /***************** leave critical region ************************/
                 if (!ReleaseMutex(mutex)) {
                     InterlockedIncrement16(&stopLooping);
-                    LOG("Fatal: Failed to release mutex (%lu)", GetLastError());
+                    LOG("Fatal: Failed to release mutex (%lu)", (unsigned long)GetLastError());
                     ABORT();
                 }
                 // if didn't spent enough time, we sleep on it
@@ -272,7 +778,7 @@ static DWORD divertClockLoop(LPVOID arg) {
                 InterlockedIncrement16(&stopLooping);
                 break;
             case WAIT_FAILED:
-                LOG("Acquire failed (%lu)", GetLastError());
+                LOG("Acquire failed (%lu)", (unsigned long)GetLastError());
                 InterlockedIncrement16(&stopLooping);
                 break;
         }
@@ -280,21 +786,21 @@ static DWORD divertClockLoop(LPVOID arg) {
         // need to get the lock here
         if (stopLooping) {
             int lastSendCount = 0;
-            BOOL closed;
 
             waitResult = WaitForSingleObject(mutex, INFINITE);
             switch (waitResult)
             {
             case WAIT_ABANDONED:
             case WAIT_FAILED:
-                LOG("Acquire failed/abandoned mutex (%lu), will still try closing and return", GetLastError());
+                LOG("Acquire failed/abandoned mutex (%lu), will still try closing and return", (unsigned long)GetLastError());
             case WAIT_OBJECT_0:
                 /***************** enter critical region ************************/
                 LOG("Read stopLooping, stopping...");
-                // clean up by closing all modules
+                // clean up by closing all modules that have started
                 for (ix = 0; ix < MODULE_CNT; ++ix) {
                     Module *module = modules[ix];
-                    if (*(module->enabledFlag)) {
+                    if (module->lastEnabled) {
+                        noteModuleIx = ix;
                         module->closeDown(head, tail);
                     } 
                 }
@@ -303,13 +809,12 @@ static DWORD divertClockLoop(LPVOID arg) {
                 LOG("Lastly sent %d packets. Closing...", lastSendCount);
 
                 // terminate recv loop by closing handler. handle related error in recv loop to quit
-                closed = WinDivertClose(divertHandle);
-                assert(closed);
+                backend->close();
 
                 // release to let read loop exit properly
                 /***************** leave critical region ************************/
                 if (!ReleaseMutex(mutex)) {
-                    LOG("Fatal: Failed to release mutex (%lu)", GetLastError());
+                    LOG("Fatal: Failed to release mutex (%lu)", (unsigned long)GetLastError());
                     ABORT();
                 }
                 return 0;
@@ -320,27 +825,35 @@ static DWORD divertClockLoop(LPVOID arg) {
 }
 
 static DWORD divertReadLoop(LPVOID arg) {
-    char packetBuf[MAX_PACKETSIZE];
+    char packetBuf[MAX_PACKETSIZE], *packet, *frame;
     WINDIVERT_ADDRESS addrBuf;
     UINT readLen;
     PacketNode *pnode;
     DWORD waitResult;
+    LONGLONG recvTick;
+    int status;
 
     UNREFERENCED_PARAMETER(arg);
+    statsRegisterThread();
 
     for(;;) {
-        // each step must fully consume the list
-        assert(isListEmpty()); // FIXME has failed this assert before. don't know why
-        if (!WinDivertRecv(divertHandle, packetBuf, MAX_PACKETSIZE, &readLen, &addrBuf)) {
-            DWORD lastError = GetLastError();
-            if (lastError == ERROR_INVALID_HANDLE || lastError == ERROR_OPERATION_ABORTED) {
-                // treat closing handle as quit
-                LOG("Handle died or operation aborted. Exit loop.");
-                return 0;
-            }
-            LOG("Failed to recv a packet. (%lu)", GetLastError());
+        frame = NULL;
+        if (backend->recvFrame) {
+            status = backend->recvFrame(packetBuf, MAX_PACKETSIZE, &frame, &readLen, &addrBuf);
+        } else {
+            status = backend->recv(packetBuf, MAX_PACKETSIZE, &readLen, &addrBuf);
+        }
+        packet = frame ? frame : packetBuf;
+        if (status == RECV_STATUS_CLOSED) {
+            return 0;
+        } else if (status == RECV_STATUS_EOF) {
+            LOG("Backend input done, stop read loop.");
+            InterlockedExchange16(&inputDone, 1);
+            return 0;
+        } else if (status != RECV_STATUS_OK) {
             continue;
         }
+        recvTick = clockTicks();
         if (readLen > MAX_PACKETSIZE) {
             // don't know how this can happen
             LOG("Internal Error: DivertRecv truncated recv packet."); 
@@ -348,30 +861,73 @@ static DWORD divertReadLoop(LPVOID arg) {
 
         //dumpPacket(packetBuf, readLen, &addrBuf);  
 
+        if (fastPathClear(addrBuf.Outbound)) {
+            fastPathSend(packet, readLen, &addrBuf);
+            if (frame) {
+                backend->release(frame);
+            }
+            // packets are what drives modules releasing what they hold, take
+            // a step when nobody else is, as a node would have
+            if (anyModuleBuffered() && WaitForSingleObject(mutex, 0) == WAIT_OBJECT_0) {
+                if (!stopLooping && !bypassing) {
+                    divertConsumeStep();
+                }
+                if (!ReleaseMutex(mutex)) {
+                    LOG("Fatal: Failed to release mutex (%lu)", (unsigned long)GetLastError());
+                    ABORT();
+                }
+            }
+            continue;
+        }
+
         waitResult = WaitForSingleObject(mutex, INFINITE);
         switch(waitResult) {
             case WAIT_OBJECT_0:
                 /***************** enter critical region ************************/
                 if (stopLooping) {
                     LOG("Lost last recved packet but user stopped. Stop read loop.");
+                    if (frame) {
+                        backend->release(frame);
+                    }
                     /***************** leave critical region ************************/
                     if (!ReleaseMutex(mutex)) {
-                        LOG("Fatal: Failed to release mutex on stopping (%lu). Will stop anyway.", GetLastError());
+                        LOG("Fatal: Failed to release mutex on stopping (%lu). Will stop anyway.", (unsigned long)GetLastError());
                     }
                     return 0;
                 }
+                // each step must fully consume the list. only holds under the
+                // lock, the clock thread's steps fill it too
+                assert(isListEmpty());
+                ++engineStats.recvPackets;
+                engineStats.recvBytes += readLen;
+                if (overloadBypass()) {
+                    bypassSend(packet, readLen, &addrBuf);
+                    if (frame) {
+                        backend->release(frame);
+                    }
+                    if (!ReleaseMutex(mutex)) {
+                        LOG("Fatal: Failed to release mutex (%lu)", (unsigned long)GetLastError());
+                        ABORT();
+                    }
+                    break;
+                }
                 // create node and put it into the list
-                pnode = createNode(packetBuf, readLen, &addrBuf);
+                pnode = frame ? createFrameNode(frame, readLen, &addrBuf) : createNode(packetBuf, readLen, &addrBuf);
+                pnode->recvTick = recvTick;
                 appendNode(pnode);
+                CAPTURE_TAP(CAPTURE_INGRESS, pnode);
                 divertConsumeStep();
                 /***************** leave critical region ************************/
                 if (!ReleaseMutex(mutex)) {
-                    LOG("Fatal: Failed to release mutex (%lu)", GetLastError());
+                    LOG("Fatal: Failed to release mutex (%lu)", (unsigned long)GetLastError());
                     ABORT();
                 }
                 break;
             case WAIT_TIMEOUT:
                 LOG("Acquire timeout, dropping one read packet");
+                if (frame) {
+                    backend->release(frame);
+                }
                 continue;
                 break;
             case WAIT_ABANDONED:
@@ -384,14 +940,115 @@ static DWORD divertReadLoop(LPVOID arg) {
     }
 }
 
+// read loop for the virtual clock. instead of waiting, the clock jumps to the
+// earliest of the next packet's timestamp, a module's wake up or a scenario
+// step, and every event is followed by one engine step. the same input and
+// settings then always give the same output, however long the delays.
+static DWORD divertVirtualLoop(LPVOID arg) {
+    char packetBuf[MAX_PACKETSIZE];
+    WINDIVERT_ADDRESS addrBuf;
+    UINT readLen = 0;
+    PacketNode *pnode;
+    INT64 firstTs = -1;
+    UINT64 packetUs = 0, wakeUs = 0, scenarioUs = 0, nowUs;
+    BOOL havePacket = FALSE, inputEnded = FALSE, waking = FALSE, scenarioPending;
+    int status;
+
+    UNREFERENCED_PARAMETER(arg);
+    statsRegisterThread();
+    scenarioPending = scenarioTick(0, &scenarioUs);
+
+    for (;;) {
+        if (stopLooping) {
+            return 0;
+        }
+        if (!havePacket && !inputEnded) {
+            status = backend->recv(packetBuf, MAX_PACKETSIZE, &readLen, &addrBuf);
+            if (status == RECV_STATUS_CLOSED) {
+                return 0;
+            } else if (status == RECV_STATUS_EOF) {
+                LOG("Backend input done, draining modules on the virtual clock.");
+                inputEnded = TRUE;
+            } else if (status != RECV_STATUS_OK) {
+                continue;
+            } else {
+                // the trace starts at virtual 0, out of order stamps don't go back in time
+                if (firstTs < 0) {
+                    firstTs = addrBuf.Timestamp;
+                }
+                packetUs = addrBuf.Timestamp > firstTs ? (UINT64)(addrBuf.Timestamp - firstTs) : 0;
+                havePacket = TRUE;
+            }
+        }
+
+        if (!havePacket && !waking && !scenarioPending) {
+            break;
+        }
+        nowUs = (UINT64)-1;
+        if (havePacket) {
+            nowUs = packetUs;
+        }
+        if (waking && wakeUs < nowUs) {
+            nowUs = wakeUs;
+        }
+        if (scenarioPending && scenarioUs < nowUs) {
+            nowUs = scenarioUs;
+        }
+        clockAdvance(nowUs);
+        nowUs = clockVirtualUs();
+
+        if (scenarioPending && scenarioUs <= nowUs) {
+            scenarioPending = scenarioTick(nowUs, &scenarioUs);
+            if (scenarioPending && scenarioUs <= nowUs) {
+                scenarioUs = nowUs + 1;
+            }
+        }
+
+        WaitForSingleObject(mutex, INFINITE);
+        /***************** enter critical region ************************/
+        if (stopLooping) {
+            ReleaseMutex(mutex);
+            return 0;
+        }
+        if (havePacket && packetUs <= nowUs) {
+            pnode = createNode(packetBuf, readLen, &addrBuf);
+            pnode->recvTick = clockTicks();
+            appendNode(pnode);
+            CAPTURE_TAP(CAPTURE_INGRESS, pnode);
+            ++engineStats.recvPackets;
+            engineStats.recvBytes += readLen;
+            havePacket = FALSE;
+        }
+        divertConsumeStep();
+        waking = clockTakeWake(&wakeUs);
+        // a module asking for a step now would never let the clock move
+        if (waking && wakeUs <= nowUs) {
+            wakeUs = nowUs + 1;
+        }
+        /***************** leave critical region ************************/
+        if (!ReleaseMutex(mutex)) {
+            LOG("Fatal: Failed to release mutex (%lu)", (unsigned long)GetLastError());
+            ABORT();
+        }
+    }
+
+    LOG("Virtual clock ran out of events at %llu us.", (unsigned long long)clockVirtualUs());
+    InterlockedExchange16(&inputDone, 1);
+    return 0;
+}
+
 void divertStop() {
     HANDLE threads[2];
     threads[0] = loopThread;
     threads[1] = clockThread;
 
     LOG("Stopping...");
+    scenarioStop();
     InterlockedIncrement16(&stopLooping);
     WaitForMultipleObjects(2, threads, TRUE, INFINITE);
+    captureStop();
+    spillStop();
+    compressStop();
 
     LOG("Successfully waited threads and stopped.");
 }
@@ -1,17 +1,16 @@
 // dropping packet module
 #include <stdlib.h>
-#include <Windows.h>
-#include "iup.h"
 #include "common.h"
 #define NAME "drop"
 
-static Ihandle *inboundCheckbox, *outboundCheckbox, *chanceInput;
-
 static volatile short dropEnabled = 0,
     dropInbound = 1, dropOutbound = 1,
     chance = 1000; // [0-10000]
 
 
+#ifndef CLUMSY_HEADLESS
+static Ihandle *inboundCheckbox, *outboundCheckbox, *chanceInput;
+
 static Ihandle* dropSetupUI() {
     Ihandle *dropControlsBox = IupHbox(
         inboundCheckbox = IupToggle("Inbound", NULL),
@@ -42,6 +41,7 @@ static Ihandle* dropSetupUI() {
 
     return dropControlsBox;
 }
+#endif
 
 static void dropStartUp() {
     LOG("drop enabled");
@@ -57,30 +57,42 @@ static short dropProcess(PacketNode *head, PacketNode* tail) {
     int dropped = 0;
     while (head->next != tail) {
         PacketNode *pac = head->next;
+        short matched = checkDirection(pac->addr.Outbound, dropInbound, dropOutbound);
+        if (matched) {
+            STATS_SEEN(dropModule, pac);
+        }
         // chance in range of [0, 10000]
-        if (checkDirection(pac->addr.Outbound, dropInbound, dropOutbound)
-            && calcChance(chance)) {
+        if (matched && calcChance(chance)) {
             LOG("dropped with chance %.1f%%, direction %s",
                 chance/100.0, pac->addr.Outbound ? "OUTBOUND" : "INBOUND");
-            freeNode(popNode(pac));
+            dropNode(popNode(pac));
             ++dropped;
         } else {
             head = head->next;
         }
     }
 
+    STATS_ADD(dropModule, dropped, dropped);
     return dropped > 0;
 }
 
 
+static ModuleParam dropParams[] = {
+    {"inbound", PARAM_TOGGLE, &dropInbound, NULL, NULL},
+    {"outbound", PARAM_TOGGLE, &dropOutbound, NULL, NULL},
+    {"chance", PARAM_CHANCE, &chance, NULL, NULL},
+    {NULL}
+};
+
 Module dropModule = {
     "Drop",
     NAME,
     (short*)&dropEnabled,
-    dropSetupUI,
+    MODULE_UI(dropSetupUI),
     dropStartUp,
     dropCloseDown,
     dropProcess,
+    dropParams,
     // runtime fields
-    0, 0, NULL
+    0, 0, NULL, NULL, 0, 0
 };
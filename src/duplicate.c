@@ -1,23 +1,41 @@
 // duplicate packet module
+// with a delay copies don't leave next to the original but each on its own
+// delay drawn by spread, the way retransmitting middleboxes and l2 loops
+// repeat packets later. delayed copies wait in a heap on their release time
 #include <stdlib.h>
-#include "iup.h"
+#include <math.h>
 #include "common.h"
 #define NAME "duplicate"
 #define COPIES_MIN "2"
 #define COPIES_MAX "50"
 #define COPIES_COUNT 2
+#define DELAY_MIN "0"
+#define DELAY_MAX "15000"
 
-static Ihandle *inboundCheckbox, *outboundCheckbox, *chanceInput, *countInput;
+#define SPREAD_FIXED 0 // every copy after exactly delay
+#define SPREAD_UNIFORM 1 // anywhere in [0, 2 * delay]
+#define SPREAD_EXPONENTIAL 2 // delay on average, mostly sooner, some much later
 
 static volatile short dupEnabled = 0,
     dupInbound = 1, dupOutbound = 1,
     chance = 1000, // [0-10000]
-    count = COPIES_COUNT; // how many copies to duplicate
+    count = COPIES_COUNT, // how many copies to duplicate
+    delay = 0, // ms, 0 sends copies with the original
+    spread = SPREAD_FIXED;
+
+// pending copies, min heap on timestamp which holds the release time
+static PacketNode **pending;
+static int pendingSize, pendingCap;
+
+#ifndef CLUMSY_HEADLESS
+static Ihandle *inboundCheckbox, *outboundCheckbox, *chanceInput, *countInput, *delayInput;
 
 static Ihandle* dupSetupUI() {
     Ihandle *dupControlsBox = IupHbox(
         IupLabel("Count:"),
         countInput = IupText(NULL),
+        IupLabel("Delay(ms):"),
+        delayInput = IupText(NULL),
         inboundCheckbox = IupToggle("Inbound", NULL),
         outboundCheckbox = IupToggle("Outbound", NULL),
         IupLabel("Chance(%):"),
@@ -40,6 +58,12 @@ static Ihandle* dupSetupUI() {
     IupSetAttribute(countInput, SYNCED_VALUE, (char*)&count);
     IupSetAttribute(countInput, INTEGER_MAX, COPIES_MAX);
     IupSetAttribute(countInput, INTEGER_MIN, COPIES_MIN);
+    IupSetAttribute(delayInput, "VISIBLECOLUMNS", "4");
+    IupSetAttribute(delayInput, "VALUE", "0");
+    IupSetCallback(delayInput, "VALUECHANGED_CB", (Icallback)uiSyncInteger);
+    IupSetAttribute(delayInput, SYNCED_VALUE, (char*)&delay);
+    IupSetAttribute(delayInput, INTEGER_MAX, DELAY_MAX);
+    IupSetAttribute(delayInput, INTEGER_MIN, DELAY_MIN);
 
     // enable by default to avoid confusing
     IupSetAttribute(inboundCheckbox, "VALUE", "ON");
@@ -50,48 +74,163 @@ static Ihandle* dupSetupUI() {
         setFromParameter(outboundCheckbox, "VALUE", NAME"-outbound");
         setFromParameter(chanceInput, "VALUE", NAME"-chance");
         setFromParameter(countInput, "VALUE", NAME"-count");
+        setFromParameter(delayInput, "VALUE", NAME"-delay");
     }
 
     return dupControlsBox;
 }
+#endif
+
+// release times are clockMs values, compared so they survive its wrap
+#define DUE_BEFORE(a, b) ((LONG)((a)->timestamp - (b)->timestamp) < 0)
+
+static BOOL pendingPush(PacketNode *pac) {
+    int ix = pendingSize, parent;
+    PacketNode **grown;
+    if (pendingSize == pendingCap) {
+        grown = (PacketNode**)realloc(pending, sizeof(PacketNode*) * (pendingCap ? pendingCap * 2 : 256));
+        if (grown == NULL) {
+            return FALSE;
+        }
+        pending = grown;
+        pendingCap = pendingCap ? pendingCap * 2 : 256;
+    }
+    // sift up
+    for (; ix > 0 && DUE_BEFORE(pac, pending[parent = (ix - 1) / 2]); ix = parent) {
+        pending[ix] = pending[parent];
+    }
+    pending[ix] = pac;
+    ++pendingSize;
+    return TRUE;
+}
+
+static PacketNode* pendingPop() {
+    PacketNode *top = pending[0], *last = pending[--pendingSize];
+    int ix = 0, child;
+    // sift down
+    while ((child = ix * 2 + 1) < pendingSize) {
+        if (child + 1 < pendingSize && DUE_BEFORE(pending[child + 1], pending[child])) {
+            ++child;
+        }
+        if (!DUE_BEFORE(pending[child], last)) {
+            break;
+        }
+        pending[ix] = pending[child];
+        ix = child;
+    }
+    pending[ix] = last;
+    return top;
+}
+
+static DWORD drawDelay() {
+    double u = rand() / (RAND_MAX + 1.0);
+    switch (spread) {
+    case SPREAD_UNIFORM:
+        return (DWORD)(u * 2 * delay + 0.5);
+    case SPREAD_EXPONENTIAL:
+        return (DWORD)(-log(1 - u) * delay + 0.5);
+    default:
+        return delay;
+    }
+}
 
 static void dupStartup() {
+    assert(pendingSize == 0);
     LOG("dup enabled");
 }
 
 static void dupCloseDown(PacketNode *head, PacketNode *tail) {
+    PacketNode *at = tail;
     UNREFERENCED_PARAMETER(head);
-    UNREFERENCED_PARAMETER(tail);
-    LOG("dup disabled");
+    // copies still waiting go out now, soonest first. the list sends from
+    // the tail so each goes in ahead of the one due before it
+    LOG("dup disabled, flushing %d delayed copies", pendingSize);
+    while (pendingSize > 0) {
+        PacketNode *pac = pendingPop();
+        budgetRefund(&dupModule, pac);
+        insertBefore(pac, at);
+        at = pac;
+    }
+    free(pending);
+    pending = NULL;
+    pendingCap = 0;
+    STATS_BUFFERED(dupModule, 0);
 }
 
 static short dupProcess(PacketNode *head, PacketNode *tail) {
     short duped = FALSE;
-    PacketNode *pac = head->next;
+    DWORD now = clockMs();
+    PacketNode *pac = head->next, *at;
     while (pac != tail) {
-        if (checkDirection(pac->addr.Outbound, dupInbound, dupOutbound)
-            && calcChance(chance)) {
+        short matched = checkDirection(pac->addr.Outbound, dupInbound, dupOutbound);
+        if (matched) {
+            STATS_SEEN(dupModule, pac);
+        }
+        if (matched && calcChance(chance)) {
             short copies = count - 1;
             LOG("duplicating w/ chance %.1f%%, cloned additionally %d packets", chance/100.0, copies);
             while (copies--) {
-                PacketNode *copy = createNode(pac->packet, pac->packetLen, &(pac->addr));
-                insertBefore(copy, pac); // must insertBefore or next packet is still pac
+                PacketNode *copy;
+                // over the memory budget delayed copies just aren't made
+                if (delay > 0 && budgetExceeded()) {
+                    break;
+                }
+                copy = createNode(pac->packet, pac->packetLen, &(pac->addr));
+                copy->notes = pac->notes;
+                PACKET_NOTE(copy, NOTE_DUPLICATED);
+                if (delay == 0) {
+                    insertBefore(copy, pac); // must insertBefore or next packet is still pac
+                } else {
+                    copy->timestamp = now + drawDelay();
+                    if (!pendingPush(copy)) {
+                        freeNode(copy);
+                        break;
+                    }
+                    budgetCharge(&dupModule, copy);
+                }
+                STATS_ADD(dupModule, duplicated, 1);
             }
             duped = TRUE;
         }
         pac = pac->next;
     }
+
+    // due copies leave before this step's packets, the list sends from the
+    // tail so each goes in ahead of the one due before it
+    at = tail;
+    while (pendingSize > 0 && (LONG)(now - pending[0]->timestamp) >= 0) {
+        pac = pendingPop();
+        budgetRefund(&dupModule, pac);
+        insertBefore(pac, at);
+        at = pac;
+        duped = TRUE;
+    }
+    if (pendingSize > 0) {
+        clockWakeAt(pending[0]->timestamp);
+    }
+    STATS_BUFFERED(dupModule, pendingSize);
     return duped;
 }
 
+static ModuleParam dupParams[] = {
+    {"inbound", PARAM_TOGGLE, &dupInbound, NULL, NULL},
+    {"outbound", PARAM_TOGGLE, &dupOutbound, NULL, NULL},
+    {"chance", PARAM_CHANCE, &chance, NULL, NULL},
+    {"count", PARAM_SHORT, &count, COPIES_MIN, COPIES_MAX},
+    {"delay", PARAM_SHORT, &delay, DELAY_MIN, DELAY_MAX},
+    {"spread", PARAM_CHOICE, &spread, "fixed|uniform|exponential", NULL},
+    {NULL}
+};
+
 Module dupModule = {
     "Duplicate",
     NAME,
     (short*)&dupEnabled,
-    dupSetupUI,
+    MODULE_UI(dupSetupUI),
     dupStartup,
     dupCloseDown,
     dupProcess,
+    dupParams,
     // runtime fields
-    0, 0, NULL
+    0, 0, NULL, NULL, 0, 0
 };
\ No newline at end of file
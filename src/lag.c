@@ -1,21 +1,17 @@
 // lagging packets
-#include "iup.h"
 #include "common.h"
 #define NAME "lag"
 #define LAG_MIN "0"
 #define LAG_MAX "15000"
-#define KEEP_AT_MOST 2000
-// send FLUSH_WHEN_FULL packets when buffer is full
-#define FLUSH_WHEN_FULL 800
 #define LAG_DEFAULT 50
 
 // don't need a chance
-static Ihandle *inboundCheckbox, *outboundCheckbox, *timeInput;
 
 static volatile short lagEnabled = 0,
     lagInbound = 1,
     lagOutbound = 1,
-    lagTime = LAG_DEFAULT; // default for 50ms
+    lagTime = LAG_DEFAULT, // default for 50ms
+    lagBudget = BUDGET_RELEASE; // over the memory budget, see budget.c
 
 static PacketNode lagHeadNode = {0}, lagTailNode = {0};
 static PacketNode *bufHead = &lagHeadNode, *bufTail = &lagTailNode;
@@ -27,6 +23,9 @@ static INLINE_FUNCTION short isBufEmpty() {
     return ret;
 }
 
+#ifndef CLUMSY_HEADLESS
+static Ihandle *inboundCheckbox, *outboundCheckbox, *timeInput;
+
 static Ihandle *lagSetupUI() {
     Ihandle *lagControlsBox = IupHbox(
         inboundCheckbox = IupToggle("Inbound", NULL),
@@ -59,6 +58,7 @@ static Ihandle *lagSetupUI() {
 
     return lagControlsBox;
 }
+#endif
 
 static void lagStartUp() {
     if (bufHead->next == NULL && bufTail->next == NULL) {
@@ -77,19 +77,30 @@ static void lagCloseDown(PacketNode *head, PacketNode *tail) {
     // flush all buffered packets
     LOG("Closing down lag, flushing %d packets", bufSize);
     while(!isBufEmpty()) {
+        // left packed, sending takes them oldest first so the flush doesn't
+        // hold up the ones already due
+        budgetRefund(&lagModule, bufTail->prev);
         insertAfter(popNode(bufTail->prev), oldLast);
         --bufSize;
     }
+    STATS_BUFFERED(lagModule, 0);
     endTimePeriod();
 }
 
 static short lagProcess(PacketNode *head, PacketNode *tail) {
-    DWORD currentTime = timeGetTime();
+    DWORD currentTime = clockMs();
     PacketNode *pac = tail->prev;
     // pick up all packets and fill in the current time
-    while (bufSize < KEEP_AT_MOST && pac != head) {
+    while (pac != head) {
         if (checkDirection(pac->addr.Outbound, lagInbound, lagOutbound)) {
-            insertAfter(popNode(pac), bufHead)->timestamp = timeGetTime();
+            STATS_SEEN(lagModule, pac);
+            STATS_ADD(lagModule, delayed, 1);
+            PACKET_NOTE(pac, NOTE_DELAYED);
+            pac->intendedUs += lagTime * 1000;
+            spillStore(pac);
+            budgetCharge(&lagModule, pac);
+            compressQueue(pac);
+            insertAfter(popNode(pac), bufHead)->timestamp = currentTime;
             ++bufSize;
             pac = tail->prev;
         } else {
@@ -101,6 +112,8 @@ static short lagProcess(PacketNode *head, PacketNode *tail) {
     while (!isBufEmpty()) {
         pac = bufTail->prev;
         if (currentTime > pac->timestamp + lagTime) {
+            budgetRefund(&lagModule, pac);
+            compressTake(pac);
             insertAfter(popNode(bufTail->prev), head); // sending queue is already empty by now
             --bufSize;
             LOG("Send lagged packets.");
@@ -110,26 +123,45 @@ static short lagProcess(PacketNode *head, PacketNode *tail) {
         }
     }
 
-    // if buffer is full just flush things out
-    if (bufSize >= KEEP_AT_MOST) {
-        int flushCnt = FLUSH_WHEN_FULL;
-        while (flushCnt-- > 0) {
-            insertAfter(popNode(bufTail->prev), head);
-            --bufSize;
+    // over the memory budget, give up what we hold until back under
+    while (budgetExceeded() && !isBufEmpty()) {
+        pac = lagBudget == BUDGET_TAIL_DROP ? bufHead->next : bufTail->prev;
+        budgetRefund(&lagModule, pac);
+        popNode(pac);
+        --bufSize;
+        if (lagBudget == BUDGET_RELEASE) {
+            compressTake(pac);
+            insertAfter(pac, head);
+        } else {
+            dropNode(pac);
+            STATS_ADD(lagModule, dropped, 1);
         }
     }
 
+    if (!isBufEmpty()) {
+        clockWakeAt(bufTail->prev->timestamp + lagTime + 1);
+    }
+    STATS_BUFFERED(lagModule, bufSize);
     return bufSize > 0;
 }
 
+static ModuleParam lagParams[] = {
+    {"inbound", PARAM_TOGGLE, &lagInbound, NULL, NULL},
+    {"outbound", PARAM_TOGGLE, &lagOutbound, NULL, NULL},
+    {"time", PARAM_SHORT, &lagTime, LAG_MIN, LAG_MAX},
+    {"budget", PARAM_CHOICE, &lagBudget, BUDGET_POLICIES, NULL},
+    {NULL}
+};
+
 Module lagModule = {
     "Lag",
     NAME,
     (short*)&lagEnabled,
-    lagSetupUI,
+    MODULE_UI(lagSetupUI),
     lagStartUp,
     lagCloseDown,
     lagProcess,
+    lagParams,
     // runtime fields
-    0, 0, NULL
+    0, 0, NULL, NULL, 0, 0
 };
\ No newline at end of file
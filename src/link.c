@@ -0,0 +1,235 @@
+// link emulation module
+// each direction is a bottleneck link. packets wait their turn for it, take
+// length / rate to be serialized onto it and then the propagation delay to
+// arrive, so a 1500 byte packet on 1000 kbit/s is 12 ms on the wire. a
+// departure clock per direction says when the link is next free, so a packet
+// costs the same however deep the queue is. while more than queue KB wait to
+// be serialized, arriving packets are tail dropped like a router's would be
+//   rate   kbit/s, 0 for no serialization delay
+//   delay  propagation in ms
+//   queue  KB waiting for the link at most, 0 for no limit
+#include "common.h"
+#define NAME "link"
+#define RATE_MIN "0"
+#define RATE_MAX "10000000" // 10 Gbit/s
+#define RATE_DEFAULT 1000
+#define DELAY_MIN "0"
+#define DELAY_MAX "15000"
+#define QUEUE_MIN "0"
+#define QUEUE_MAX "1000000"
+#define QUEUE_DEFAULT 64
+
+typedef struct {
+    volatile LONG rate, queue;
+    volatile short delay;
+    LONGLONG departUs; // when the link is done with what's queued, since baseMs
+    DWORD lastRelease; // releases stay in order when delay is turned down
+    PacketNode headNode, tailNode;
+    PacketNode *bufHead, *bufTail;
+    int bufSize;
+} Link;
+
+static volatile short linkEnabled = 0,
+    linkInbound = 1, linkOutbound = 1;
+
+static Link uplink = {RATE_DEFAULT, QUEUE_DEFAULT, 0}, downlink = {RATE_DEFAULT, QUEUE_DEFAULT, 0};
+static DWORD baseMs;
+
+#ifndef CLUMSY_HEADLESS
+static Ihandle *inboundCheckbox, *outboundCheckbox;
+static Ihandle *upRateInput, *upDelayInput, *upQueueInput, *downRateInput, *downDelayInput, *downQueueInput;
+
+static Ihandle* linkInput(volatile void *value, const char *initial, const char *min, const char *max, Icallback sync) {
+    Ihandle *input = IupText(NULL);
+    IupSetAttribute(input, "VISIBLECOLUMNS", "5");
+    IupSetAttribute(input, "VALUE", initial);
+    IupSetCallback(input, "VALUECHANGED_CB", sync);
+    IupSetAttribute(input, SYNCED_VALUE, (char*)value);
+    IupSetAttribute(input, INTEGER_MAX, max);
+    IupSetAttribute(input, INTEGER_MIN, min);
+    return input;
+}
+
+static Ihandle* linkSetupUI() {
+    Ihandle *linkControlsBox = IupHbox(
+        inboundCheckbox = IupToggle("Inbound", NULL),
+        outboundCheckbox = IupToggle("Outbound", NULL),
+        IupLabel("Up(kbit/s):"),
+        upRateInput = linkInput(&uplink.rate, STR(RATE_DEFAULT), RATE_MIN, RATE_MAX, uiSyncInt32),
+        IupLabel("ms:"),
+        upDelayInput = linkInput(&uplink.delay, "0", DELAY_MIN, DELAY_MAX, uiSyncInteger),
+        IupLabel("KB:"),
+        upQueueInput = linkInput(&uplink.queue, STR(QUEUE_DEFAULT), QUEUE_MIN, QUEUE_MAX, uiSyncInt32),
+        IupLabel("Down(kbit/s):"),
+        downRateInput = linkInput(&downlink.rate, STR(RATE_DEFAULT), RATE_MIN, RATE_MAX, uiSyncInt32),
+        IupLabel("ms:"),
+        downDelayInput = linkInput(&downlink.delay, "0", DELAY_MIN, DELAY_MAX, uiSyncInteger),
+        IupLabel("KB:"),
+        downQueueInput = linkInput(&downlink.queue, STR(QUEUE_DEFAULT), QUEUE_MIN, QUEUE_MAX, uiSyncInt32),
+        NULL
+    );
+
+    IupSetCallback(inboundCheckbox, "ACTION", (Icallback)uiSyncToggle);
+    IupSetAttribute(inboundCheckbox, SYNCED_VALUE, (char*)&linkInbound);
+    IupSetCallback(outboundCheckbox, "ACTION", (Icallback)uiSyncToggle);
+    IupSetAttribute(outboundCheckbox, SYNCED_VALUE, (char*)&linkOutbound);
+
+    // enable by default to avoid confusing
+    IupSetAttribute(inboundCheckbox, "VALUE", "ON");
+    IupSetAttribute(outboundCheckbox, "VALUE", "ON");
+
+    if (parameterized) {
+        setFromParameter(inboundCheckbox, "VALUE", NAME"-inbound");
+        setFromParameter(outboundCheckbox, "VALUE", NAME"-outbound");
+        setFromParameter(upRateInput, "VALUE", NAME"-uplink-rate");
+        setFromParameter(upDelayInput, "VALUE", NAME"-uplink-delay");
+        setFromParameter(upQueueInput, "VALUE", NAME"-uplink-queue");
+        setFromParameter(downRateInput, "VALUE", NAME"-downlink-rate");
+        setFromParameter(downDelayInput, "VALUE", NAME"-downlink-delay");
+        setFromParameter(downQueueInput, "VALUE", NAME"-downlink-queue");
+    }
+
+    return linkControlsBox;
+}
+#endif
+
+static void linkOpen(Link *link, DWORD now) {
+    link->bufHead = &link->headNode;
+    link->bufTail = &link->tailNode;
+    link->bufHead->next = link->bufTail;
+    link->bufTail->prev = link->bufHead;
+    link->bufSize = 0;
+    link->departUs = 0;
+    link->lastRelease = now;
+}
+
+// everything still on the link goes out now, in order. the list sends from
+// the tail so each goes in ahead of the one before it
+static void linkFlush(Link *link, PacketNode *tail) {
+    PacketNode *pac, *at = tail;
+    while (link->bufHead->next != link->bufTail) {
+        pac = popNode(link->bufHead->next);
+        budgetRefund(&linkModule, pac);
+        insertBefore(pac, at);
+        at = pac;
+    }
+    link->bufSize = 0;
+}
+
+static void linkStartUp() {
+    baseMs = clockMs();
+    linkOpen(&uplink, baseMs);
+    linkOpen(&downlink, baseMs);
+    startTimePeriod();
+    LOG("link enabled");
+}
+
+static void linkCloseDown(PacketNode *head, PacketNode *tail) {
+    UNREFERENCED_PARAMETER(head);
+    LOG("Closing down link, flushing %d packets", uplink.bufSize + downlink.bufSize);
+    linkFlush(&uplink, tail);
+    linkFlush(&downlink, tail);
+    STATS_BUFFERED(linkModule, 0);
+    endTimePeriod();
+}
+
+// schedules pac on the link, FALSE if it's to be dropped
+static BOOL linkEnqueue(Link *link, PacketNode *pac, DWORD now, LONGLONG nowUs) {
+    LONG rate = link->rate, queue = link->queue;
+    LONGLONG start = link->departUs > nowUs ? link->departUs : nowUs;
+    DWORD release;
+    // bytes still waiting to be serialized, as the departure clock has it
+    if (queue > 0 && rate > 0
+        && (start - nowUs) * rate / 8000 + pac->packetLen > (LONGLONG)queue * 1024) {
+        return FALSE;
+    }
+    if (budgetExceeded()) {
+        return FALSE;
+    }
+    if (rate > 0) {
+        start += (LONGLONG)pac->packetLen * 8000 / rate;
+    }
+    link->departUs = start;
+    // the engine steps in milliseconds, round up so nothing arrives early
+    release = baseMs + (DWORD)((start + 999) / 1000) + link->delay;
+    if ((LONG)(release - link->lastRelease) < 0) {
+        release = link->lastRelease;
+    }
+    link->lastRelease = release;
+    pac->timestamp = release;
+    pac->intendedUs += (release - now) * 1000;
+    budgetCharge(&linkModule, pac);
+    insertBefore(pac, link->bufTail);
+    ++link->bufSize;
+    return TRUE;
+}
+
+// due packets go ahead of this step's, the list sends from the tail
+static void linkRelease(Link *link, PacketNode *tail, DWORD now) {
+    PacketNode *pac, *at = tail;
+    while (link->bufSize > 0 && (LONG)(now - link->bufHead->next->timestamp) >= 0) {
+        pac = popNode(link->bufHead->next);
+        budgetRefund(&linkModule, pac);
+        insertBefore(pac, at);
+        at = pac;
+        --link->bufSize;
+    }
+    if (link->bufSize > 0) {
+        clockWakeAt(link->bufHead->next->timestamp);
+    }
+}
+
+static short linkProcess(PacketNode *head, PacketNode *tail) {
+    DWORD now = clockMs();
+    LONGLONG nowUs = (LONGLONG)(LONG)(now - baseMs) * 1000;
+    PacketNode *pac = head->next, *next;
+    int dropped = 0;
+
+    while (pac != tail) {
+        next = pac->next;
+        if (checkDirection(pac->addr.Outbound, linkInbound, linkOutbound)) {
+            STATS_SEEN(linkModule, pac);
+            popNode(pac);
+            if (linkEnqueue(pac->addr.Outbound ? &uplink : &downlink, pac, now, nowUs)) {
+                PACKET_NOTE(pac, NOTE_DELAYED);
+                STATS_ADD(linkModule, delayed, 1);
+            } else {
+                LOG("link queue full, dropped %s packet", pac->addr.Outbound ? "OUTBOUND" : "INBOUND");
+                dropNode(pac);
+                ++dropped;
+            }
+        }
+        pac = next;
+    }
+
+    linkRelease(&uplink, tail, now);
+    linkRelease(&downlink, tail, now);
+    STATS_ADD(linkModule, dropped, dropped);
+    STATS_BUFFERED(linkModule, uplink.bufSize + downlink.bufSize);
+    return dropped > 0 || uplink.bufSize + downlink.bufSize > 0;
+}
+
+static ModuleParam linkParams[] = {
+    {"inbound", PARAM_TOGGLE, &linkInbound, NULL, NULL},
+    {"outbound", PARAM_TOGGLE, &linkOutbound, NULL, NULL},
+    {"uplink-rate", PARAM_INT32, &uplink.rate, RATE_MIN, RATE_MAX},
+    {"uplink-delay", PARAM_SHORT, &uplink.delay, DELAY_MIN, DELAY_MAX},
+    {"uplink-queue", PARAM_INT32, &uplink.queue, QUEUE_MIN, QUEUE_MAX},
+    {"downlink-rate", PARAM_INT32, &downlink.rate, RATE_MIN, RATE_MAX},
+    {"downlink-delay", PARAM_SHORT, &downlink.delay, DELAY_MIN, DELAY_MAX},
+    {"downlink-queue", PARAM_INT32, &downlink.queue, QUEUE_MIN, QUEUE_MAX},
+    {NULL}
+};
+
+Module linkModule = {
+    "Link",
+    NAME,
+    (short*)&linkEnabled,
+    MODULE_UI(linkSetupUI),
+    linkStartUp,
+    linkCloseDown,
+    linkProcess,
+    linkParams,
+    // runtime fields
+    0, 0, NULL, NULL, 0, 0
+};
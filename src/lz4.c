@@ -0,0 +1,161 @@
+// lz4 block format codec, just what compress.c needs. greedy single probe
+// matcher, the output is a plain lz4 block any lz4 decoder takes.
+// https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+#include <string.h>
+#include "common.h"
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // the block ends in at least this many literals
+#define LZ4_MF_LIMIT 12 // and the last match starts at least this far from the end
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+// skip ahead faster the longer nothing matches, like lz4 does
+#define LZ4_SKIP_TRIGGER 6
+
+static UINT32 read32(const UINT8 *p) {
+    UINT32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static UINT hashSeq(UINT32 seq) {
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+// 15 in the token, then 255s and the remainder
+static UINT8* writeLength(UINT8 *op, UINT len) {
+    for (len -= 15; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (UINT8)len;
+    return op;
+}
+
+// worst case size of a sequence with these lengths
+static UINT sequenceSize(UINT litLen, UINT matchLen) {
+    return 1 + litLen + (litLen + 240) / 255 + 2 + (matchLen + 240) / 255;
+}
+
+// returns the compressed length, 0 if it doesn't fit in dstCap
+int lz4Compress(const char *src, int srcLen, char *dst, int dstCap) {
+    const UINT8 *base = (const UINT8*)src, *ip = base, *anchor = base, *end = base + srcLen;
+    const UINT8 *mfLimit = end - LZ4_MF_LIMIT, *matchLimit = end - LZ4_LAST_LITERALS;
+    const UINT8 *ref, *mp, *mr;
+    UINT8 *op = (UINT8*)dst, *opEnd = (UINT8*)dst + dstCap, *token;
+    UINT32 table[1 << LZ4_HASH_BITS], seq;
+    UINT litLen, matchLen, offset, h;
+
+    memset(table, 0, sizeof(table));
+    while (srcLen > LZ4_MF_LIMIT && ip < mfLimit) {
+        seq = read32(ip);
+        h = hashSeq(seq);
+        ref = base + table[h];
+        table[h] = (UINT32)(ip - base);
+        if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != seq) {
+            ip += 1 + ((ip - anchor) >> LZ4_SKIP_TRIGGER);
+            continue;
+        }
+        // grow the match both ways
+        while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+            --ip;
+            --ref;
+        }
+        for (mp = ip + LZ4_MIN_MATCH, mr = ref + LZ4_MIN_MATCH; mp < matchLimit && *mp == *mr; ++mp, ++mr);
+
+        litLen = (UINT)(ip - anchor);
+        matchLen = (UINT)(mp - ip) - LZ4_MIN_MATCH;
+        offset = (UINT)(ip - ref);
+        if (sequenceSize(litLen, matchLen) > (UINT)(opEnd - op)) {
+            return 0;
+        }
+        token = op++;
+        *token = (UINT8)((litLen >= 15 ? 15 : litLen) << 4);
+        if (litLen >= 15) {
+            op = writeLength(op, litLen);
+        }
+        memcpy(op, anchor, litLen);
+        op += litLen;
+        *op++ = (UINT8)offset;
+        *op++ = (UINT8)(offset >> 8);
+        *token |= (UINT8)(matchLen >= 15 ? 15 : matchLen);
+        if (matchLen >= 15) {
+            op = writeLength(op, matchLen);
+        }
+        ip = anchor = mp;
+    }
+
+    // the rest goes as literals
+    litLen = (UINT)(end - anchor);
+    if (1 + litLen + (litLen + 240) / 255 > (UINT)(opEnd - op)) {
+        return 0;
+    }
+    token = op++;
+    *token = (UINT8)((litLen >= 15 ? 15 : litLen) << 4);
+    if (litLen >= 15) {
+        op = writeLength(op, litLen);
+    }
+    memcpy(op, anchor, litLen);
+    op += litLen;
+    return (int)(op - (UINT8*)dst);
+}
+
+static BOOL readLength(const UINT8 **ip, const UINT8 *ipEnd, UINT *len) {
+    UINT8 b;
+    do {
+        if (*ip >= ipEnd) {
+            return FALSE;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return TRUE;
+}
+
+// returns the decompressed length, -1 if src isn't a valid block for dst
+int lz4Decompress(const char *src, int srcLen, char *dst, int dstLen) {
+    const UINT8 *ip = (const UINT8*)src, *ipEnd = ip + srcLen, *ref;
+    UINT8 *op = (UINT8*)dst, *opEnd = op + dstLen, token;
+    UINT len, offset, chunk;
+
+    while (ip < ipEnd) {
+        token = *ip++;
+        len = token >> 4;
+        if (len == 15 && !readLength(&ip, ipEnd, &len)) {
+            return -1;
+        }
+        if (len > (UINT)(ipEnd - ip) || len > (UINT)(opEnd - op)) {
+            return -1;
+        }
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+        if (ip == ipEnd) {
+            break;
+        }
+
+        if (ipEnd - ip < 2) {
+            return -1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (UINT)(op - (UINT8*)dst)) {
+            return -1;
+        }
+        len = token & 15;
+        if (len == 15 && !readLength(&ip, ipEnd, &len)) {
+            return -1;
+        }
+        len += LZ4_MIN_MATCH;
+        if (len > (UINT)(opEnd - op)) {
+            return -1;
+        }
+        // may overlap what it writes. what's been copied repeats the pattern,
+        // so every chunk can be twice the last and never overlap
+        for (ref = op - offset; len > 0; len -= chunk) {
+            chunk = (UINT)(op - ref) < len ? (UINT)(op - ref) : len;
+            memcpy(op, ref, chunk);
+            op += chunk;
+        }
+    }
+    return (int)(op - (UINT8*)dst);
+}
@@ -6,24 +6,10 @@
 #include "iup.h"
 #include "common.h"
 
-// ! the order decides which module get processed first
-Module* modules[MODULE_CNT] = {
-    &lagModule,
-    &dropModule,
-    &throttleModule,
-    &dupModule,
-    &oodModule,
-    &tamperModule,
-    &resetModule,
-	&bandwidthModule,
-};
-
-volatile short sendState = SEND_STATUS_NONE;
-
 // global iup handlers
 static Ihandle *dialog, *topFrame, *bottomFrame; 
 static Ihandle *statusLabel;
-static Ihandle *filterText, *filterButton;
+static Ihandle *filterText, *filterButton, *applyButton;
 Ihandle *filterSelectList;
 // timer to update icons
 static Ihandle *stateIcon;
@@ -34,6 +20,7 @@ void showStatus(const char *line);
 static int uiOnDialogShow(Ihandle *ih, int state);
 static int uiStopCb(Ihandle *ih);
 static int uiStartCb(Ihandle *ih);
+static int uiApplyCb(Ihandle *ih);
 static int uiTimerCb(Ihandle *ih);
 static int uiTimeoutCb(Ihandle *ih);
 static int uiListSelectCb(Ihandle *ih, char *text, int item, int state);
@@ -123,7 +110,8 @@ void init(int argc, char* argv[]) {
     UINT ix;
     Ihandle *topVbox, *bottomVbox, *dialogVBox, *controlHbox;
     Ihandle *noneIcon, *doingIcon, *errorIcon;
-    char* arg_value = NULL;
+    const char* arg_value = NULL;
+    char orderError[MSG_BUFSIZE];
 
     // fill in config
     loadConfig();
@@ -143,6 +131,7 @@ void init(int argc, char* argv[]) {
             controlHbox = IupHbox(
                 stateIcon = IupLabel(NULL),
                 filterButton = IupButton("Start", NULL),
+                applyButton = IupButton("Apply", NULL),
                 IupFill(),
                 IupLabel("Presets:  "),
                 filterSelectList = IupList(NULL),
@@ -163,6 +152,12 @@ void init(int argc, char* argv[]) {
         }
         parameterized = 1;
     }
+    // module rows below show in processing order
+    arg_value = getArg("module-order");
+    if (arg_value != NULL && !setModuleOrder(arg_value, orderError)) {
+        fprintf(stderr, "%s", orderError);
+        exit(-1);
+    }
 
     IupSetAttribute(topFrame, "TITLE", "Filtering");
     IupSetAttribute(topFrame, "EXPAND", "HORIZONTAL");
@@ -170,6 +165,10 @@ void init(int argc, char* argv[]) {
     IupSetCallback(filterText, "VALUECHANGED_CB", (Icallback)uiFilterTextCb);
     IupSetAttribute(filterButton, "PADDING", "8x");
     IupSetCallback(filterButton, "ACTION", uiStartCb);
+    // switches the filter while running, see divertSwitchFilter
+    IupSetAttribute(applyButton, "PADDING", "8x");
+    IupSetAttribute(applyButton, "ACTIVE", "NO");
+    IupSetCallback(applyButton, "ACTION", uiApplyCb);
     IupSetAttribute(topVbox, "NCMARGIN", "4x4");
     IupSetAttribute(topVbox, "NCGAP", "4x2");
     IupSetAttribute(controlHbox, "ALIGNMENT", "ACENTER");
@@ -247,7 +246,7 @@ void init(int argc, char* argv[]) {
     IupSetCallback(timer, "ACTION_CB", uiTimerCb);
 
     // setup timeout of program
-    arg_value = IupGetGlobal("timeout");
+    arg_value = getArg("timeout");
     if(arg_value != NULL)
     {
         char valueBuf[16];
@@ -261,9 +260,22 @@ void init(int argc, char* argv[]) {
 }
 
 void startup() {
+    const char *controlName, *scenarioPath;
+    char buf[MSG_BUFSIZE];
     // initialize seed
     srand((unsigned int)time(NULL));
 
+    // scenarios and scripts on the control channel can drive modules while the
+    // ui is up. note the ui controls don't follow changes made this way
+    scenarioPath = getArg("scenario");
+    if (scenarioPath != NULL && !scenarioLoad(scenarioPath, buf)) {
+        showStatus(buf);
+    }
+    controlName = getArg("control");
+    if (controlName != NULL && !controlStart(controlName, buf)) {
+        showStatus(buf);
+    }
+
     // kickoff event loops
     IupShowXY(dialog, IUP_CENTER, IUP_CENTER);
     IupMainLoop();
@@ -271,6 +283,7 @@ void startup() {
 }
 
 void cleanup() {
+    controlStop();
 
     IupDestroy(timer);
     if (timeout) {
@@ -367,7 +380,8 @@ static int uiStartCb(Ihandle *ih) {
 
     // successfully started
     showStatus("Started filtering. Enable functionalities to take effect.");
-    IupSetAttribute(filterText, "ACTIVE", "NO");
+    // criteria stay editable, Apply switches to them without stopping
+    IupSetAttribute(applyButton, "ACTIVE", "YES");
     IupSetAttribute(filterButton, "TITLE", "Stop");
     IupSetCallback(filterButton, "ACTION", uiStopCb);
     IupSetAttribute(timer, "RUN", "YES");
@@ -375,16 +389,27 @@ static int uiStartCb(Ihandle *ih) {
     return IUP_DEFAULT;
 }
 
+static int uiApplyCb(Ihandle *ih) {
+    char buf[MSG_BUFSIZE];
+    UNREFERENCED_PARAMETER(ih);
+    if (!divertSwitchFilter(IupGetAttribute(filterText, "VALUE"), buf)) {
+        showStatus(buf);
+        return IUP_DEFAULT;
+    }
+    showStatus("Switched filter. Packets held by functionalities carry over.");
+    return IUP_DEFAULT;
+}
+
 static int uiStopCb(Ihandle *ih) {
     int ix;
     UNREFERENCED_PARAMETER(ih);
     
     // try stopping
     IupSetAttribute(filterButton, "ACTIVE", "NO");
+    IupSetAttribute(applyButton, "ACTIVE", "NO");
     IupFlush(); // flush to show disabled state
     divertStop();
 
-    IupSetAttribute(filterText, "ACTIVE", "YES");
     IupSetAttribute(filterButton, "TITLE", "Start");
     IupSetAttribute(filterButton, "ACTIVE", "YES");
     IupSetCallback(filterButton, "ACTION", uiStartCb);
@@ -409,17 +434,32 @@ static int uiToggleControls(Ihandle *ih, int state) {
     if (controlsActive && !state) {
         IupSetAttribute(controls, "ACTIVE", "NO");
         InterlockedExchange16(target, I2S(state));
+        MODULES_CHANGED();
     } else if (!controlsActive && state) {
         IupSetAttribute(controls, "ACTIVE", "YES");
         InterlockedExchange16(target, I2S(state));
+        MODULES_CHANGED();
     }
 
     return IUP_DEFAULT;
 }
 
 static int uiTimerCb(Ihandle *ih) {
+    static BOOL lastBypassing;
     int ix;
+    char statsBuf[MSG_BUFSIZE];
+    EngineStats stats;
     UNREFERENCED_PARAMETER(ih);
+    // tell when overload protection kicks in or lets go
+    if (divertBypassing() != lastBypassing) {
+        lastBypassing = !lastBypassing;
+        divertReadStats(&stats);
+        sprintf(statsBuf, lastBypassing
+            ? "Overloaded, passing packets through untouched for now (episode %llu)."
+            : "Recovered from overload, functionalities are back on (%llu episodes so far).",
+            (unsigned long long)stats.bypassEpisodes);
+        showStatus(statsBuf);
+    }
     for (ix = 0; ix < MODULE_CNT; ++ix) {
         if (modules[ix]->processTriggered) {
             IupSetAttribute(modules[ix]->iconHandle, "IMAGE", "doing_icon");
@@ -427,6 +467,9 @@ static int uiTimerCb(Ihandle *ih) {
         } else {
             IupSetAttribute(modules[ix]->iconHandle, "IMAGE", "none_icon");
         }
+        // hovering the icon shows the module counters
+        statsFormat(modules[ix], statsBuf, MSG_BUFSIZE);
+        IupStoreAttribute(modules[ix]->iconHandle, "TIP", statsBuf);
     }
 
     // update global send status icon
@@ -497,7 +540,16 @@ static void uiSetupModule(Module *module, Ihandle *parent) {
 
     // parameterize toggle
     if (parameterized) {
+        ModuleParam *param;
+        char key[NAME_SIZE * 2];
         setFromParameter(toggle, "VALUE", module->shortName);
+        // choices have no widget, take them from the arguments as they are
+        for (param = module->params; param && param->name; ++param) {
+            sprintf(key, "%s-%s", module->shortName, param->name);
+            if (param->type == PARAM_CHOICE && getArg(key)) {
+                setByKey(key, getArg(key));
+            }
+        }
     }
 }
 
@@ -0,0 +1,142 @@
+// mock backend, generates synthetic udp traffic and swallows whatever is sent.
+// lets the engine and modules run without WinDivert, e.g. headless on linux.
+// the capture filter is ignored.
+// options:
+//   --mock-rate     packets per second, default 1000
+//   --mock-size     ip packet size in bytes, default 512
+//   --mock-inbound  percentage of packets marked as inbound, default 50
+//   --mock-count    end input after this many packets, 0 for unlimited
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+#include "common.h"
+
+#define MOCK_RATE_DEFAULT 1000
+#define MOCK_SIZE_DEFAULT 512
+#define MOCK_INBOUND_DEFAULT 50
+#define MOCK_HEADER_SIZE (sizeof(WINDIVERT_IPHDR) + sizeof(WINDIVERT_UDPHDR))
+
+static volatile short mockClosed;
+static UINT mockRate, mockSize, mockInbound;
+static UINT64 mockCount, mockSeq;
+static LONGLONG mockStartTick, mockFrequency;
+
+static UINT argOr(const char *key, UINT defaultValue) {
+    const char *value = getArg(key);
+    return value ? (UINT)strtoul(value, NULL, 10) : defaultValue;
+}
+
+static BOOL mockOpen(const char *filter, char buf[]) {
+    LARGE_INTEGER tick;
+    UNREFERENCED_PARAMETER(filter);
+    mockRate = argOr("mock-rate", MOCK_RATE_DEFAULT);
+    mockSize = argOr("mock-size", MOCK_SIZE_DEFAULT);
+    mockInbound = argOr("mock-inbound", MOCK_INBOUND_DEFAULT);
+    mockCount = argOr("mock-count", 0);
+    if (mockRate == 0 || mockSize < MOCK_HEADER_SIZE + sizeof(UINT32) || mockSize > 0xFFFF) {
+        sprintf(buf, "Invalid mock options: rate must be > 0 and size in [%d, 65535].",
+            (int)(MOCK_HEADER_SIZE + sizeof(UINT32)));
+        return FALSE;
+    }
+
+    QueryPerformanceFrequency(&tick);
+    mockFrequency = tick.QuadPart;
+    QueryPerformanceCounter(&tick);
+    mockStartTick = tick.QuadPart;
+    mockSeq = 0;
+    mockClosed = 0;
+    LOG("mock backend: %u pkt/s, %u bytes, %u%% inbound", mockRate, mockSize, mockInbound);
+    return TRUE;
+}
+
+static void buildPacket(char *buf, UINT64 seq, BOOL inbound) {
+    PWINDIVERT_IPHDR ip = (PWINDIVERT_IPHDR)buf;
+    PWINDIVERT_UDPHDR udp = (PWINDIVERT_UDPHDR)(buf + sizeof(WINDIVERT_IPHDR));
+    UINT32 *payload = (UINT32*)(buf + MOCK_HEADER_SIZE);
+    // 10.0.0.1:5000 is the local end
+    UINT32 local = htonl(0x0A000001), remote = htonl(0x0A000002);
+
+    memset(buf, 0, mockSize);
+    ip->Version = 4;
+    ip->HdrLength = sizeof(WINDIVERT_IPHDR) / 4;
+    ip->Length = htons((UINT16)mockSize);
+    ip->Id = htons((UINT16)seq);
+    ip->TTL = 64;
+    ip->Protocol = 17;
+    ip->SrcAddr = inbound ? remote : local;
+    ip->DstAddr = inbound ? local : remote;
+    udp->SrcPort = htons(inbound ? 6000 : 5000);
+    udp->DstPort = htons(inbound ? 5000 : 6000);
+    udp->Length = htons((UINT16)(mockSize - sizeof(WINDIVERT_IPHDR)));
+    *payload = htonl((UINT32)seq);
+    WinDivertHelperCalcChecksums(buf, mockSize, NULL, 0);
+}
+
+static int mockRecv(char *buf, UINT bufLen, UINT *readLen, WINDIVERT_ADDRESS *addr) {
+    LARGE_INTEGER now;
+    LONGLONG due;
+    BOOL inbound;
+    assert(bufLen >= mockSize);
+    UNREFERENCED_PARAMETER(bufLen);
+
+    // pace packets evenly, catching up without sleeping when behind. the
+    // virtual clock goes by the timestamps instead
+    for (;;) {
+        if (mockClosed) {
+            return RECV_STATUS_CLOSED;
+        }
+        if (mockCount && mockSeq >= mockCount) {
+            return RECV_STATUS_EOF;
+        }
+        if (clockIsVirtual()) {
+            break;
+        }
+        QueryPerformanceCounter(&now);
+        due = mockStartTick + (LONGLONG)(mockSeq / mockRate) * mockFrequency
+            + (LONGLONG)(mockSeq % mockRate) * mockFrequency / mockRate;
+        if (now.QuadPart >= due) {
+            break;
+        }
+        Sleep((DWORD)((due - now.QuadPart) * 1000 / mockFrequency));
+    }
+
+    inbound = (UINT)(mockSeq % 100) < mockInbound;
+    buildPacket(buf, mockSeq, inbound);
+    memset(addr, 0, sizeof(WINDIVERT_ADDRESS));
+    addr->Outbound = !inbound;
+    addr->IPChecksum = addr->UDPChecksum = 1;
+    addr->Timestamp = (INT64)(mockSeq / mockRate) * 1000000 + (INT64)(mockSeq % mockRate) * 1000000 / mockRate;
+    *readLen = mockSize;
+    ++mockSeq;
+    return RECV_STATUS_OK;
+}
+
+static short mockSend(PacketNode *pnode) {
+    // nothing to deliver to, the engine counts what went through
+    UNREFERENCED_PARAMETER(pnode);
+    return SEND_STATUS_SEND;
+}
+
+static void mockClose() {
+    InterlockedExchange16(&mockClosed, 1);
+}
+
+Backend mockBackend = {
+    "mock",
+    mockOpen,
+    mockRecv,
+    mockSend,
+    mockClose,
+    1,
+    1,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
@@ -0,0 +1,575 @@
+// linux netfilter queue backend. iptables or nftables rules send packets to a
+// queue and they go back with a verdict, so packets held by modules stay in
+// the kernel until released, inbound ones included. speaks nfnetlink directly,
+// no library needed. needs root or CAP_NET_ADMIN.
+//   --nfq-queue   queue number, default 0
+//   --nfq-maxlen  packets the kernel holds for us, default 65536, rounded up to
+//                 a power of 2. past that the queue fails open and packets
+//                 skip clumsy rather than stall
+// the capture filter is ignored, the rules pick the traffic. for loopback udp:
+//   iptables -A OUTPUT -o lo -p udp --dport 9111 -m mark ! --mark 0x636c -j NFQUEUE --queue-num 0
+// each packet takes one verdict, so copies made by modules like duplicate go
+// out through a raw socket instead, marked 0x636c for the rules to let pass.
+// copies of inbound packets from other hosts can't be injected that way and
+// are counted as failed sends.
+// a recv drains as many queued packets as one read returns, and verdicts are
+// written once per engine step, runs of untouched packets as one batch verdict.
+#ifdef __linux__
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_queue.h>
+#include "common.h"
+
+#define NFQ_QUEUE_DEFAULT 0
+#define NFQ_MAXLEN_DEFAULT 65536
+#define NFQ_MAXLEN_MAX (1 << 20)
+#define NFQ_MARK 0x636C
+#define NFQ_RECV_BUFSIZE (1024 * 1024)
+#define NFQ_SOCKET_BUFSIZE (16 * 1024 * 1024)
+#define NFQ_SEND_BUFSIZE (256 * 1024)
+#define NFQ_RECV_TIMEOUT_MS 100
+#define NFQ_UNTRACKED_MAX 4096 // a power of 2
+#ifndef IPV6_HDRINCL
+#define IPV6_HDRINCL 36
+#endif
+
+// what the backend keeps in a packet's address, copied along with duplicates
+#define NFQ_FROM_QUEUE 0x1 // Reserved2 is the queue's packet id
+#define NFQ_TRACKED 0x2 // the id is in the window below, otherwise in the untracked ring
+
+// state of each id from the lowest one possibly still queued. slots below the
+// window are all ID_FREE, so it slides on without clearing
+#define ID_FREE 0 // got its verdict, or never came to us
+#define ID_QUEUED 1 // held in the kernel
+#define ID_ACCEPT 2 // accepted untouched, the verdict goes with the next flush
+
+static int nlFd = -1, rawFd = -1, raw6Fd = -1;
+static UINT16 queueNum;
+static UINT32 windowMask;
+static UINT8 idStates[NFQ_MAXLEN_MAX];
+// the read loop adds ids at nextId, the engine retires them from lowId
+static UINT32 lowId, pendingAccepts;
+static volatile UINT32 nextId;
+static BOOL idsStarted;
+// ids that came in too far past lowId for the window, in the order read. the
+// read loop adds them at the tail, the engine marks them done as they get their
+// verdicts and moves the head past done ones. no batch verdict may reach the
+// lowest one still outstanding, the kernel would take it with the batch
+static UINT32 untrackedIds[NFQ_UNTRACKED_MAX];
+static BOOL untrackedDone[NFQ_UNTRACKED_MAX];
+static volatile UINT32 untrackedHead, untrackedTail;
+static UINT64 modifiedNotes;
+static int loopbackIndex;
+static char recvBuf[NFQ_RECV_BUFSIZE];
+static size_t recvLen, recvPos;
+static char sendBuf[NFQ_SEND_BUFSIZE];
+static size_t sendLen;
+static volatile short nfqClosed;
+static UINT64 batchVerdicts, singleVerdicts, injected, overruns, verdictErrors;
+
+static struct nlmsghdr* putHeader(char *buf, UINT16 type) {
+    struct nlmsghdr *nlh = (struct nlmsghdr*)buf;
+    struct nfgenmsg *nfg;
+    nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    nlh->nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | type;
+    nlh->nlmsg_flags = NLM_F_REQUEST;
+    nlh->nlmsg_seq = 0;
+    nlh->nlmsg_pid = 0;
+    nfg = (struct nfgenmsg*)NLMSG_DATA(nlh);
+    nfg->nfgen_family = AF_UNSPEC;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(queueNum);
+    return nlh;
+}
+
+static void putAttr(struct nlmsghdr *nlh, UINT16 type, const void *data, size_t len) {
+    struct nlattr *attr = (struct nlattr*)((char*)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+    attr->nla_type = type;
+    attr->nla_len = (UINT16)(NLA_HDRLEN + len);
+    memcpy((char*)attr + NLA_HDRLEN, data, len);
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(attr->nla_len);
+}
+
+static size_t verdictSize(UINT packetLen) {
+    return NLMSG_SPACE(sizeof(struct nfgenmsg)) + NLA_ALIGN(NLA_HDRLEN + sizeof(struct nfqnl_msg_verdict_hdr))
+        + NLA_ALIGN(NLA_HDRLEN + packetLen);
+}
+
+static void writeVerdicts() {
+    if (sendLen && send(nlFd, sendBuf, sendLen, 0) < 0) {
+        LOG("nfq failed to send verdicts (%d)", errno);
+    }
+    sendLen = 0;
+}
+
+// queue a verdict for the next write, with the packet when modules changed it
+static void putVerdict(UINT16 type, UINT32 id, UINT32 verdict, PacketNode *pnode) {
+    struct nlmsghdr *nlh;
+    struct nfqnl_msg_verdict_hdr hdr;
+    if (sendLen + verdictSize(pnode ? pnode->packetLen : 0) > NFQ_SEND_BUFSIZE) {
+        writeVerdicts();
+    }
+    nlh = putHeader(sendBuf + sendLen, type);
+    hdr.verdict = htonl(verdict);
+    hdr.id = htonl(id);
+    putAttr(nlh, NFQA_VERDICT_HDR, &hdr, sizeof(hdr));
+    if (pnode) {
+        putAttr(nlh, NFQA_PAYLOAD, pnode->packet, pnode->packetLen);
+    }
+    sendLen += NLMSG_ALIGN(nlh->nlmsg_len);
+    if (type == NFQNL_MSG_VERDICT_BATCH) {
+        ++batchVerdicts;
+    } else {
+        ++singleVerdicts;
+    }
+}
+
+// verdict right away from the read loop, for packets the engine never sees
+static void verdictNow(UINT32 id, UINT32 verdict) {
+    char buf[NLMSG_SPACE(sizeof(struct nfgenmsg)) + NLA_ALIGN(NLA_HDRLEN + sizeof(struct nfqnl_msg_verdict_hdr))];
+    struct nlmsghdr *nlh = putHeader(buf, NFQNL_MSG_VERDICT);
+    struct nfqnl_msg_verdict_hdr hdr;
+    hdr.verdict = htonl(verdict);
+    hdr.id = htonl(id);
+    putAttr(nlh, NFQA_VERDICT_HDR, &hdr, sizeof(hdr));
+    send(nlFd, buf, nlh->nlmsg_len, 0);
+}
+
+// lowest untracked id still waiting for its verdict, FALSE if there's none.
+// read after nextId, so every untracked id below it is in the ring
+static BOOL lowestUntracked(UINT32 *low) {
+    UINT32 tail = __atomic_load_n(&untrackedTail, __ATOMIC_ACQUIRE), ix;
+    BOOL found = FALSE;
+    for (ix = untrackedHead; ix != tail; ++ix) {
+        if (!untrackedDone[ix & (NFQ_UNTRACKED_MAX - 1)]
+            && (!found || (INT32)(untrackedIds[ix & (NFQ_UNTRACKED_MAX - 1)] - *low) < 0)) {
+            *low = untrackedIds[ix & (NFQ_UNTRACKED_MAX - 1)];
+            found = TRUE;
+        }
+    }
+    return found;
+}
+
+// the untracked id's verdict is taken now, FALSE if it's had one already
+static BOOL takeUntracked(UINT32 id) {
+    UINT32 tail = __atomic_load_n(&untrackedTail, __ATOMIC_ACQUIRE), ix;
+    for (ix = untrackedHead; ix != tail; ++ix) {
+        if (!untrackedDone[ix & (NFQ_UNTRACKED_MAX - 1)] && untrackedIds[ix & (NFQ_UNTRACKED_MAX - 1)] == id) {
+            untrackedDone[ix & (NFQ_UNTRACKED_MAX - 1)] = TRUE;
+            break;
+        }
+    }
+    if (ix == tail) {
+        return FALSE;
+    }
+    // free the done ones at the head for the read loop
+    for (ix = untrackedHead; ix != tail && untrackedDone[ix & (NFQ_UNTRACKED_MAX - 1)]; ++ix) {
+        untrackedDone[ix & (NFQ_UNTRACKED_MAX - 1)] = FALSE;
+    }
+    __atomic_store_n(&untrackedHead, ix, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+// turn pending accepts into verdicts. the ones at the bottom of the window go
+// as one batch verdict, which takes every queued id up to it, the ones behind
+// a packet still held go one by one
+static void putAccepts() {
+    UINT32 high = __atomic_load_n(&nextId, __ATOMIC_ACQUIRE), id, batchTop = 0, untrackedLow = 0;
+    BOOL batch = FALSE, bounded;
+    UINT8 *state;
+    if (pendingAccepts == 0) {
+        return;
+    }
+    bounded = lowestUntracked(&untrackedLow);
+    while (lowId != high) {
+        state = &idStates[lowId & windowMask];
+        if (*state == ID_QUEUED) {
+            break;
+        }
+        // an untracked id is held here, its slot doesn't say so
+        if (bounded && (INT32)(lowId - untrackedLow) >= 0) {
+            break;
+        }
+        if (*state == ID_ACCEPT) {
+            *state = ID_FREE;
+            --pendingAccepts;
+            batchTop = lowId;
+            batch = TRUE;
+        }
+        ++lowId;
+    }
+    if (batch) {
+        putVerdict(NFQNL_MSG_VERDICT_BATCH, batchTop, NF_ACCEPT, NULL);
+    }
+    for (id = lowId; id != high && pendingAccepts; ++id) {
+        state = &idStates[id & windowMask];
+        if (*state == ID_ACCEPT) {
+            *state = ID_FREE;
+            --pendingAccepts;
+            putVerdict(NFQNL_MSG_VERDICT, id, NF_ACCEPT, NULL);
+        }
+    }
+}
+
+// the packet's own verdict is still to be given, and it's taken now
+static BOOL takeQueued(WINDIVERT_ADDRESS *addr) {
+    UINT8 *state;
+    if (!(addr->Reserved1 & NFQ_FROM_QUEUE)) {
+        return FALSE;
+    }
+    if (!(addr->Reserved1 & NFQ_TRACKED)) {
+        return takeUntracked(addr->Reserved2);
+    }
+    state = &idStates[addr->Reserved2 & windowMask];
+    if (*state != ID_QUEUED) {
+        return FALSE;
+    }
+    *state = ID_FREE;
+    return TRUE;
+}
+
+static BOOL configure(struct nlmsghdr *nlh, char buf[]) {
+    char reply[NLMSG_SPACE(sizeof(struct nlmsgerr)) + 256];
+    struct nlmsghdr *answer = (struct nlmsghdr*)reply;
+    ssize_t len;
+    int error;
+    nlh->nlmsg_flags |= NLM_F_ACK;
+    if (send(nlFd, nlh, nlh->nlmsg_len, 0) < 0) {
+        sprintf(buf, "Failed to configure nfqueue %u (%d)", queueNum, errno);
+        return FALSE;
+    }
+    len = recv(nlFd, reply, sizeof(reply), 0);
+    if (len < (ssize_t)NLMSG_HDRLEN || answer->nlmsg_type != NLMSG_ERROR) {
+        sprintf(buf, "No reply configuring nfqueue %u, is nfnetlink_queue loaded?", queueNum);
+        return FALSE;
+    }
+    error = ((struct nlmsgerr*)NLMSG_DATA(answer))->error;
+    if (error != 0) {
+        sprintf(buf, "Failed to bind nfqueue %u (%d)%s", queueNum, -error,
+            error == -EPERM ? ", run as root" : error == -EBUSY ? ", queue taken by another process" : "");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL nfqOpen(const char *filter, char buf[]) {
+    const char *value;
+    struct sockaddr_nl local;
+    struct nfqnl_msg_config_cmd cmd;
+    struct nfqnl_msg_config_params params;
+    struct timeval timeout;
+    char msg[256];
+    struct nlmsghdr *nlh;
+    UINT32 maxlen = NFQ_MAXLEN_DEFAULT, flags;
+    int size = NFQ_SOCKET_BUFSIZE, on = 1, mark = NFQ_MARK, ix;
+
+    UNREFERENCED_PARAMETER(filter);
+    // the last run's read loop may have been in recv when it was closed
+    if (nlFd >= 0) {
+        close(nlFd);
+    }
+    value = getArg("nfq-queue");
+    queueNum = (UINT16)(value ? atoi(value) : NFQ_QUEUE_DEFAULT);
+    value = getArg("nfq-maxlen");
+    if (value) {
+        maxlen = (UINT32)strtoul(value, NULL, 10);
+    }
+    if (maxlen == 0 || maxlen > NFQ_MAXLEN_MAX) {
+        sprintf(buf, "--nfq-maxlen must be in [1, %d]", NFQ_MAXLEN_MAX);
+        return FALSE;
+    }
+    for (windowMask = 1; windowMask < maxlen; windowMask <<= 1);
+    maxlen = windowMask;
+    --windowMask;
+
+    nlFd = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER);
+    if (nlFd < 0) {
+        sprintf(buf, "Failed to open netfilter netlink socket (%d)", errno);
+        return FALSE;
+    }
+    // a burst the engine can't take right away waits here, not in the kernel
+    if (setsockopt(nlFd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) != 0) {
+        setsockopt(nlFd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    timeout.tv_sec = 0;
+    timeout.tv_usec = NFQ_RECV_TIMEOUT_MS * 1000;
+    setsockopt(nlFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    if (bind(nlFd, (struct sockaddr*)&local, sizeof(local)) != 0) {
+        sprintf(buf, "Failed to bind netfilter netlink socket (%d)", errno);
+        goto FAIL;
+    }
+
+    nlh = putHeader(msg, NFQNL_MSG_CONFIG);
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = NFQNL_CFG_CMD_BIND;
+    putAttr(nlh, NFQA_CFG_CMD, &cmd, sizeof(cmd));
+    params.copy_range = htonl(MAX_PACKETSIZE);
+    params.copy_mode = NFQNL_COPY_PACKET;
+    putAttr(nlh, NFQA_CFG_PARAMS, &params, sizeof(params));
+    maxlen = htonl(maxlen);
+    putAttr(nlh, NFQA_CFG_QUEUE_MAXLEN, &maxlen, sizeof(maxlen));
+    flags = htonl(NFQA_CFG_F_FAIL_OPEN);
+    putAttr(nlh, NFQA_CFG_FLAGS, &flags, sizeof(flags));
+    putAttr(nlh, NFQA_CFG_MASK, &flags, sizeof(flags));
+    if (!configure(nlh, buf)) {
+        goto FAIL;
+    }
+
+    // copies only, nfqueue alone still works without
+    if (rawFd < 0) {
+        rawFd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+        if (rawFd < 0 || setsockopt(rawFd, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) != 0) {
+            LOG("nfq can't inject ipv4 copies (%d)", errno);
+        }
+    }
+    if (raw6Fd < 0) {
+        raw6Fd = socket(AF_INET6, SOCK_RAW, IPPROTO_RAW);
+        if (raw6Fd < 0 || setsockopt(raw6Fd, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) != 0
+            || setsockopt(raw6Fd, IPPROTO_IPV6, IPV6_HDRINCL, &on, sizeof(on)) != 0) {
+            LOG("nfq can't inject ipv6 copies (%d)", errno);
+        }
+    }
+
+    modifiedNotes = 0;
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        modifiedNotes |= (UINT64)NOTE_MODIFIED << (ix * NOTE_BITS);
+    }
+    loopbackIndex = (int)if_nametoindex("lo");
+    memset(idStates, 0, sizeof(idStates));
+    idsStarted = FALSE;
+    lowId = nextId = pendingAccepts = 0;
+    untrackedHead = untrackedTail = 0;
+    memset(untrackedDone, 0, sizeof(untrackedDone));
+    recvLen = recvPos = sendLen = 0;
+    batchVerdicts = singleVerdicts = injected = overruns = verdictErrors = 0;
+    nfqClosed = 0;
+    LOG("nfq backend bound to queue %u, %u packets at most", queueNum, windowMask + 1);
+    return TRUE;
+
+FAIL:
+    close(nlFd);
+    nlFd = -1;
+    return FALSE;
+}
+
+// fill in the engine's view of a queued packet, FALSE if it can't take it
+static BOOL readPacket(struct nlmsghdr *nlh, char *buf, UINT bufLen, UINT *readLen, WINDIVERT_ADDRESS *addr) {
+    struct nfqnl_msg_packet_hdr *hdr = NULL;
+    struct nlattr *attr;
+    const char *payload = NULL;
+    UINT payloadLen = 0;
+    UINT32 indev = 0, outdev = 0, id;
+    int remaining = (int)nlh->nlmsg_len - NLMSG_SPACE(sizeof(struct nfgenmsg));
+    BOOL tracked;
+
+    attr = (struct nlattr*)((char*)NLMSG_DATA(nlh) + NLMSG_ALIGN(sizeof(struct nfgenmsg)));
+    while (remaining >= (int)sizeof(struct nlattr) && attr->nla_len >= sizeof(struct nlattr)
+        && attr->nla_len <= remaining) {
+        switch (attr->nla_type & NLA_TYPE_MASK) {
+        case NFQA_PACKET_HDR:
+            hdr = (struct nfqnl_msg_packet_hdr*)((char*)attr + NLA_HDRLEN);
+            break;
+        case NFQA_PAYLOAD:
+            payload = (char*)attr + NLA_HDRLEN;
+            payloadLen = attr->nla_len - NLA_HDRLEN;
+            break;
+        case NFQA_IFINDEX_INDEV:
+            memcpy(&indev, (char*)attr + NLA_HDRLEN, sizeof(indev));
+            indev = ntohl(indev);
+            break;
+        case NFQA_IFINDEX_OUTDEV:
+            memcpy(&outdev, (char*)attr + NLA_HDRLEN, sizeof(outdev));
+            outdev = ntohl(outdev);
+            break;
+        }
+        remaining -= NLA_ALIGN(attr->nla_len);
+        attr = (struct nlattr*)((char*)attr + NLA_ALIGN(attr->nla_len));
+    }
+    if (hdr == NULL) {
+        return FALSE;
+    }
+    id = ntohl(hdr->packet_id);
+    if (payload == NULL || payloadLen == 0 || payloadLen > bufLen) {
+        verdictNow(id, NF_ACCEPT);
+        return FALSE;
+    }
+
+    // ids only go up. one that would wrap onto a slot still in use skips the
+    // window and goes in the untracked ring, ahead of any later id reaching
+    // nextId. with that full too it's let through untouched
+    if (!idsStarted) {
+        lowId = nextId = id;
+        idsStarted = TRUE;
+    }
+    tracked = id - nextId < 0x80000000u && id - lowId <= windowMask;
+    if (tracked) {
+        idStates[id & windowMask] = ID_QUEUED;
+        __atomic_store_n(&nextId, id + 1, __ATOMIC_RELEASE);
+    } else if (untrackedTail - __atomic_load_n(&untrackedHead, __ATOMIC_ACQUIRE) < NFQ_UNTRACKED_MAX) {
+        untrackedIds[untrackedTail & (NFQ_UNTRACKED_MAX - 1)] = id;
+        __atomic_store_n(&untrackedTail, untrackedTail + 1, __ATOMIC_RELEASE);
+    } else {
+        ++overruns;
+        verdictNow(id, NF_ACCEPT);
+        return FALSE;
+    }
+
+    *readLen = payloadLen;
+    memcpy(buf, payload, payloadLen);
+    memset(addr, 0, sizeof(WINDIVERT_ADDRESS));
+    addr->Outbound = hdr->hook == NF_INET_LOCAL_OUT || hdr->hook == NF_INET_POST_ROUTING
+        || hdr->hook == NF_INET_FORWARD;
+    addr->Loopback = loopbackIndex && ((int)indev == loopbackIndex || (int)outdev == loopbackIndex);
+    addr->IPv6 = (payload[0] & 0xF0) == 0x60;
+    addr->Network.IfIdx = addr->Outbound ? outdev : indev;
+    addr->Reserved1 = NFQ_FROM_QUEUE | (tracked ? NFQ_TRACKED : 0);
+    addr->Reserved2 = id;
+    return TRUE;
+}
+
+static int nfqRecv(char *buf, UINT bufLen, UINT *readLen, WINDIVERT_ADDRESS *addr) {
+    struct nlmsghdr *nlh;
+    ssize_t len;
+    for (;;) {
+        if (nfqClosed) {
+            return RECV_STATUS_CLOSED;
+        }
+        // one read brings a whole batch, handed out one packet per call
+        if (recvPos >= recvLen) {
+            recvPos = recvLen = 0;
+            len = recv(nlFd, recvBuf, sizeof(recvBuf), 0);
+            if (len < 0) {
+                if (errno == ENOBUFS) {
+                    ++overruns;
+                }
+                return nfqClosed ? RECV_STATUS_CLOSED : RECV_STATUS_RETRY;
+            }
+            recvLen = (size_t)len;
+        }
+        nlh = (struct nlmsghdr*)(recvBuf + recvPos);
+        if (!NLMSG_OK(nlh, recvLen - recvPos)) {
+            recvPos = recvLen;
+            continue;
+        }
+        recvPos += NLMSG_ALIGN(nlh->nlmsg_len);
+        if (nlh->nlmsg_type == NLMSG_ERROR) {
+            // a verdict the kernel didn't take, e.g. for an id already given one
+            ++verdictErrors;
+            continue;
+        }
+        if (nlh->nlmsg_type == ((NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_PACKET)
+            && readPacket(nlh, buf, bufLen, readLen, addr)) {
+            return RECV_STATUS_OK;
+        }
+    }
+}
+
+// a copy or a packet made up by a module, no verdict to give it
+static short nfqInject(PacketNode *pnode) {
+    struct sockaddr_in to;
+    struct sockaddr_in6 to6;
+    ssize_t sent;
+    if (!pnode->addr.Outbound && !pnode->addr.Loopback) {
+        return SEND_STATUS_FAIL;
+    }
+    // anything before it in the list goes first
+    putAccepts();
+    writeVerdicts();
+    if ((pnode->packet[0] & 0xF0) == 0x40 && pnode->packetLen >= sizeof(WINDIVERT_IPHDR) && rawFd >= 0) {
+        memset(&to, 0, sizeof(to));
+        to.sin_family = AF_INET;
+        memcpy(&to.sin_addr, pnode->packet + 16, 4);
+        sent = sendto(rawFd, pnode->packet, pnode->packetLen, 0, (struct sockaddr*)&to, sizeof(to));
+    } else if ((pnode->packet[0] & 0xF0) == 0x60 && pnode->packetLen >= sizeof(WINDIVERT_IPV6HDR) && raw6Fd >= 0) {
+        memset(&to6, 0, sizeof(to6));
+        to6.sin6_family = AF_INET6;
+        memcpy(&to6.sin6_addr, pnode->packet + 24, 16);
+        sent = sendto(raw6Fd, pnode->packet, pnode->packetLen, 0, (struct sockaddr*)&to6, sizeof(to6));
+    } else {
+        return SEND_STATUS_FAIL;
+    }
+    if (sent != (ssize_t)pnode->packetLen) {
+        return SEND_STATUS_FAIL;
+    }
+    ++injected;
+    return SEND_STATUS_SEND;
+}
+
+static short nfqSend(PacketNode *pnode) {
+    BOOL modified = (pnode->notes & modifiedNotes) != 0,
+        tracked = (pnode->addr.Reserved1 & NFQ_TRACKED) != 0;
+    // keep the order of the list, earlier packets get their verdicts first.
+    // done while this one still counts as held, so no batch reaches past it
+    if (modified || !tracked) {
+        putAccepts();
+    }
+    if (!takeQueued(&pnode->addr)) {
+        return nfqInject(pnode);
+    }
+    if (!modified && tracked) {
+        idStates[pnode->addr.Reserved2 & windowMask] = ID_ACCEPT;
+        ++pendingAccepts;
+        return SEND_STATUS_SEND;
+    }
+    putVerdict(NFQNL_MSG_VERDICT, pnode->addr.Reserved2, NF_ACCEPT, modified ? pnode : NULL);
+    return SEND_STATUS_SEND;
+}
+
+static void nfqDrop(PacketNode *pnode) {
+    if (takeQueued(&pnode->addr)) {
+        putVerdict(NFQNL_MSG_VERDICT, pnode->addr.Reserved2, NF_DROP, NULL);
+    }
+}
+
+static void nfqFlush() {
+    putAccepts();
+    writeVerdicts();
+}
+
+// runs after the last send, with the engine lock held. the socket stays open
+// for the read loop to notice, the next open closes it
+static void nfqClose() {
+    char msg[64];
+    struct nlmsghdr *nlh;
+    struct nfqnl_msg_config_cmd cmd;
+    InterlockedExchange16(&nfqClosed, 1);
+    nfqFlush();
+    // packets queued from here on are dropped by the kernel
+    nlh = putHeader(msg, NFQNL_MSG_CONFIG);
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = NFQNL_CFG_CMD_UNBIND;
+    putAttr(nlh, NFQA_CFG_CMD, &cmd, sizeof(cmd));
+    send(nlFd, msg, nlh->nlmsg_len, 0);
+    LOG("nfq closed, %llu batch and %llu single verdicts, %llu copies injected, %llu overruns, %llu verdict errors",
+        (unsigned long long)batchVerdicts, (unsigned long long)singleVerdicts,
+        (unsigned long long)injected, (unsigned long long)overruns, (unsigned long long)verdictErrors);
+}
+
+Backend nfqBackend = {
+    "nfq",
+    nfqOpen,
+    nfqRecv,
+    nfqSend,
+    nfqClose,
+    0,
+    0,
+    nfqDrop,
+    nfqFlush,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+#endif
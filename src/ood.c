@@ -1,19 +1,19 @@
 // out of order arrange packets module
-#include "iup.h"
 #include "common.h"
 #define NAME "ood"
 // keep a picked packet at most for KEEP_TURNS_MAX steps, or if there's no following
 // one, it will just be sent
 #define KEEP_TURNS_MAX 10 
 
-static Ihandle *inboundCheckbox, *outboundCheckbox, *chanceInput;
-
 static volatile short oodEnabled = 0,
     oodInbound = 1, oodOutbound = 1,
     chance = 1000; // [0-10000]
 static PacketNode *oodPacket = NULL;
 static int giveUpCnt;
 
+#ifndef CLUMSY_HEADLESS
+static Ihandle *inboundCheckbox, *outboundCheckbox, *chanceInput;
+
 static Ihandle *oodSetupUI() {
     Ihandle *oodControlsBox = IupHbox(
         inboundCheckbox = IupToggle("Inbound", NULL),
@@ -44,6 +44,7 @@ static Ihandle *oodSetupUI() {
 
     return oodControlsBox;
 }
+#endif
 
 static void oodStartUp() {
     LOG("ood enabled");
@@ -58,6 +59,7 @@ static void oodCloseDown(PacketNode *head, PacketNode *tail) {
     if (oodPacket != NULL) {
         insertAfter(oodPacket, head);
         oodPacket = NULL; // ! need to empty the ood packet
+        STATS_BUFFERED(oodModule, 0);
     }
 }
 
@@ -101,20 +103,38 @@ static void swapNode(PacketNode *a, PacketNode *b) {
 }
 
 static short oodProcess(PacketNode *head, PacketNode *tail) {
+    PacketNode *pac;
+    // every packet in ood's direction is seen, whether it's picked, swapped or neither
+    for (pac = head->next; pac != tail; pac = pac->next) {
+        if (checkDirection(pac->addr.Outbound, oodInbound, oodOutbound)) {
+            STATS_SEEN(oodModule, pac);
+        }
+    }
     if (oodPacket != NULL) {
         if (!isListEmpty() || --giveUpCnt == 0) {
             LOG("Ooo sent direction %s, is giveup %s", oodPacket->addr.Outbound ? "OUTBOUND" : "INBOUND", giveUpCnt ? "NO" : "YES");
+            // holding back is what ood is for, none of it is overhead
+            oodPacket->intendedUs += (clockMs() - oodPacket->timestamp) * 1000;
             insertAfter(oodPacket, head);
             oodPacket = NULL;
             giveUpCnt = KEEP_TURNS_MAX;
+            STATS_BUFFERED(oodModule, 0);
+        } else {
+            // give up counts clock steps, which the virtual clock only takes when asked
+            clockWakeAt(clockMs() + CLOCK_WAITMS);
         } // skip picking packets when having oodPacket already
     } else if (!isListEmpty()) {
-        PacketNode *pac = head->next;
+        pac = head->next;
         if (pac->next == tail) {
             // only contains a single packet, then pick it out and insert later
             if (checkDirection(pac->addr.Outbound, oodInbound, oodOutbound) && calcChance(chance)) {
                 oodPacket = popNode(pac);
+                oodPacket->timestamp = clockMs();
+                STATS_ADD(oodModule, delayed, 1);
+                STATS_BUFFERED(oodModule, 1);
+                PACKET_NOTE(pac, NOTE_DELAYED);
                 LOG("Ooo picked packet w/ chance %.1f%%, direction %s", chance/100.0, pac->addr.Outbound ? "OUTBOUND" : "INBOUND");
+                clockWakeAt(clockMs() + CLOCK_WAITMS);
                 return TRUE;
             }
         } else if (calcChance(chance)) {
@@ -126,6 +146,8 @@ static short oodProcess(PacketNode *head, PacketNode *tail) {
                 // calculate chance per swap
                 if (first && second && calcChance(chance)) {
                     swapNode(first, second);
+                    STATS_ADD(oodModule, delayed, 1);
+                    PACKET_NOTE(first, NOTE_DELAYED);
                     LOG("Multiple packets OOD swapping");
                 } else {
                     // move forward first to progress
@@ -139,14 +161,22 @@ static short oodProcess(PacketNode *head, PacketNode *tail) {
     return FALSE;
 }
 
+static ModuleParam oodParams[] = {
+    {"inbound", PARAM_TOGGLE, &oodInbound, NULL, NULL},
+    {"outbound", PARAM_TOGGLE, &oodOutbound, NULL, NULL},
+    {"chance", PARAM_CHANCE, &chance, NULL, NULL},
+    {NULL}
+};
+
 Module oodModule = {
     "Out of order",
     NAME,
     (short*)&oodEnabled,
-    oodSetupUI,
+    MODULE_UI(oodSetupUI),
     oodStartUp,
     oodCloseDown,
     oodProcess,
+    oodParams,
     // runtime fields
-    0, 0, NULL
+    0, 0, NULL, NULL, 0, 0
 };
\ No newline at end of file
@@ -1,7 +1,9 @@
+#include <stdlib.h>
 #include "common.h"
 
 static PacketNode headNode = {0}, tailNode = {0};
 PacketNode * const head = &headNode, * const tail = &tailNode;
+UINT64 packetAllocs = 0;
 
 void initPacketNodeList() {
     if (head->next == NULL && tail->prev == NULL) {
@@ -19,19 +21,59 @@ void initPacketNodeList() {
 PacketNode* createNode(char* buf, UINT len, WINDIVERT_ADDRESS *addr) {
     PacketNode *newNode = (PacketNode*)malloc(sizeof(PacketNode));
     newNode->packet = (char*)malloc(len);
+    packetAllocs += 2;
     memcpy(newNode->packet, buf, len);
     newNode->packetLen = len;
     memcpy(&(newNode->addr), addr, sizeof(WINDIVERT_ADDRESS));
+    newNode->recvTick = 0;
+    newNode->intendedUs = 0;
+    newNode->notes = 0;
+    newNode->frame = 0;
+    newNode->spilled = 0;
+    newNode->packed = 0;
+    newNode->next = newNode->prev = NULL;
+    return newNode;
+}
+
+PacketNode* createFrameNode(char *frame, UINT len, WINDIVERT_ADDRESS *addr) {
+    PacketNode *newNode = (PacketNode*)malloc(sizeof(PacketNode));
+    ++packetAllocs;
+    newNode->packet = frame;
+    newNode->packetLen = len;
+    memcpy(&(newNode->addr), addr, sizeof(WINDIVERT_ADDRESS));
+    newNode->recvTick = 0;
+    newNode->intendedUs = 0;
+    newNode->notes = 0;
+    newNode->frame = 1;
+    newNode->spilled = 0;
+    newNode->packed = 0;
     newNode->next = newNode->prev = NULL;
     return newNode;
 }
 
 void freeNode(PacketNode *node) {
     assert((node != head) && (node != tail));
-    free(node->packet);
+    // still with the compression helper, make sure it lets go
+    compressDrop(node);
+    if (node->spilled) {
+        spillFree(node);
+    } else if (node->frame) {
+        divertReleaseFrame(node->packet);
+    } else {
+        free(node->packet);
+    }
     free(node);
 }
 
+void dropNode(PacketNode *node) {
+    // the tap and the backend read the whole payload
+    compressTake(node);
+    PACKET_NOTE(node, NOTE_DROPPED);
+    CAPTURE_TAP(CAPTURE_DROPPED, node);
+    divertDropped(node);
+    freeNode(node);
+}
+
 PacketNode* popNode(PacketNode *node) {
     assert((node != head) && (node != tail));
     node->prev->next = node->next;
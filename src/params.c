@@ -0,0 +1,262 @@
+// setting module parameters by key, shared by the headless frontend and
+// anything else that needs to drive modules without the ui widgets.
+// values are normalized the same way the ui sync callbacks in utils.c do.
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+Module* findModule(const char *shortName) {
+    int ix;
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        if (strcmp(modules[ix]->shortName, shortName) == 0) {
+            return modules[ix];
+        }
+    }
+    return NULL;
+}
+
+// --module-order, comma separated short names. modules run in this order and
+// the ones left out follow in their default order. module order changes what
+// the impairments add up to, e.g. dropping before or after duplicating
+BOOL setModuleOrder(const char *order, char buf[]) {
+    Module *ordered[MODULE_CNT], *module;
+    char name[NAME_SIZE];
+    const char *pos = order, *comma;
+    size_t len;
+    int count = 0, ix, jx;
+
+    while (*pos) {
+        comma = strchr(pos, ',');
+        len = comma ? (size_t)(comma - pos) : strlen(pos);
+        if (len == 0 || len >= NAME_SIZE) {
+            sprintf(buf, "Invalid module order %.64s", order);
+            return FALSE;
+        }
+        memcpy(name, pos, len);
+        name[len] = '\0';
+        module = findModule(name);
+        if (module == NULL) {
+            sprintf(buf, "Unknown module %.64s in module order", name);
+            return FALSE;
+        }
+        for (jx = 0; jx < count; ++jx) {
+            if (ordered[jx] == module) {
+                sprintf(buf, "Module %.64s listed twice in module order", name);
+                return FALSE;
+            }
+        }
+        ordered[count++] = module;
+        pos = comma ? comma + 1 : pos + len;
+    }
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        for (jx = 0; jx < count && ordered[jx] != modules[ix]; ++jx);
+        if (jx == count) {
+            ordered[count++] = modules[ix];
+        }
+    }
+    memcpy(modules, ordered, sizeof(ordered));
+    MODULES_CHANGED();
+    return TRUE;
+}
+
+ModuleParam* findParam(Module *module, const char *name) {
+    ModuleParam *param;
+    for (param = module->params; param && param->name; ++param) {
+        if (strcmp(param->name, name) == 0) {
+            return param;
+        }
+    }
+    return NULL;
+}
+
+static BOOL parseToggle(const char *value, short *out) {
+    // same words IupGetInt takes as on/off
+    if (_stricmp(value, "on") == 0 || _stricmp(value, "yes") == 0
+        || _stricmp(value, "true") == 0 || strcmp(value, "1") == 0) {
+        *out = 1;
+    } else if (_stricmp(value, "off") == 0 || _stricmp(value, "no") == 0
+        || _stricmp(value, "false") == 0 || strcmp(value, "0") == 0) {
+        *out = 0;
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// parse value into what paramStore takes, without touching the param.
+// numbers are clamped to the param range
+BOOL paramParse(ModuleParam *param, const char *value, LONG *out) {
+    char *end;
+    switch (param->type) {
+    case PARAM_TOGGLE: {
+        short state;
+        if (!parseToggle(value, &state)) {
+            return FALSE;
+        }
+        *out = state;
+        break;
+    }
+    case PARAM_CHANCE: {
+        double percent = strtod(value, &end);
+        if (end == value) {
+            return FALSE;
+        }
+        if (percent > 100.0) {
+            percent = 100.0;
+        } else if (percent < 0) {
+            percent = 0.0;
+        }
+        *out = (LONG)(percent * 100);
+        break;
+    }
+    case PARAM_SHORT:
+    case PARAM_INT32: {
+        long number = strtol(value, &end, 10);
+        long minValue = atol(param->minValue), maxValue = atol(param->maxValue);
+        if (end == value) {
+            return FALSE;
+        }
+        if (number > maxValue) {
+            number = maxValue;
+        } else if (number < minValue) {
+            number = minValue;
+        }
+        *out = (LONG)number;
+        break;
+    }
+    case PARAM_CHOICE: {
+        const char *name = param->minValue, *bar;
+        size_t len = strlen(value);
+        LONG ix = 0;
+        for (;;) {
+            bar = strchr(name, '|');
+            if ((bar ? (size_t)(bar - name) : strlen(name)) == len && _strnicmp(name, value, len) == 0) {
+                break;
+            }
+            if (bar == NULL) {
+                return FALSE;
+            }
+            name = bar + 1;
+            ++ix;
+        }
+        *out = ix;
+        break;
+    }
+    default:
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void paramStore(ModuleParam *param, LONG value) {
+    if (param->type == PARAM_INT32) {
+        InterlockedExchange((LONG*)param->value, value);
+    } else {
+        InterlockedExchange16((short*)param->value, (short)value);
+    }
+    if (param->type == PARAM_TOGGLE) {
+        MODULES_CHANGED();
+    }
+}
+
+BOOL paramSet(ModuleParam *param, const char *value) {
+    LONG parsed;
+    if (!paramParse(param, value, &parsed)) {
+        return FALSE;
+    }
+    paramStore(param, parsed);
+    return TRUE;
+}
+
+void paramFormat(ModuleParam *param, char *buf, size_t bufLen) {
+    switch (param->type) {
+    case PARAM_TOGGLE:
+        snprintf(buf, bufLen, "%s", *(volatile short*)param->value ? "on" : "off");
+        break;
+    case PARAM_CHANCE:
+        snprintf(buf, bufLen, "%.2f", *(volatile short*)param->value / 100.0);
+        break;
+    case PARAM_SHORT:
+        snprintf(buf, bufLen, "%d", *(volatile short*)param->value);
+        break;
+    case PARAM_INT32:
+        snprintf(buf, bufLen, "%ld", (long)*(volatile LONG*)param->value);
+        break;
+    case PARAM_CHOICE: {
+        const char *name = param->minValue, *bar;
+        int ix;
+        for (ix = *(volatile short*)param->value; ix > 0 && (bar = strchr(name, '|')) != NULL; --ix) {
+            name = bar + 1;
+        }
+        bar = strchr(name, '|');
+        snprintf(buf, bufLen, "%.*s", (int)(bar ? bar - name : (int)strlen(name)), name);
+        break;
+    }
+    }
+}
+
+// key is either a module short name, which resolves to a toggle on the
+// module's enabled flag, or "<shortName>-<param>"
+BOOL resolveKey(const char *key, ModuleParam *out) {
+    char name[NAME_SIZE];
+    const char *dash = strchr(key, '-');
+    size_t nameLen = dash ? (size_t)(dash - key) : strlen(key);
+    Module *module;
+    ModuleParam *param;
+
+    if (nameLen >= NAME_SIZE) {
+        return FALSE;
+    }
+    memcpy(name, key, nameLen);
+    name[nameLen] = '\0';
+    module = findModule(name);
+    if (module == NULL) {
+        return FALSE;
+    }
+
+    if (dash == NULL) {
+        out->name = module->shortName;
+        out->type = PARAM_TOGGLE;
+        out->value = module->enabledFlag;
+        out->minValue = out->maxValue = NULL;
+        return TRUE;
+    }
+    param = findParam(module, dash + 1);
+    if (param == NULL) {
+        return FALSE;
+    }
+    *out = *param;
+    return TRUE;
+}
+
+BOOL setByKey(const char *key, const char *value) {
+    ModuleParam param;
+    if (!resolveKey(key, &param) || !paramSet(&param, value)) {
+        return FALSE;
+    }
+    LOG("%s set to %s", key, value);
+    return TRUE;
+}
+
+// push every module related command line option into the modules
+void applyArgs() {
+    int ix;
+    char key[NAME_SIZE * 2];
+    const char *value;
+    ModuleParam *param;
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        Module *module = modules[ix];
+        // params first so the module never runs with defaults it shouldn't
+        for (param = module->params; param && param->name; ++param) {
+            snprintf(key, sizeof(key), "%s-%s", module->shortName, param->name);
+            value = getArg(key);
+            if (value && !setByKey(key, value)) {
+                fprintf(stderr, "invalid value for --%s: %s\n", key, value);
+            }
+        }
+        value = getArg(module->shortName);
+        if (value && !setByKey(module->shortName, value)) {
+            fprintf(stderr, "invalid value for --%s: %s\n", module->shortName, value);
+        }
+    }
+}
@@ -0,0 +1,309 @@
+// offline backend, reads packets from a pcap file and writes what the modules
+// let through to another one. no capture driver needed, so it also runs on
+// linux for regression tests.
+//   --pcap-in     input pcap, ethernet, raw ip, loopback or linux cooked
+//   --pcap-out    output pcap, raw ip. optional, packets are discarded without
+//   --pcap-speed  replay speed relative to the trace timestamps, default 1.
+//                 0 feeds packets as fast as the engine takes them. unused
+//                 with --clock virtual, which follows the trace exactly
+//   --pcap-local  ipv4 or ipv6 address of the local end. packets from it are
+//                 outbound, everything else inbound. all outbound without
+// output timestamps are the input ones plus the time spent in the engine.
+// the capture filter is ignored, every packet of the input goes through.
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <Ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#endif
+#include "common.h"
+
+#define PCAP_MAGIC_US 0xA1B2C3D4
+#define PCAP_MAGIC_NS 0xA1B23C4D
+#define PCAP_HEADER_SIZE 24
+#define PCAP_RECORD_HEADER_SIZE 16
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LOOP 108
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86DD
+#define ETHERTYPE_VLAN 0x8100
+#define PCAP_FILE_BUFSIZE (1024 * 1024)
+
+static const char *inData, *inPos, *inEnd;
+static size_t inLen;
+static BOOL swapped, nanos;
+static UINT32 linkType;
+static FILE *outFile;
+static double speed;
+static UINT8 localAddr[16];
+static int localAddrLen; // 0, 4 or 16
+static volatile short pcapClosed;
+static INT64 firstTs;
+static LONGLONG startTick, frequency;
+static UINT64 skipped;
+
+static UINT32 read32(const char *p) {
+    UINT32 v;
+    memcpy(&v, p, 4);
+    if (swapped) {
+        v = (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) | (v << 24);
+    }
+    return v;
+}
+
+static UINT16 readBE16(const char *p) {
+    return (UINT16)(((UINT8)p[0] << 8) | (UINT8)p[1]);
+}
+
+static BOOL pcapOpen(const char *filter, char buf[]) {
+    const char *inPath = getArg("pcap-in"), *outPath = getArg("pcap-out"), *value;
+    UINT32 magic;
+    LARGE_INTEGER tick;
+
+    UNREFERENCED_PARAMETER(filter);
+    // the previous run's input stays mapped until here, its read loop may
+    // have been inside recv when it was closed
+    if (inData) {
+        unmapFile(inData, inLen);
+        inData = NULL;
+    }
+    if (inPath == NULL) {
+        sprintf(buf, "pcap backend needs --pcap-in");
+        return FALSE;
+    }
+    inData = mapFileRead(inPath, &inLen);
+    if (inData == NULL || inLen < PCAP_HEADER_SIZE) {
+        sprintf(buf, "Failed to read pcap %.200s", inPath);
+        goto FAIL;
+    }
+    memcpy(&magic, inData, 4);
+    swapped = FALSE;
+    if (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) {
+        swapped = TRUE;
+        magic = read32(inData);
+    }
+    if (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) {
+        sprintf(buf, "%.200s is not a pcap file, pcapng isn't supported", inPath);
+        goto FAIL;
+    }
+    nanos = magic == PCAP_MAGIC_NS;
+    linkType = read32(inData + 20) & 0xFFFF;
+    if (linkType != LINKTYPE_NULL && linkType != LINKTYPE_ETHERNET && linkType != LINKTYPE_RAW
+        && linkType != LINKTYPE_LOOP && linkType != LINKTYPE_LINUX_SLL
+        && linkType != LINKTYPE_IPV4 && linkType != LINKTYPE_IPV6) {
+        sprintf(buf, "Unsupported pcap link type %u", linkType);
+        goto FAIL;
+    }
+    inPos = inData + PCAP_HEADER_SIZE;
+    inEnd = inData + inLen;
+
+    value = getArg("pcap-speed");
+    speed = value ? atof(value) : 1.0;
+    if (speed < 0) {
+        speed = 0;
+    }
+    localAddrLen = 0;
+    value = getArg("pcap-local");
+    if (value) {
+        if (inet_pton(AF_INET, value, localAddr) == 1) {
+            localAddrLen = 4;
+        } else if (inet_pton(AF_INET6, value, localAddr) == 1) {
+            localAddrLen = 16;
+        } else {
+            sprintf(buf, "Invalid --pcap-local address %.64s", value);
+            goto FAIL;
+        }
+    }
+
+    outFile = NULL;
+    if (outPath) {
+        UINT32 header[6] = {PCAP_MAGIC_US, 0x00040002, 0, 0, MAX_PACKETSIZE, LINKTYPE_RAW};
+        outFile = fopen(outPath, "wb");
+        if (outFile == NULL) {
+            sprintf(buf, "Failed to open %.200s for writing", outPath);
+            goto FAIL;
+        }
+        setvbuf(outFile, NULL, _IOFBF, PCAP_FILE_BUFSIZE);
+        fwrite(header, 4, 6, outFile);
+    }
+
+    QueryPerformanceFrequency(&tick);
+    frequency = tick.QuadPart;
+    QueryPerformanceCounter(&tick);
+    startTick = tick.QuadPart;
+    firstTs = -1;
+    skipped = 0;
+    pcapClosed = 0;
+    LOG("pcap backend reading %s, link type %u, speed %.2f", inPath, linkType, speed);
+    return TRUE;
+
+FAIL:
+    if (inData) {
+        unmapFile(inData, inLen);
+        inData = NULL;
+    }
+    return FALSE;
+}
+
+// offset of the ip header in a frame, -1 if it isn't ip
+static int ipOffset(const char *frame, UINT32 len) {
+    UINT32 family;
+    int offset;
+    switch (linkType) {
+    case LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+        return 0;
+    case LINKTYPE_NULL:
+    case LINKTYPE_LOOP:
+        if (len < 5) {
+            return -1;
+        }
+        // AF_INET is 2 everywhere, AF_INET6 differs between systems
+        memcpy(&family, frame, 4);
+        return family == 2 || family == 0x02000000 || (frame[4] & 0xF0) == 0x60 ? 4 : -1;
+    case LINKTYPE_LINUX_SLL:
+        if (len < 16) {
+            return -1;
+        }
+        offset = 16;
+        break;
+    case LINKTYPE_ETHERNET:
+        offset = 14;
+        while ((UINT32)offset <= len && readBE16(frame + offset - 2) == ETHERTYPE_VLAN) {
+            offset += 4;
+        }
+        if ((UINT32)offset > len) {
+            return -1;
+        }
+        break;
+    default:
+        return -1;
+    }
+    switch (readBE16(frame + offset - 2)) {
+    case ETHERTYPE_IPV4:
+    case ETHERTYPE_IPV6:
+        return offset;
+    default:
+        return -1;
+    }
+}
+
+static BOOL isOutbound(const char *packet, UINT len) {
+    if (localAddrLen == 0) {
+        return TRUE;
+    }
+    if ((packet[0] & 0xF0) == 0x40) {
+        return localAddrLen == 4 && len >= 20 && memcmp(packet + 12, localAddr, 4) == 0;
+    }
+    return localAddrLen == 16 && len >= 40 && memcmp(packet + 8, localAddr, 16) == 0;
+}
+
+static int pcapRecv(char *buf, UINT bufLen, UINT *readLen, WINDIVERT_ADDRESS *addr) {
+    const char *frame;
+    UINT32 capLen;
+    INT64 ts;
+    int offset;
+    LARGE_INTEGER now;
+    LONGLONG due;
+
+    for (;;) {
+        if (pcapClosed) {
+            return RECV_STATUS_CLOSED;
+        }
+        if (inEnd - inPos < PCAP_RECORD_HEADER_SIZE) {
+            LOG("pcap input done, skipped %llu non ip frames", (unsigned long long)skipped);
+            return RECV_STATUS_EOF;
+        }
+        capLen = read32(inPos + 8);
+        frame = inPos + PCAP_RECORD_HEADER_SIZE;
+        if ((size_t)(inEnd - frame) < capLen) {
+            LOG("pcap input truncated");
+            return RECV_STATUS_EOF;
+        }
+        inPos = frame + capLen;
+        ts = (INT64)read32(frame - 16) * 1000000 + read32(frame - 12) / (nanos ? 1000 : 1);
+
+        offset = ipOffset(frame, capLen);
+        if (offset < 0 || capLen - offset > bufLen || capLen == (UINT32)offset) {
+            ++skipped;
+            continue;
+        }
+        break;
+    }
+
+    // pace against the trace, sleeping off whatever is ahead of it
+    if (firstTs < 0) {
+        firstTs = ts;
+    }
+    if (speed > 0 && !clockIsVirtual()) {
+        due = startTick + (LONGLONG)((ts - firstTs) / speed * frequency / 1000000);
+        for (;;) {
+            QueryPerformanceCounter(&now);
+            if (now.QuadPart >= due || pcapClosed) {
+                break;
+            }
+            Sleep((DWORD)((due - now.QuadPart) * 1000 / frequency));
+        }
+    }
+
+    *readLen = capLen - offset;
+    memcpy(buf, frame + offset, *readLen);
+    memset(addr, 0, sizeof(WINDIVERT_ADDRESS));
+    addr->Outbound = isOutbound(buf, *readLen);
+    addr->Timestamp = ts;
+    return RECV_STATUS_OK;
+}
+
+static short pcapSend(PacketNode *pnode) {
+    UINT32 record[4];
+    INT64 ts = pnode->addr.Timestamp;
+    if (outFile == NULL) {
+        return SEND_STATUS_SEND;
+    }
+    // keep the trace timeline, shifted by how long the engine held the packet
+    if (pnode->recvTick) {
+        ts += (INT64)statsTicksToUs(clockTicks() - pnode->recvTick);
+    }
+    record[0] = (UINT32)(ts / 1000000);
+    record[1] = (UINT32)(ts % 1000000);
+    record[2] = record[3] = pnode->packetLen;
+    if (fwrite(record, 4, 4, outFile) != 4
+        || fwrite(pnode->packet, 1, pnode->packetLen, outFile) != pnode->packetLen) {
+        return SEND_STATUS_FAIL;
+    }
+    return SEND_STATUS_SEND;
+}
+
+// runs after the last send, with the engine lock held
+static void pcapClose() {
+    InterlockedExchange16(&pcapClosed, 1);
+    if (outFile) {
+        fclose(outFile);
+        outFile = NULL;
+    }
+}
+
+Backend pcapBackend = {
+    "pcap",
+    pcapOpen,
+    pcapRecv,
+    pcapSend,
+    pcapClose,
+    1,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
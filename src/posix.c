@@ -0,0 +1,397 @@
+// posix implementation of the Win32 and WinDivert subset declared in posix.h
+#ifndef _WIN32
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "common.h"
+
+/*
+ * timing
+ */
+static LONGLONG monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (LONGLONG)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+DWORD timeGetTime() {
+    return (DWORD)(monotonicNs() / 1000000);
+}
+
+void Sleep(DWORD ms) {
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER *counter) {
+    counter->QuadPart = monotonicNs();
+    return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq) {
+    freq->QuadPart = 1000000000LL;
+    return TRUE;
+}
+
+/*
+ * threads and mutexes
+ */
+#define HANDLE_THREAD 1
+#define HANDLE_MUTEX 2
+typedef struct {
+    int kind;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    LPTHREAD_START_ROUTINE start;
+    LPVOID arg;
+} PosixHandle;
+
+static THREAD_LOCAL int lastError = 0;
+
+static void* threadTrampoline(void *arg) {
+    PosixHandle *h = (PosixHandle*)arg;
+    return (void*)(uintptr_t)h->start(h->arg);
+}
+
+HANDLE CreateThread(void *attr, size_t stackSize, LPTHREAD_START_ROUTINE start, LPVOID arg, DWORD flags, DWORD *threadId) {
+    PosixHandle *h = (PosixHandle*)calloc(1, sizeof(PosixHandle));
+    int err;
+    UNREFERENCED_PARAMETER(attr);
+    UNREFERENCED_PARAMETER(stackSize); // win32 rounds tiny stack sizes up, just use the default
+    UNREFERENCED_PARAMETER(flags);
+    h->kind = HANDLE_THREAD;
+    h->start = start;
+    h->arg = arg;
+    err = pthread_create(&h->thread, NULL, threadTrampoline, h);
+    if (err) {
+        lastError = err;
+        free(h);
+        return NULL;
+    }
+    if (threadId) {
+        *threadId = 0;
+    }
+    return h;
+}
+
+HANDLE CreateMutex(void *attr, BOOL initialOwner, const char *name) {
+    PosixHandle *h = (PosixHandle*)calloc(1, sizeof(PosixHandle));
+    pthread_mutexattr_t mattr;
+    UNREFERENCED_PARAMETER(attr);
+    UNREFERENCED_PARAMETER(name);
+    h->kind = HANDLE_MUTEX;
+    // win32 mutexes can be re-acquired by the owner
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&h->mutex, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+    if (initialOwner) {
+        pthread_mutex_lock(&h->mutex);
+    }
+    return h;
+}
+
+BOOL ReleaseMutex(HANDLE mutex) {
+    PosixHandle *h = (PosixHandle*)mutex;
+    int err;
+    assert(h->kind == HANDLE_MUTEX);
+    err = pthread_mutex_unlock(&h->mutex);
+    lastError = err;
+    return err == 0;
+}
+
+DWORD WaitForSingleObject(HANDLE handle, DWORD ms) {
+    PosixHandle *h = (PosixHandle*)handle;
+    int err;
+    if (h->kind == HANDLE_MUTEX) {
+        if (ms == INFINITE) {
+            err = pthread_mutex_lock(&h->mutex);
+        } else {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += ms / 1000;
+            deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            err = pthread_mutex_timedlock(&h->mutex, &deadline);
+        }
+    } else {
+        // only infinite waits on threads are needed
+        assert(ms == INFINITE);
+        err = pthread_join(h->thread, NULL);
+        if (err == 0) {
+            h->kind = 0; // joined, CloseHandle only frees it now
+        }
+    }
+    if (err == ETIMEDOUT) {
+        return WAIT_TIMEOUT;
+    }
+    lastError = err;
+    return err ? WAIT_FAILED : WAIT_OBJECT_0;
+}
+
+DWORD WaitForMultipleObjects(DWORD count, const HANDLE *handles, BOOL waitAll, DWORD ms) {
+    DWORD ix, ret = WAIT_OBJECT_0;
+    assert(waitAll);
+    UNREFERENCED_PARAMETER(waitAll);
+    for (ix = 0; ix < count; ++ix) {
+        if (WaitForSingleObject(handles[ix], ms) != WAIT_OBJECT_0) {
+            ret = WAIT_FAILED;
+        }
+    }
+    return ret;
+}
+
+BOOL CloseHandle(HANDLE handle) {
+    PosixHandle *h = (PosixHandle*)handle;
+    if (h == NULL) {
+        return FALSE;
+    }
+    if (h->kind == HANDLE_MUTEX) {
+        pthread_mutex_destroy(&h->mutex);
+    } else if (h->kind == HANDLE_THREAD) {
+        pthread_detach(h->thread);
+    }
+    free(h);
+    return TRUE;
+}
+
+DWORD GetLastError() {
+    return (DWORD)lastError;
+}
+
+/*
+ * WinDivert helpers
+ */
+#define IPPROTO_HOPOPTS_ 0
+#define IPPROTO_ICMP_ 1
+#define IPPROTO_TCP_ 6
+#define IPPROTO_UDP_ 17
+#define IPPROTO_ROUTING_ 43
+#define IPPROTO_FRAGMENT_ 44
+#define IPPROTO_AH_ 51
+#define IPPROTO_ICMPV6_ 58
+#define IPPROTO_DSTOPTS_ 60
+
+BOOL WinDivertHelperParsePacket(const VOID *pPacket, UINT packetLen,
+    PWINDIVERT_IPHDR *ppIpHdr, PWINDIVERT_IPV6HDR *ppIpv6Hdr, UINT8 *pProtocol,
+    PWINDIVERT_ICMPHDR *ppIcmpHdr, PWINDIVERT_ICMPV6HDR *ppIcmpv6Hdr,
+    PWINDIVERT_TCPHDR *ppTcpHdr, PWINDIVERT_UDPHDR *ppUdpHdr,
+    PVOID *ppData, UINT *pDataLen, PVOID *ppNext, UINT *pNextLen) {
+    UINT8 *data = (UINT8*)pPacket;
+    UINT len = packetLen, hdrLen, totalLen;
+    PWINDIVERT_IPHDR ipHdr = NULL;
+    PWINDIVERT_IPV6HDR ipv6Hdr = NULL;
+    PWINDIVERT_ICMPHDR icmpHdr = NULL;
+    PWINDIVERT_ICMPV6HDR icmpv6Hdr = NULL;
+    PWINDIVERT_TCPHDR tcpHdr = NULL;
+    PWINDIVERT_UDPHDR udpHdr = NULL;
+    UINT8 protocol = 0;
+    BOOL fragment = FALSE, ok = FALSE;
+
+    if (data == NULL || len < 1) {
+        goto PARSE_DONE;
+    }
+
+    switch (data[0] >> 4) {
+    case 4:
+        ipHdr = (PWINDIVERT_IPHDR)data;
+        hdrLen = ipHdr->HdrLength * 4;
+        totalLen = ntohs(ipHdr->Length);
+        if (len < sizeof(WINDIVERT_IPHDR) || hdrLen < sizeof(WINDIVERT_IPHDR)
+            || totalLen < hdrLen || totalLen > len) {
+            ipHdr = NULL;
+            goto PARSE_DONE;
+        }
+        protocol = ipHdr->Protocol;
+        fragment = WINDIVERT_IPHDR_GET_FRAGOFF(ipHdr) != 0;
+        data += hdrLen;
+        len = totalLen - hdrLen;
+        break;
+    case 6:
+        ipv6Hdr = (PWINDIVERT_IPV6HDR)data;
+        if (len < sizeof(WINDIVERT_IPV6HDR)
+            || ntohs(ipv6Hdr->Length) + sizeof(WINDIVERT_IPV6HDR) > len) {
+            ipv6Hdr = NULL;
+            goto PARSE_DONE;
+        }
+        protocol = ipv6Hdr->NextHdr;
+        data += sizeof(WINDIVERT_IPV6HDR);
+        len = ntohs(ipv6Hdr->Length);
+        // walk the extension headers
+        while (protocol == IPPROTO_HOPOPTS_ || protocol == IPPROTO_ROUTING_ || protocol == IPPROTO_FRAGMENT_
+            || protocol == IPPROTO_AH_ || protocol == IPPROTO_DSTOPTS_) {
+            UINT extLen;
+            if (len < 8) {
+                goto PARSE_DONE;
+            }
+            if (protocol == IPPROTO_FRAGMENT_) {
+                extLen = 8;
+                fragment = (ntohs(*(UINT16*)(data + 2)) & 0xFFF8) != 0;
+            } else if (protocol == IPPROTO_AH_) {
+                extLen = (data[1] + 2) * 4;
+            } else {
+                extLen = (data[1] + 1) * 8;
+            }
+            if (extLen > len) {
+                goto PARSE_DONE;
+            }
+            protocol = data[0];
+            data += extLen;
+            len -= extLen;
+        }
+        break;
+    default:
+        goto PARSE_DONE;
+    }
+
+    // non first fragments don't carry the transport header
+    if (!fragment) {
+        switch (protocol) {
+        case IPPROTO_TCP_:
+            tcpHdr = (PWINDIVERT_TCPHDR)data;
+            hdrLen = tcpHdr->HdrLength * 4;
+            if (len < sizeof(WINDIVERT_TCPHDR) || hdrLen < sizeof(WINDIVERT_TCPHDR) || hdrLen > len) {
+                tcpHdr = NULL;
+                break;
+            }
+            data += hdrLen;
+            len -= hdrLen;
+            break;
+        case IPPROTO_UDP_:
+            if (len < sizeof(WINDIVERT_UDPHDR)) {
+                break;
+            }
+            udpHdr = (PWINDIVERT_UDPHDR)data;
+            data += sizeof(WINDIVERT_UDPHDR);
+            len -= sizeof(WINDIVERT_UDPHDR);
+            break;
+        case IPPROTO_ICMP_:
+            if (ipHdr == NULL || len < sizeof(WINDIVERT_ICMPHDR)) {
+                break;
+            }
+            icmpHdr = (PWINDIVERT_ICMPHDR)data;
+            data += sizeof(WINDIVERT_ICMPHDR);
+            len -= sizeof(WINDIVERT_ICMPHDR);
+            break;
+        case IPPROTO_ICMPV6_:
+            if (ipv6Hdr == NULL || len < sizeof(WINDIVERT_ICMPV6HDR)) {
+                break;
+            }
+            icmpv6Hdr = (PWINDIVERT_ICMPV6HDR)data;
+            data += sizeof(WINDIVERT_ICMPV6HDR);
+            len -= sizeof(WINDIVERT_ICMPV6HDR);
+            break;
+        }
+    }
+    ok = TRUE;
+
+PARSE_DONE:
+    if (ppIpHdr) *ppIpHdr = ipHdr;
+    if (ppIpv6Hdr) *ppIpv6Hdr = ipv6Hdr;
+    if (pProtocol) *pProtocol = protocol;
+    if (ppIcmpHdr) *ppIcmpHdr = icmpHdr;
+    if (ppIcmpv6Hdr) *ppIcmpv6Hdr = icmpv6Hdr;
+    if (ppTcpHdr) *ppTcpHdr = tcpHdr;
+    if (ppUdpHdr) *ppUdpHdr = udpHdr;
+    if (ppData) *ppData = (ok && len > 0) ? data : NULL;
+    if (pDataLen) *pDataLen = ok ? len : 0;
+    if (ppNext) *ppNext = NULL;
+    if (pNextLen) *pNextLen = 0;
+    return ok;
+}
+
+// one's complement sum over big endian 16 bit words
+static UINT32 checksumAdd(UINT32 sum, const void *buf, UINT len) {
+    const UINT8 *p = (const UINT8*)buf;
+    while (len > 1) {
+        sum += ((UINT32)p[0] << 8) | p[1];
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        sum += (UINT32)p[0] << 8;
+    }
+    return sum;
+}
+
+static UINT16 checksumFold(UINT32 sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return htons((UINT16)~sum);
+}
+
+static UINT32 pseudoHeaderSum(PWINDIVERT_IPHDR ipHdr, PWINDIVERT_IPV6HDR ipv6Hdr, UINT8 protocol, UINT len) {
+    UINT32 sum = 0;
+    if (ipHdr) {
+        sum = checksumAdd(sum, &ipHdr->SrcAddr, 4);
+        sum = checksumAdd(sum, &ipHdr->DstAddr, 4);
+    } else {
+        sum = checksumAdd(sum, ipv6Hdr->SrcAddr, 16);
+        sum = checksumAdd(sum, ipv6Hdr->DstAddr, 16);
+        sum += len >> 16;
+    }
+    return sum + protocol + (len & 0xFFFF);
+}
+
+BOOL WinDivertHelperCalcChecksums(VOID *pPacket, UINT packetLen,
+    WINDIVERT_ADDRESS *pAddr, UINT64 flags) {
+    PWINDIVERT_IPHDR ipHdr;
+    PWINDIVERT_IPV6HDR ipv6Hdr;
+    PWINDIVERT_ICMPHDR icmpHdr;
+    PWINDIVERT_ICMPV6HDR icmpv6Hdr;
+    PWINDIVERT_TCPHDR tcpHdr;
+    PWINDIVERT_UDPHDR udpHdr;
+    UINT8 *end;
+    UINT len;
+
+    if (!WinDivertHelperParsePacket(pPacket, packetLen, &ipHdr, &ipv6Hdr, NULL,
+        &icmpHdr, &icmpv6Hdr, &tcpHdr, &udpHdr, NULL, NULL, NULL, NULL)) {
+        return FALSE;
+    }
+    end = ipHdr ? (UINT8*)ipHdr + ntohs(ipHdr->Length)
+        : (UINT8*)ipv6Hdr + sizeof(WINDIVERT_IPV6HDR) + ntohs(ipv6Hdr->Length);
+
+    if (ipHdr && !(flags & WINDIVERT_HELPER_NO_IP_CHECKSUM)) {
+        ipHdr->Checksum = 0;
+        ipHdr->Checksum = checksumFold(checksumAdd(0, ipHdr, ipHdr->HdrLength * 4));
+        if (pAddr) pAddr->IPChecksum = 1;
+    }
+    if (tcpHdr && !(flags & WINDIVERT_HELPER_NO_TCP_CHECKSUM)) {
+        len = (UINT)(end - (UINT8*)tcpHdr);
+        tcpHdr->Checksum = 0;
+        tcpHdr->Checksum = checksumFold(checksumAdd(
+            pseudoHeaderSum(ipHdr, ipv6Hdr, IPPROTO_TCP_, len), tcpHdr, len));
+        if (pAddr) pAddr->TCPChecksum = 1;
+    }
+    if (udpHdr && !(flags & WINDIVERT_HELPER_NO_UDP_CHECKSUM)) {
+        len = (UINT)(end - (UINT8*)udpHdr);
+        udpHdr->Checksum = 0;
+        udpHdr->Checksum = checksumFold(checksumAdd(
+            pseudoHeaderSum(ipHdr, ipv6Hdr, IPPROTO_UDP_, len), udpHdr, len));
+        if (udpHdr->Checksum == 0) {
+            udpHdr->Checksum = 0xFFFF; // zero means no checksum for udp
+        }
+        if (pAddr) pAddr->UDPChecksum = 1;
+    }
+    if (icmpHdr && !(flags & WINDIVERT_HELPER_NO_ICMP_CHECKSUM)) {
+        len = (UINT)(end - (UINT8*)icmpHdr);
+        icmpHdr->Checksum = 0;
+        icmpHdr->Checksum = checksumFold(checksumAdd(0, icmpHdr, len));
+    }
+    if (icmpv6Hdr && !(flags & WINDIVERT_HELPER_NO_ICMPV6_CHECKSUM)) {
+        len = (UINT)(end - (UINT8*)icmpv6Hdr);
+        icmpv6Hdr->Checksum = 0;
+        icmpv6Hdr->Checksum = checksumFold(checksumAdd(
+            pseudoHeaderSum(NULL, ipv6Hdr, IPPROTO_ICMPV6_, len), icmpv6Hdr, len));
+    }
+    return TRUE;
+}
+#endif
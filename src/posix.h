@@ -0,0 +1,86 @@
+// the small part of Win32 and WinDivert the engine and modules rely on,
+// so they build on posix systems for the headless target. see posix.c
+#pragma once
+#ifndef _WIN32
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+typedef int BOOL;
+typedef unsigned int UINT;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef int64_t LONGLONG;
+typedef int64_t LONG64;
+typedef void VOID;
+typedef void *PVOID, *LPVOID, *HANDLE;
+typedef int8_t INT8;
+typedef uint8_t UINT8;
+typedef int16_t INT16;
+typedef uint16_t UINT16;
+typedef int32_t INT32;
+typedef uint32_t UINT32;
+typedef int64_t INT64;
+typedef uint64_t UINT64;
+typedef union {
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+typedef DWORD (*LPTHREAD_START_ROUTINE)(LPVOID);
+
+#define WINAPI
+#define TRUE 1
+#define FALSE 0
+#define UNREFERENCED_PARAMETER(x) ((void)(x))
+#define _stricmp strcasecmp
+#define _strnicmp strncasecmp
+#define _strdup strdup
+
+// only pull in the types, no windows.h and no dll imports
+#define WINDIVERT_KERNEL
+#include "windivert.h"
+
+// interlocked ops mapped to gcc builtins, same as the mingw workaround in common.h
+#define InterlockedAnd16(p, val) (__atomic_and_fetch((short*)(p), (val), __ATOMIC_SEQ_CST))
+#define InterlockedExchange16(p, val) (__atomic_exchange_n((short*)(p), (val), __ATOMIC_SEQ_CST))
+#define InterlockedIncrement16(p) (__atomic_add_fetch((short*)(p), 1, __ATOMIC_SEQ_CST))
+#define InterlockedDecrement16(p) (__atomic_sub_fetch((short*)(p), 1, __ATOMIC_SEQ_CST))
+#define InterlockedExchange(p, val) (__atomic_exchange_n((LONG*)(p), (val), __ATOMIC_SEQ_CST))
+#define InterlockedIncrement(p) (__atomic_add_fetch((LONG*)(p), 1, __ATOMIC_SEQ_CST))
+#define InterlockedDecrement(p) (__atomic_sub_fetch((LONG*)(p), 1, __ATOMIC_SEQ_CST))
+#define InterlockedExchangeAdd(p, val) (__atomic_fetch_add((LONG*)(p), (val), __ATOMIC_SEQ_CST))
+#define InterlockedExchangePointer(p, val) (__atomic_exchange_n((p), (val), __ATOMIC_SEQ_CST))
+#define InterlockedCompareExchangePointer(p, val, cmp) (__sync_val_compare_and_swap((p), (cmp), (val)))
+
+// timing
+DWORD timeGetTime();
+#define GetTickCount timeGetTime
+#define timeBeginPeriod(x) ((void)(x))
+#define timeEndPeriod(x) ((void)(x))
+void Sleep(DWORD ms);
+BOOL QueryPerformanceCounter(LARGE_INTEGER *counter);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq);
+
+// threads and mutexes, HANDLE points to a small tagged struct
+#define INFINITE 0xFFFFFFFF
+#define WAIT_OBJECT_0 0
+#define WAIT_ABANDONED 0x80
+#define WAIT_TIMEOUT 258
+#define WAIT_FAILED 0xFFFFFFFF
+HANDLE CreateThread(void *attr, size_t stackSize, LPTHREAD_START_ROUTINE start, LPVOID arg, DWORD flags, DWORD *threadId);
+HANDLE CreateMutex(void *attr, BOOL initialOwner, const char *name);
+BOOL ReleaseMutex(HANDLE mutex);
+DWORD WaitForSingleObject(HANDLE handle, DWORD ms);
+DWORD WaitForMultipleObjects(DWORD count, const HANDLE *handles, BOOL waitAll, DWORD ms);
+BOOL CloseHandle(HANDLE handle);
+DWORD GetLastError();
+
+// portable versions of the WinDivert helpers modules use
+BOOL WinDivertHelperParsePacket(const VOID *pPacket, UINT packetLen,
+    PWINDIVERT_IPHDR *ppIpHdr, PWINDIVERT_IPV6HDR *ppIpv6Hdr, UINT8 *pProtocol,
+    PWINDIVERT_ICMPHDR *ppIcmpHdr, PWINDIVERT_ICMPV6HDR *ppIcmpv6Hdr,
+    PWINDIVERT_TCPHDR *ppTcpHdr, PWINDIVERT_UDPHDR *ppUdpHdr,
+    PVOID *ppData, UINT *pDataLen, PVOID *ppNext, UINT *pNextLen);
+BOOL WinDivertHelperCalcChecksums(VOID *pPacket, UINT packetLen,
+    WINDIVERT_ADDRESS *pAddr, UINT64 flags);
+
+#endif
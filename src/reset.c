@@ -1,19 +1,19 @@
 // Reset injection packet module
 #include <stdlib.h>
-#include "iup.h"
 #include "common.h"
 #define NAME "reset"
 
 static const unsigned int TCP_MIN_SIZE = sizeof(WINDIVERT_IPHDR) + sizeof(WINDIVERT_TCPHDR);
 
-static Ihandle *inboundCheckbox, *outboundCheckbox, *chanceInput, *rstButton;
-
 static volatile short resetEnabled = 0,
     resetInbound = 1, resetOutbound = 1,
     chance = 0, // [0-10000]
     setNextCount = 0;
 
 
+#ifndef CLUMSY_HEADLESS
+static Ihandle *inboundCheckbox, *outboundCheckbox, *chanceInput, *rstButton;
+
 static int resetSetRSTNextButtonCb(Ihandle *ih) {
     UNREFERENCED_PARAMETER(ih);
 
@@ -59,6 +59,7 @@ static Ihandle* resetSetupUI() {
 
     return dupControlsBox;
 }
+#endif
 
 static void resetStartup() {
     LOG("reset enabled");
@@ -76,7 +77,11 @@ static short resetProcess(PacketNode *head, PacketNode *tail) {
     short reset = FALSE;
     PacketNode *pac = head->next;
     while (pac != tail) {
-        if (checkDirection(pac->addr.Outbound, resetInbound, resetOutbound)
+        short matched = checkDirection(pac->addr.Outbound, resetInbound, resetOutbound);
+        if (matched) {
+            STATS_SEEN(resetModule, pac);
+        }
+        if (matched
             && pac->packetLen > TCP_MIN_SIZE
             && (setNextCount || calcChance(chance)))
         {
@@ -102,6 +107,8 @@ static short resetProcess(PacketNode *head, PacketNode *tail) {
                 WinDivertHelperCalcChecksums(pac->packet, pac->packetLen, NULL, 0);
 
                 reset = TRUE;
+                STATS_ADD(resetModule, reset, 1);
+                PACKET_NOTE(pac, NOTE_MODIFIED);
                 if (setNextCount > 0) {
                     InterlockedDecrement16(&setNextCount);
                 }
@@ -113,14 +120,22 @@ static short resetProcess(PacketNode *head, PacketNode *tail) {
     return reset;
 }
 
+static ModuleParam resetParams[] = {
+    {"inbound", PARAM_TOGGLE, &resetInbound, NULL, NULL},
+    {"outbound", PARAM_TOGGLE, &resetOutbound, NULL, NULL},
+    {"chance", PARAM_CHANCE, &chance, NULL, NULL},
+    {NULL}
+};
+
 Module resetModule = {
     "Set TCP RST",
     NAME,
     (short*)&resetEnabled,
-    resetSetupUI,
+    MODULE_UI(resetSetupUI),
     resetStartup,
     resetCloseDown,
     resetProcess,
+    resetParams,
     // runtime fields
-    0, 0, NULL
+    0, 0, NULL, NULL, 0, 0
 };
\ No newline at end of file
@@ -0,0 +1,385 @@
+// timeline of parameter changes, run by the engine from the moment capture
+// starts. one step per line, '#' starts a comment:
+//   <time> set <key> <value> [<key> <value>...]
+//   <time> ramp <key> <from> <to> <duration>
+// time is from the start of capture, or from the previous step when it starts
+// with '+'. times take a "ms" or "s" suffix and default to ms, e.g.
+//   0      set lag on lag-time 0
+//   +1s    ramp lag-time 0 500 200ms
+//   +3s    set lag-time 0 drop on drop-chance 5
+//   +10s   set drop off
+// ramps interpolate numeric params linearly, one update per millisecond.
+// every applied step is logged with its actual time, to --scenario-log or
+// stdout on headless builds.
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "common.h"
+
+#define SCENARIO_MAX_PAIRS 16
+#define SCENARIO_LINE_SIZE 1024
+#define SCENARIO_STEP_KIND_SET 0
+#define SCENARIO_STEP_KIND_RAMP 1
+// sleep until this close to a deadline, then yield until it's reached
+#define SCENARIO_SPIN_MS 2.0
+// longest single sleep, keeps stopping responsive
+#define SCENARIO_MAX_SLEEP_MS 10
+
+typedef struct {
+    short kind;
+    int line;
+    double atMs;
+    int count; // pairs for set, 1 for ramp
+    char keys[SCENARIO_MAX_PAIRS][NAME_SIZE * 2];
+    ModuleParam params[SCENARIO_MAX_PAIRS];
+    LONG values[SCENARIO_MAX_PAIRS];
+    // ramp only, values[0] is the start value
+    LONG rampTo;
+    double durationMs;
+} ScenarioStep;
+
+static ScenarioStep *steps;
+static int stepCount;
+static FILE *scenarioLog;
+static HANDLE scenarioThread;
+static volatile short scenarioStopping;
+static BOOL virtualRunning;
+// progress through the steps, ramps run until done and a later ramp on the
+// same key takes over
+static int nextStep, rampCount;
+static ScenarioStep *ramps[SCENARIO_MAX_PAIRS];
+static LONG rampValues[SCENARIO_MAX_PAIRS];
+
+static BOOL parseTime(const char *text, double *ms) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) {
+        return FALSE;
+    }
+    if (*end == '\0' || strcmp(end, "ms") == 0) {
+        *ms = value;
+    } else if (strcmp(end, "s") == 0) {
+        *ms = value * 1000;
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL parseStep(char *line, int lineNo, double lastMs, ScenarioStep *step, char buf[]) {
+    char *words[SCENARIO_MAX_PAIRS * 2 + 2];
+    char *p = line, *at;
+    int cnt = 0, ix;
+
+    while (*p) {
+        while (isspace((unsigned char)*p)) {
+            *p++ = '\0';
+        }
+        if (*p == '\0') {
+            break;
+        }
+        if (cnt == sizeof(words) / sizeof(words[0])) {
+            sprintf(buf, "scenario line %d: too many values", lineNo);
+            return FALSE;
+        }
+        words[cnt++] = p;
+        while (*p && !isspace((unsigned char)*p)) {
+            ++p;
+        }
+    }
+
+    memset(step, 0, sizeof(*step));
+    step->line = lineNo;
+    at = words[0];
+    if (!parseTime(at[0] == '+' ? at + 1 : at, &step->atMs)) {
+        sprintf(buf, "scenario line %d: invalid time %.32s", lineNo, at);
+        return FALSE;
+    }
+    if (at[0] == '+') {
+        step->atMs += lastMs;
+    } else if (step->atMs < lastMs) {
+        sprintf(buf, "scenario line %d: time goes backwards", lineNo);
+        return FALSE;
+    }
+
+    if (cnt >= 4 && (cnt - 2) % 2 == 0 && strcmp(words[1], "set") == 0) {
+        step->kind = SCENARIO_STEP_KIND_SET;
+        step->count = (cnt - 2) / 2;
+    } else if (cnt == 6 && strcmp(words[1], "ramp") == 0) {
+        step->kind = SCENARIO_STEP_KIND_RAMP;
+        step->count = 1;
+    } else {
+        sprintf(buf, "scenario line %d: expected \"<time> set <key> <value>...\" or \"<time> ramp <key> <from> <to> <duration>\"", lineNo);
+        return FALSE;
+    }
+
+    for (ix = 0; ix < step->count; ++ix) {
+        const char *key = words[2 + ix * 2], *value = words[3 + ix * 2];
+        if (strlen(key) >= sizeof(step->keys[ix]) || !resolveKey(key, &step->params[ix])) {
+            sprintf(buf, "scenario line %d: unknown key %.32s", lineNo, key);
+            return FALSE;
+        }
+        strcpy(step->keys[ix], key);
+        if (!paramParse(&step->params[ix], value, &step->values[ix])) {
+            sprintf(buf, "scenario line %d: invalid value for %s: %.32s", lineNo, key, value);
+            return FALSE;
+        }
+    }
+
+    if (step->kind == SCENARIO_STEP_KIND_RAMP) {
+        if (step->params[0].type == PARAM_TOGGLE || step->params[0].type == PARAM_CHOICE) {
+            sprintf(buf, "scenario line %d: can't ramp %s", lineNo, step->keys[0]);
+            return FALSE;
+        }
+        if (!paramParse(&step->params[0], words[4], &step->rampTo)) {
+            sprintf(buf, "scenario line %d: invalid value for %s: %.32s", lineNo, step->keys[0], words[4]);
+            return FALSE;
+        }
+        if (!parseTime(words[5], &step->durationMs)) {
+            sprintf(buf, "scenario line %d: invalid duration %.32s", lineNo, words[5]);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+BOOL scenarioLoad(const char *path, char buf[]) {
+    char line[SCENARIO_LINE_SIZE], *comment, *p;
+    int lineNo = 0, capacity = 0;
+    double lastMs = 0;
+    const char *logPath;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        sprintf(buf, "Failed to open scenario %.200s", path);
+        return FALSE;
+    }
+    free(steps);
+    steps = NULL;
+    stepCount = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        ++lineNo;
+        comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        for (p = line; isspace((unsigned char)*p); ++p);
+        if (*p == '\0') {
+            continue;
+        }
+        if (stepCount == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            steps = (ScenarioStep*)realloc(steps, capacity * sizeof(ScenarioStep));
+        }
+        if (!parseStep(p, lineNo, lastMs, &steps[stepCount], buf)) {
+            fclose(fp);
+            free(steps);
+            steps = NULL;
+            stepCount = 0;
+            return FALSE;
+        }
+        lastMs = steps[stepCount].atMs;
+        ++stepCount;
+    }
+    fclose(fp);
+
+    logPath = getArg("scenario-log");
+    if (scenarioLog && scenarioLog != stdout) {
+        fclose(scenarioLog);
+    }
+#ifdef CLUMSY_HEADLESS
+    scenarioLog = stdout;
+#else
+    scenarioLog = NULL;
+#endif
+    if (logPath && (scenarioLog = fopen(logPath, "a")) == NULL) {
+        sprintf(buf, "Failed to open scenario log %.200s", logPath);
+        return FALSE;
+    }
+    LOG("Loaded %d scenario steps from %s", stepCount, path);
+    return TRUE;
+}
+
+static double elapsedMs(LONGLONG startTick, LONGLONG frequency) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (now.QuadPart - startTick) * 1000.0 / frequency;
+}
+
+static void logApplied(ScenarioStep *step, double nowMs, double scheduledMs, const char *what) {
+    LOG("scenario line %d: %s at %.3f ms, scheduled %.3f ms", step->line, what, nowMs, scheduledMs);
+    if (scenarioLog) {
+        fprintf(scenarioLog, "scenario line %d: %s at %.3f ms, scheduled %.3f ms\n",
+            step->line, what, nowMs, scheduledMs);
+        fflush(scenarioLog);
+    }
+}
+
+static void applySet(ScenarioStep *step, double nowMs) {
+    char what[SCENARIO_LINE_SIZE], value[NAME_SIZE];
+    size_t len;
+    BOOL locked;
+    int ix;
+
+    // whole line lands between two engine steps
+    locked = divertLock();
+    for (ix = 0; ix < step->count; ++ix) {
+        paramStore(&step->params[ix], step->values[ix]);
+    }
+    if (locked) {
+        divertUnlock();
+    }
+
+    len = snprintf(what, sizeof(what), "set");
+    for (ix = 0; ix < step->count && len < sizeof(what); ++ix) {
+        paramFormat(&step->params[ix], value, sizeof(value));
+        len += snprintf(what + len, sizeof(what) - len, " %s %s", step->keys[ix], value);
+    }
+    logApplied(step, nowMs, step->atMs, what);
+}
+
+// store the ramp value for nowMs, TRUE once the ramp has reached its end
+static BOOL applyRamp(ScenarioStep *step, double nowMs, LONG *lastValue) {
+    double progress = step->durationMs > 0 ? (nowMs - step->atMs) / step->durationMs : 1.0;
+    LONG value;
+    if (progress >= 1.0) {
+        value = step->rampTo;
+    } else {
+        value = step->values[0] + (LONG)((step->rampTo - step->values[0]) * progress);
+    }
+    if (value != *lastValue) {
+        paramStore(&step->params[0], value);
+        *lastValue = value;
+    }
+    return progress >= 1.0;
+}
+
+static void waitUntil(double dueMs, LONGLONG startTick, LONGLONG frequency) {
+    double remaining;
+    while (!scenarioStopping && (remaining = dueMs - elapsedMs(startTick, frequency)) > 0) {
+        if (remaining > SCENARIO_SPIN_MS) {
+            double sleepMs = remaining - SCENARIO_SPIN_MS;
+            Sleep(sleepMs > SCENARIO_MAX_SLEEP_MS ? SCENARIO_MAX_SLEEP_MS : (DWORD)sleepMs);
+        } else {
+            Sleep(0);
+        }
+    }
+}
+
+// runs the steps and ramps due by nowMs, returns when to run again or a
+// negative time once everything is done
+static double scenarioRun(double nowMs) {
+    int ix, jx;
+    double dueMs;
+    char what[NAME_SIZE * 4];
+
+    for (; nextStep < stepCount && steps[nextStep].atMs <= nowMs; ++nextStep) {
+        ScenarioStep *step = &steps[nextStep];
+        if (step->kind == SCENARIO_STEP_KIND_SET) {
+            applySet(step, nowMs);
+            continue;
+        }
+        for (ix = 0; ix < rampCount && ramps[ix]->params[0].value != step->params[0].value; ++ix);
+        if (ix == rampCount) {
+            if (rampCount == SCENARIO_MAX_PAIRS) {
+                logApplied(step, nowMs, step->atMs, "skipped ramp, too many running");
+                continue;
+            }
+            ++rampCount;
+        }
+        ramps[ix] = step;
+        rampValues[ix] = step->values[0] - 1; // force the first store
+        snprintf(what, sizeof(what), "ramp %s started", step->keys[0]);
+        logApplied(step, nowMs, step->atMs, what);
+    }
+
+    for (ix = 0; ix < rampCount; ) {
+        if (applyRamp(ramps[ix], nowMs, &rampValues[ix])) {
+            snprintf(what, sizeof(what), "ramp %s done", ramps[ix]->keys[0]);
+            logApplied(ramps[ix], nowMs, ramps[ix]->atMs + ramps[ix]->durationMs, what);
+            for (jx = ix + 1; jx < rampCount; ++jx) {
+                ramps[jx - 1] = ramps[jx];
+                rampValues[jx - 1] = rampValues[jx];
+            }
+            --rampCount;
+        } else {
+            ++ix;
+        }
+    }
+
+    if (nextStep == stepCount && rampCount == 0) {
+        return -1.0;
+    }
+    // wake for the next step, or the next millisecond while ramping
+    dueMs = nextStep < stepCount ? steps[nextStep].atMs : nowMs + 1.0;
+    if (rampCount > 0 && dueMs > nowMs + 1.0) {
+        dueMs = nowMs + 1.0;
+    }
+    return dueMs;
+}
+
+static DWORD scenarioLoop(LPVOID arg) {
+    LARGE_INTEGER tick;
+    LONGLONG startTick, frequency;
+    double dueMs;
+
+    UNREFERENCED_PARAMETER(arg);
+    QueryPerformanceFrequency(&tick);
+    frequency = tick.QuadPart;
+    QueryPerformanceCounter(&tick);
+    startTick = tick.QuadPart;
+
+    while (!scenarioStopping && (dueMs = scenarioRun(elapsedMs(startTick, frequency))) >= 0) {
+        waitUntil(dueMs, startTick, frequency);
+    }
+    LOG("Scenario %s", scenarioStopping ? "stopped" : "finished");
+    return 0;
+}
+
+// with the virtual clock the engine runs the scenario itself, calling this
+// whenever its clock reaches the returned due time. FALSE once done
+BOOL scenarioTick(UINT64 nowUs, UINT64 *dueUs) {
+    double dueMs;
+    if (!virtualRunning) {
+        return FALSE;
+    }
+    dueMs = scenarioRun(nowUs / 1000.0);
+    if (dueMs < 0) {
+        virtualRunning = FALSE;
+        LOG("Scenario finished");
+        return FALSE;
+    }
+    *dueUs = (UINT64)(dueMs * 1000.0 + 0.5);
+    return TRUE;
+}
+
+void scenarioStart() {
+    if (stepCount == 0 || scenarioThread != NULL) {
+        return;
+    }
+    nextStep = rampCount = 0;
+    if (clockIsVirtual()) {
+        virtualRunning = TRUE;
+        return;
+    }
+    scenarioStopping = 0;
+    timeBeginPeriod(1);
+    scenarioThread = CreateThread(NULL, 1, (LPTHREAD_START_ROUTINE)scenarioLoop, NULL, 0, NULL);
+    if (scenarioThread == NULL) {
+        LOG("Failed to create scenario thread (%lu)", (unsigned long)GetLastError());
+        timeEndPeriod(1);
+    }
+}
+
+void scenarioStop() {
+    virtualRunning = FALSE;
+    if (scenarioThread == NULL) {
+        return;
+    }
+    InterlockedExchange16(&scenarioStopping, 1);
+    WaitForSingleObject(scenarioThread, INFINITE);
+    CloseHandle(scenarioThread);
+    scenarioThread = NULL;
+    timeEndPeriod(1);
+}
@@ -0,0 +1,174 @@
+// spill store for packets held long, used by lag. with --spill-dir set,
+// payloads of held packets are appended to memory mapped segment files of
+// SPILL_SEGMENT_SIZE in that directory and the node keeps only a pointer into
+// them. seconds of multi gigabit traffic then sit in the page cache where the
+// os can write them out, instead of in gigabytes of heap. segments are
+// recycled once every packet in them has been freed. spilled payloads don't
+// count against --memory-budget, SPILL_SEGMENTS_MAX caps them instead and
+// past that packets stay on the heap.
+// only touched under the engine lock
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "common.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#define SPILL_SEGMENT_SIZE (64 << 20)
+#define SPILL_SEGMENTS_MAX 1024 // 64 GB
+// each record is the segment index then the payload, 8 byte aligned
+#define SPILL_HEADER 8
+#define SPILL_ALIGN(len) (((len) + 7) & ~(UINT)7)
+
+typedef struct {
+    char *base;
+    UINT used; // append offset, only the current segment grows
+    LONG live; // records not freed yet
+} SpillSegment;
+
+static const char *spillDir;
+static SpillSegment segments[SPILL_SEGMENTS_MAX];
+static int segmentCount, current = -1;
+static UINT64 spilledBytes;
+
+static char* mapSegment() {
+#ifdef _WIN32
+    char path[MAX_PATH];
+    HANDLE file, mapping;
+    char *base = NULL;
+    if (GetTempFileNameA(spillDir, "cls", 0, path) == 0) {
+        return NULL;
+    }
+    file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        DeleteFileA(path);
+        return NULL;
+    }
+    mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, SPILL_SEGMENT_SIZE, NULL);
+    if (mapping != NULL) {
+        // the view keeps the mapping and the file alive, the file goes away
+        // with the view
+        base = (char*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, SPILL_SEGMENT_SIZE);
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+    return base;
+#else
+    char path[MSG_BUFSIZE];
+    void *base = MAP_FAILED;
+    int fd;
+    snprintf(path, sizeof(path), "%s/clumsy-spill-XXXXXX", spillDir);
+    fd = mkstemp(path);
+    if (fd < 0) {
+        return NULL;
+    }
+    // only the mapping keeps it
+    unlink(path);
+    if (ftruncate(fd, SPILL_SEGMENT_SIZE) == 0) {
+        base = mmap(NULL, SPILL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return base == MAP_FAILED ? NULL : (char*)base;
+#endif
+}
+
+static void unmapSegment(char *base) {
+#ifdef _WIN32
+    UnmapViewOfFile(base);
+#else
+    munmap(base, SPILL_SEGMENT_SIZE);
+#endif
+}
+
+void spillStart() {
+    spillDir = getArg("spill-dir");
+    segmentCount = 0;
+    current = -1;
+    spilledBytes = 0;
+}
+
+void spillStop() {
+    int ix;
+    for (ix = 0; ix < segmentCount; ++ix) {
+        assert(segments[ix].live == 0);
+        unmapSegment(segments[ix].base);
+    }
+    segmentCount = 0;
+    current = -1;
+}
+
+// a segment with room for size bytes, recycling emptied ones before
+// mapping more
+static BOOL segmentFor(UINT size) {
+    int ix;
+    if (current >= 0 && segments[current].used + size <= SPILL_SEGMENT_SIZE) {
+        return TRUE;
+    }
+    for (ix = 0; ix < segmentCount; ++ix) {
+        if (segments[ix].live == 0) {
+            segments[ix].used = 0;
+            current = ix;
+            return TRUE;
+        }
+    }
+    if (segmentCount == SPILL_SEGMENTS_MAX) {
+        return FALSE;
+    }
+    segments[segmentCount].base = mapSegment();
+    if (segments[segmentCount].base == NULL) {
+        LOG("Failed to map spill segment in %s, keeping packets in memory.", spillDir);
+        return FALSE;
+    }
+    segments[segmentCount].used = 0;
+    segments[segmentCount].live = 0;
+    current = segmentCount++;
+    LOG("Mapped spill segment %d.", current);
+    return TRUE;
+}
+
+// move the payload into the store, FALSE if it stays where it is
+BOOL spillStore(PacketNode *pac) {
+    UINT size = SPILL_HEADER + SPILL_ALIGN(pac->packetLen);
+    SpillSegment *segment;
+    char *record;
+    if (spillDir == NULL || pac->spilled || !segmentFor(size)) {
+        return FALSE;
+    }
+    segment = &segments[current];
+    record = segment->base + segment->used;
+    *(UINT32*)record = (UINT32)current;
+    memcpy(record + SPILL_HEADER, pac->packet, pac->packetLen);
+    segment->used += size;
+    ++segment->live;
+    spilledBytes += pac->packetLen;
+    // a lent frame goes back to the backend right away
+    if (pac->frame) {
+        divertReleaseFrame(pac->packet);
+        pac->frame = 0;
+    } else {
+        free(pac->packet);
+    }
+    pac->packet = record + SPILL_HEADER;
+    pac->spilled = 1;
+    return TRUE;
+}
+
+// called by freeNode
+void spillFree(PacketNode *pac) {
+    SpillSegment *segment = &segments[*(UINT32*)(pac->packet - SPILL_HEADER)];
+    assert(segment->live > 0);
+    spilledBytes -= pac->packetLen;
+    if (--segment->live == 0 && segment == &segments[current]) {
+        // nothing left in it, start over at the front
+        segment->used = 0;
+    }
+}
+
+void spillRead(UINT64 *bytes, int *segmentsMapped) {
+    *bytes = spilledBytes;
+    *segmentsMapped = segmentCount;
+}
@@ -0,0 +1,136 @@
+// per module hot path statistics
+// each packet thread owns one counter slot per module and bumps it without any
+// locking or interlocked op. slots are cache line sized and aligned so the
+// threads never bounce lines, and are only summed up when someone reads them.
+#include <stdio.h>
+#include <string.h>
+#include "common.h"
+
+// slot 0 is shared by threads that never registered (ui thread calling into
+// modules etc.), packet threads take slot 1 and up
+THREAD_LOCAL int statsSlot = 0;
+
+ALIGNED(CACHE_LINE_SIZE) static ModuleCounters counterSlots[MODULE_CNT][STATS_THREAD_SLOTS];
+static volatile LONG registeredThreads = 0;
+static LONGLONG perfFrequency = 0;
+
+// reset all counters and hand out slots, must be called before packet threads start
+void statsInit() {
+    int ix;
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    perfFrequency = freq.QuadPart;
+
+    memset(counterSlots, 0, sizeof(counterSlots));
+    registeredThreads = 0;
+    for (ix = 0; ix < MODULE_CNT; ++ix) {
+        modules[ix]->counters = counterSlots[ix];
+        modules[ix]->buffered = 0;
+        modules[ix]->bufferedBytes = 0;
+    }
+}
+
+// called once at the start of each packet thread. slots are never shared
+// between registered threads, their counters aren't atomic
+void statsRegisterThread() {
+    LONG ix = InterlockedIncrement(&registeredThreads);
+    if (ix >= STATS_THREAD_SLOTS) {
+        // counts from here on may be lost, raise STATS_THREAD_SLOTS
+        LOG("Stats: out of thread slots, thread %ld shares slot 0", (long)ix);
+        assert(0);
+        statsSlot = 0;
+        return;
+    }
+    statsSlot = (int)ix;
+    LOG("thread registered with stats slot %d", statsSlot);
+}
+
+void statsRead(Module *module, ModuleStats *out) {
+    int ix;
+    UINT64 cpuTicks = 0;
+    memset(out, 0, sizeof(ModuleStats));
+    if (module->counters == NULL) {
+        return;
+    }
+    for (ix = 0; ix < STATS_THREAD_SLOTS; ++ix) {
+        // reading while the owner writes is fine, values are only for display
+        ModuleCounters *c = &module->counters[ix];
+        out->seen += c->seen;
+        out->bytes += c->bytes;
+        out->dropped += c->dropped;
+        out->delayed += c->delayed;
+        out->duplicated += c->duplicated;
+        out->tampered += c->tampered;
+        out->reset += c->reset;
+        cpuTicks += c->cpuTicks;
+    }
+    out->cpuUs = statsTicksToUs((LONGLONG)cpuTicks);
+    out->buffered = module->buffered;
+    out->bufferedBytes = module->bufferedBytes;
+}
+
+UINT64 statsTicksToUs(LONGLONG ticks) {
+    if (perfFrequency == 0 || ticks < 0) {
+        return 0;
+    }
+    // split up to not overflow on large sums
+    return (UINT64)(ticks / perfFrequency) * 1000000
+        + (UINT64)(ticks % perfFrequency) * 1000000 / perfFrequency;
+}
+
+static int highestBit(UINT64 value) {
+    int bit = 0;
+    while (value >>= 1) {
+        ++bit;
+    }
+    return bit;
+}
+
+void statsHistogramAdd(StatsHistogram *hist, UINT64 value) {
+    int shift;
+    if (value < STATS_HIST_SUB) {
+        ++hist->buckets[value];
+    } else {
+        // the top STATS_HIST_SUB_BITS + 1 bits pick the bucket
+        shift = highestBit(value) - STATS_HIST_SUB_BITS;
+        ++hist->buckets[STATS_HIST_SUB * (shift + 1) + (value >> shift) - STATS_HIST_SUB];
+    }
+    ++hist->count;
+}
+
+// middle of the bucket holding the percentile, 0 when empty
+double statsHistogramPercentile(StatsHistogram *hist, double percentile) {
+    UINT64 target = (UINT64)(percentile / 100.0 * hist->count + 0.5), seen = 0;
+    int ix, shift;
+    if (hist->count == 0) {
+        return 0;
+    }
+    if (target == 0) {
+        target = 1;
+    }
+    for (ix = 0; ix < STATS_HIST_BUCKETS; ++ix) {
+        seen += hist->buckets[ix];
+        if (seen >= target) {
+            break;
+        }
+    }
+    if (ix < STATS_HIST_SUB) {
+        return ix;
+    }
+    shift = ix / STATS_HIST_SUB - 1;
+    return (double)((UINT64)(ix % STATS_HIST_SUB + STATS_HIST_SUB) << shift) + ((UINT64)1 << shift) / 2.0;
+}
+
+void statsFormat(Module *module, char *buf, size_t bufLen) {
+    ModuleStats st;
+    statsRead(module, &st);
+    snprintf(buf, bufLen, "seen: %llu (%llu bytes)\n"
+        "dropped: %llu, delayed: %llu, duplicated: %llu\n"
+        "tampered: %llu, reset: %llu, buffered: %ld (%ld bytes)\n"
+        "cpu: %.1f ms",
+        (unsigned long long)st.seen, (unsigned long long)st.bytes,
+        (unsigned long long)st.dropped, (unsigned long long)st.delayed,
+        (unsigned long long)st.duplicated, (unsigned long long)st.tampered,
+        (unsigned long long)st.reset, (long)st.buffered, (long)st.bufferedBytes,
+        st.cpuUs / 1000.0);
+}
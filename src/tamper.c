@@ -1,16 +1,30 @@
 // tampering packet module
-#include "iup.h"
-#include "windivert.h"
+// with ber set it's a bit error model instead: every payload bit flips on its
+// own with that probability. rather than a draw per bit, the gap to the next
+// flipped bit is drawn from the geometric distribution and carried across
+// packets, so the cost goes with the bits flipped, not the bits seen
+#include <stdlib.h>
+#include <math.h>
 #include "common.h"
 #define NAME "tamper"
-
-static Ihandle *inboundCheckbox, *outboundCheckbox, *chanceInput, *checksumCheckbox;
+#define BER_MIN "0"
+#define BER_MAX "100000000" // 1e-1
 
 static volatile short tamperEnabled = 0,
     tamperInbound = 1,
     tamperOutbound = 1,
     chance = 1000, // [0 - 10000]
     doChecksum = 1; // recompute checksum after after tampering
+static volatile LONG ber = 0; // flipped bits per 10^9, 0 tampers by chance
+
+// bits to pass over before the next flip, drawn for berDrawn
+static UINT64 skipBits;
+static LONG berDrawn;
+static double logKeep; // log(1 - ber)
+static UINT64 rngState;
+
+#ifndef CLUMSY_HEADLESS
+static Ihandle *inboundCheckbox, *outboundCheckbox, *chanceInput, *checksumCheckbox, *berInput;
 
 static Ihandle* tamperSetupUI() {
     Ihandle *dupControlsBox = IupHbox(
@@ -19,6 +33,8 @@ static Ihandle* tamperSetupUI() {
         outboundCheckbox = IupToggle("Outbound", NULL),
         IupLabel("Chance(%):"),
         chanceInput = IupText(NULL),
+        IupLabel("BER(1e-9):"),
+        berInput = IupText(NULL),
         NULL
         );
 
@@ -33,6 +49,12 @@ static Ihandle* tamperSetupUI() {
     // sync doChecksum
     IupSetCallback(checksumCheckbox, "ACTION", (Icallback)uiSyncToggle);
     IupSetAttribute(checksumCheckbox, SYNCED_VALUE, (char*)&doChecksum);
+    IupSetAttribute(berInput, "VISIBLECOLUMNS", "6");
+    IupSetAttribute(berInput, "VALUE", "0");
+    IupSetCallback(berInput, "VALUECHANGED_CB", uiSyncInt32);
+    IupSetAttribute(berInput, SYNCED_VALUE, (char*)&ber);
+    IupSetAttribute(berInput, INTEGER_MAX, BER_MAX);
+    IupSetAttribute(berInput, INTEGER_MIN, BER_MIN);
 
     // enable by default to avoid confusing
     IupSetAttribute(inboundCheckbox, "VALUE", "ON");
@@ -44,10 +66,12 @@ static Ihandle* tamperSetupUI() {
         setFromParameter(outboundCheckbox, "VALUE", NAME"-outbound");
         setFromParameter(chanceInput, "VALUE", NAME"-chance");
         setFromParameter(checksumCheckbox, "VALUE", NAME"-checksum");
+        setFromParameter(berInput, "VALUE", NAME"-ber");
     }
 
     return dupControlsBox;
 }
+#endif
 
 // patterns covers every bit
 #define PATTERN_CNT 8
@@ -68,6 +92,9 @@ static int patIx; // put this here to give a more random results
 static void tamperStartup() {
     LOG("tamper enabled");
     patIx = 0;
+    // seeded off rand so --seed repeats the flips too
+    rngState = ((UINT64)rand() << 32) ^ ((UINT64)rand() << 16) ^ (UINT64)rand() ^ 0x9E3779B97F4A7C15ULL;
+    berDrawn = 0;
 }
 
 static void tamperCloseDown(PacketNode *head, PacketNode *tail) {
@@ -83,12 +110,66 @@ static INLINE_FUNCTION void tamper_buf(char *buf, UINT len) {
     }
 }
 
+// xorshift64*, rand has too few bits for the long gaps of low rates
+static double uniform() {
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    // 53 bits in (0, 1]
+    return ((rngState * 0x2545F4914F6CDD1DULL >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static UINT64 drawSkip() {
+    double skip = log(uniform()) / logKeep;
+    return skip < 1e18 ? (UINT64)skip : (UINT64)1e18;
+}
+
+// flips the bits the running gap lands on, returns how many
+static UINT flipBits(char *data, UINT len) {
+    UINT64 bits = (UINT64)len * 8, pos = 0;
+    UINT flipped = 0;
+    if (berDrawn != ber) {
+        // rate changed, the old gap was drawn for the old rate
+        berDrawn = ber;
+        logKeep = log(1 - berDrawn / 1e9);
+        skipBits = drawSkip();
+    }
+    while (bits - pos > skipBits) {
+        pos += skipBits;
+        data[pos / 8] ^= (char)(1 << (pos % 8));
+        ++flipped;
+        ++pos;
+        skipBits = drawSkip();
+    }
+    skipBits -= bits - pos;
+    return flipped;
+}
+
 static short tamperProcess(PacketNode *head, PacketNode *tail) {
     short tampered = FALSE;
     PacketNode *pac = head->next;
     while (pac != tail) {
-        if (checkDirection(pac->addr.Outbound, tamperInbound, tamperOutbound)
-            && calcChance(chance)) {
+        short matched = checkDirection(pac->addr.Outbound, tamperInbound, tamperOutbound);
+        if (matched) {
+            STATS_SEEN(tamperModule, pac);
+        }
+        if (matched && ber > 0) {
+            char *data = NULL;
+            UINT dataLen = 0, flipped;
+            // payload bits only, flipped headers wouldn't get reinjected
+            if (WinDivertHelperParsePacket(pac->packet, pac->packetLen, NULL, NULL, NULL, NULL,
+                NULL, NULL, NULL, (PVOID*)&data, &dataLen, NULL, NULL)
+                && data != NULL && dataLen != 0
+                && (flipped = flipBits(data, dataLen)) > 0) {
+                LOG("bit errors at %ld per 1e9, flipped %u of %u bits", (long)ber, flipped, dataLen * 8);
+                if (doChecksum) {
+                    WinDivertHelperCalcChecksums(pac->packet, pac->packetLen, NULL, 0);
+                }
+                tampered = TRUE;
+                STATS_ADD(tamperModule, tampered, 1);
+                PACKET_NOTE(pac, NOTE_MODIFIED);
+            }
+        } else if (matched && calcChance(chance)) {
             char *data = NULL;
             UINT dataLen = 0;
             if (WinDivertHelperParsePacket(pac->packet, pac->packetLen, NULL, NULL, NULL, NULL,
@@ -112,6 +193,8 @@ static short tamperProcess(PacketNode *head, PacketNode *tail) {
                     WinDivertHelperCalcChecksums(pac->packet, pac->packetLen, NULL, 0);
                 }
                 tampered = TRUE;
+                STATS_ADD(tamperModule, tampered, 1);
+                PACKET_NOTE(pac, NOTE_MODIFIED);
             }
 
         }
@@ -120,14 +203,24 @@ static short tamperProcess(PacketNode *head, PacketNode *tail) {
     return tampered;
 }
 
+static ModuleParam tamperParams[] = {
+    {"inbound", PARAM_TOGGLE, &tamperInbound, NULL, NULL},
+    {"outbound", PARAM_TOGGLE, &tamperOutbound, NULL, NULL},
+    {"chance", PARAM_CHANCE, &chance, NULL, NULL},
+    {"checksum", PARAM_TOGGLE, &doChecksum, NULL, NULL},
+    {"ber", PARAM_INT32, &ber, BER_MIN, BER_MAX},
+    {NULL}
+};
+
 Module tamperModule = {
     "Tamper",
     NAME,
     (short*)&tamperEnabled,
-    tamperSetupUI,
+    MODULE_UI(tamperSetupUI),
     tamperStartup,
     tamperCloseDown,
     tamperProcess,
+    tamperParams,
     // runtime fields
-    0, 0, NULL
+    0, 0, NULL, NULL, 0, 0
 };
@@ -1,14 +1,9 @@
 // throttling packets
-#include "iup.h"
 #include "common.h"
 #define NAME "throttle"
 #define TIME_MIN "0"
 #define TIME_MAX "1000"
 #define TIME_DEFAULT 30
-// threshold for how many packet to throttle at most
-#define KEEP_AT_MOST 1000
-
-static Ihandle *inboundCheckbox, *outboundCheckbox, *chanceInput, *frameInput, *dropThrottledCheckbox;
 
 static volatile short throttleEnabled = 0,
     throttleInbound = 1, throttleOutbound = 1,
@@ -16,7 +11,8 @@ static volatile short throttleEnabled = 0,
     // time frame in ms, when a throttle start the packets within the time 
     // will be queued and sent altogether when time is over
     throttleFrame = TIME_DEFAULT,
-    dropThrottled = 0; 
+    dropThrottled = 0,
+    throttleBudget = BUDGET_RELEASE; // over the memory budget, see budget.c
 
 static PacketNode throttleHeadNode = {0}, throttleTailNode = {0};
 static PacketNode *bufHead = &throttleHeadNode, *bufTail = &throttleTailNode;
@@ -29,6 +25,9 @@ static INLINE_FUNCTION short isBufEmpty() {
     return ret;
 }
 
+#ifndef CLUMSY_HEADLESS
+static Ihandle *inboundCheckbox, *outboundCheckbox, *chanceInput, *frameInput, *dropThrottledCheckbox;
+
 static Ihandle *throttleSetupUI() {
     Ihandle *throttleControlsBox = IupHbox(
         dropThrottledCheckbox = IupToggle("Drop Throttled", NULL),
@@ -69,10 +68,12 @@ static Ihandle *throttleSetupUI() {
         setFromParameter(outboundCheckbox, "VALUE", NAME"-outbound");
         setFromParameter(chanceInput, "VALUE", NAME"-chance");
         setFromParameter(frameInput, "VALUE", NAME"-frame");
+        setFromParameter(dropThrottledCheckbox, "VALUE", NAME"-drop");
     }
 
     return throttleControlsBox;
 }
+#endif
 
 static void throttleStartUp() {
     if (bufHead->next == NULL && bufTail->next == NULL) {
@@ -88,8 +89,10 @@ static void throttleStartUp() {
 
 static void clearBufPackets(PacketNode *tail) {
     PacketNode *oldLast = tail->prev;
-    LOG("Throttled end, send all %d packets. Buffer at max: %s", bufSize, bufSize == KEEP_AT_MOST ? "YES" : "NO");
+    LOG("Throttled end, send all %d packets.", bufSize);
     while (!isBufEmpty()) {
+        budgetRefund(&throttleModule, bufTail->prev);
+        compressTake(bufTail->prev);
         insertAfter(popNode(bufTail->prev), oldLast);
         --bufSize;
     }
@@ -97,9 +100,11 @@ static void clearBufPackets(PacketNode *tail) {
 }
 
 static void dropBufPackets() {
-    LOG("Throttled end, drop all %d packets. Buffer at max: %s", bufSize, bufSize == KEEP_AT_MOST ? "YES" : "NO");
+    LOG("Throttled end, drop all %d packets.", bufSize);
+    STATS_ADD(throttleModule, dropped, bufSize);
     while (!isBufEmpty()) {
-        freeNode(popNode(bufTail->prev));
+        budgetRefund(&throttleModule, bufTail->prev);
+        dropNode(popNode(bufTail->prev));
         --bufSize;
     }
     throttleStartTick = 0;
@@ -110,6 +115,7 @@ static void throttleCloseDown(PacketNode *head, PacketNode *tail) {
     UNREFERENCED_PARAMETER(tail);
     UNREFERENCED_PARAMETER(head);
     clearBufPackets(tail);
+    STATS_BUFFERED(throttleModule, 0);
     endTimePeriod();
 }
 
@@ -119,7 +125,7 @@ static short throttleProcess(PacketNode *head, PacketNode *tail) {
     if (!throttleStartTick) {
         if (!isListEmpty() && calcChance(chance)) {
             LOG("Start new throttling w/ chance %.1f, time frame: %d", chance/10.0, throttleFrame);
-            throttleStartTick = timeGetTime();
+            throttleStartTick = clockMs();
             throttled = TRUE;
             goto THROTTLE_START; // need this goto since maybe we'll start and stop at this single call
         }
@@ -129,9 +135,19 @@ THROTTLE_START:
         {
             // already throttling, keep filling up
             PacketNode *pac = tail->prev;
-            DWORD currentTick = timeGetTime();
-            while (bufSize < KEEP_AT_MOST && pac != head) {
+            DWORD currentTick = clockMs();
+            // meant to be held until the frame is over
+            LONG frameLeft = (LONG)(throttleStartTick + throttleFrame - currentTick);
+            while (pac != head) {
                 if (checkDirection(pac->addr.Outbound, throttleInbound, throttleOutbound)) {
+                    STATS_SEEN(throttleModule, pac);
+                    STATS_ADD(throttleModule, delayed, 1);
+                    PACKET_NOTE(pac, NOTE_DELAYED);
+                    if (frameLeft > 0) {
+                        pac->intendedUs += frameLeft * 1000;
+                    }
+                    budgetCharge(&throttleModule, pac);
+                    compressQueue(pac);
                     insertAfter(popNode(pac), bufHead);
                     ++bufSize;
                     pac = tail->prev;
@@ -140,8 +156,23 @@ THROTTLE_START:
                 }
             }
 
+            // over the memory budget, give up what we hold until back under
+            while (budgetExceeded() && !isBufEmpty()) {
+                pac = throttleBudget == BUDGET_TAIL_DROP ? bufHead->next : bufTail->prev;
+                budgetRefund(&throttleModule, pac);
+                popNode(pac);
+                --bufSize;
+                if (throttleBudget == BUDGET_RELEASE) {
+                    compressTake(pac);
+                    insertAfter(pac, head);
+                } else {
+                    dropNode(pac);
+                    STATS_ADD(throttleModule, dropped, 1);
+                }
+            }
+
             // send all when throttled enough, including in current step
-            if (bufSize >= KEEP_AT_MOST || (currentTick - throttleStartTick > (unsigned int)throttleFrame)) {
+            if (currentTick - throttleStartTick > (unsigned int)throttleFrame) {
                 // drop throttled if dropThrottled is toggled
                 if (dropThrottled) {
                     dropBufPackets();
@@ -152,17 +183,32 @@ THROTTLE_START:
         }
     }
 
+    if (throttleStartTick) {
+        clockWakeAt(throttleStartTick + throttleFrame + 1);
+    }
+    STATS_BUFFERED(throttleModule, bufSize);
     return throttled;
 }
 
+static ModuleParam throttleParams[] = {
+    {"inbound", PARAM_TOGGLE, &throttleInbound, NULL, NULL},
+    {"outbound", PARAM_TOGGLE, &throttleOutbound, NULL, NULL},
+    {"chance", PARAM_CHANCE, &chance, NULL, NULL},
+    {"frame", PARAM_SHORT, &throttleFrame, TIME_MIN, TIME_MAX},
+    {"drop", PARAM_TOGGLE, &dropThrottled, NULL, NULL},
+    {"budget", PARAM_CHOICE, &throttleBudget, BUDGET_POLICIES, NULL},
+    {NULL}
+};
+
 Module throttleModule = {
     "Throttle",
     NAME,
     (short*)&throttleEnabled,
-    throttleSetupUI,
+    MODULE_UI(throttleSetupUI),
     throttleStartUp,
     throttleCloseDown,
     throttleProcess,
+    throttleParams,
     // runtime fields
-    0, 0, NULL
+    0, 0, NULL, NULL, 0, 0
 };
\ No newline at end of file
@@ -0,0 +1,536 @@
+// linux tun backend, clumsy sits inline between two tun interfaces and
+// forwards whatever one side writes out of the other. with one end in a
+// network namespace this gives a self contained link to benchmark through:
+//   --tun-a       near side, packets read from it are outbound, default clumsy0
+//   --tun-b       far side, packets read from it are inbound, default clumsy1
+//   --tun-b-netns create or attach tun-b inside the namespace /run/netns/<name>
+//   --tun-mtu     mtu both interfaces are set to, default 1500
+// interfaces are made persistent and brought up, addresses and routes are left
+// to the user, e.g. with --tun-b-netns cl:
+//   ip addr add 10.9.0.1/24 dev clumsy0
+//   ip -n cl addr add 10.9.0.2/24 dev clumsy1
+// the capture filter is ignored, everything routed into the pair goes through.
+// all io goes through io_uring, no liburing needed. reads are multishot into a
+// ring of provided buffers and packets are copied once from there into the
+// engine, writes come from a registered buffer and are submitted once per
+// engine step. kernels before 6.7 fall back to one shot reads.
+#ifdef __linux__
+// setns
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <linux/io_uring.h>
+#include "common.h"
+
+#define TUN_A_DEFAULT "clumsy0"
+#define TUN_B_DEFAULT "clumsy1"
+#define TUN_MTU_DEFAULT 1500
+#define TUN_MTU_MIN 576
+#define TUN_TXQUEUE_LEN 8192 // packets the kernel queues for us while the engine is busy
+#define TUN_RECV_BUFS 1024 // provided buffers, a power of 2
+#define TUN_SEND_SLOTS 1024 // writes in flight at most
+#define TUN_RING_ENTRIES 256
+#define TUN_CQ_ENTRIES 4096
+#define TUN_RECV_TIMEOUT_MS 100
+#define TUN_BUFFER_GROUP 0
+// older headers don't have it, the kernel answers -EINVAL if it doesn't either
+#define TUN_OP_READ_MULTISHOT 49
+
+typedef struct {
+    int fd;
+    unsigned entries, toSubmit;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ringMap;
+    size_t ringMapLen, sqesLen;
+} Ring;
+
+// reads come in on recvRing, owned by the read loop. writes go out on
+// sendRing, owned by whoever holds the engine lock
+static Ring recvRing = { -1 }, sendRing = { -1 };
+static int tunFds[2] = { -1, -1 };
+static BOOL multishot[2];
+static UINT bufSize;
+static struct io_uring_buf_ring *bufRing;
+static char *recvBufs, *sendBufs;
+static UINT freeSlots[TUN_SEND_SLOTS], freeCount;
+static volatile short tunClosed;
+static UINT64 overruns, truncated, sendErrors, directWrites;
+
+static int ringSetup(Ring *ring, unsigned entries, unsigned cqEntries) {
+    struct io_uring_params params;
+    size_t sqLen, cqLen;
+    char *map;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cqEntries;
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -errno;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(ring->fd);
+        ring->fd = -1;
+        return -EOPNOTSUPP;
+    }
+    sqLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ringMapLen = sqLen > cqLen ? sqLen : cqLen;
+    ring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+    map = (char*)mmap(NULL, ring->ringMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        ring->fd = -1;
+        return -ENOMEM;
+    }
+    ring->ringMap = map;
+    ring->entries = params.sq_entries;
+    ring->toSubmit = 0;
+    ring->sqHead = (unsigned*)(map + params.sq_off.head);
+    ring->sqTail = (unsigned*)(map + params.sq_off.tail);
+    ring->sqMask = (unsigned*)(map + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(map + params.sq_off.array);
+    ring->cqHead = (unsigned*)(map + params.cq_off.head);
+    ring->cqTail = (unsigned*)(map + params.cq_off.tail);
+    ring->cqMask = (unsigned*)(map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(map + params.cq_off.cqes);
+    return 0;
+}
+
+static void ringFree(Ring *ring) {
+    if (ring->fd < 0) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqesLen);
+    munmap(ring->ringMap, ring->ringMapLen);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+// submit what's queued, waiting for a completion when wait is set. with a
+// timeout in ms it gives up after that long and returns -ETIME
+static int ringEnter(Ring *ring, BOOL wait, int timeoutMs) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    memset(&arg, 0, sizeof(arg));
+    if (wait && timeoutMs > 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (timeoutMs % 1000) * 1000000LL;
+        arg.ts = (UINT64)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    ret = (int)syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, wait ? 1 : 0, flags,
+        flags & IORING_ENTER_EXT_ARG ? (void*)&arg : NULL, sizeof(arg));
+    if (ret < 0) {
+        return -errno;
+    }
+    ring->toSubmit -= (unsigned)ret < ring->toSubmit ? (unsigned)ret : ring->toSubmit;
+    return ret;
+}
+
+// next free sqe, cleared, or NULL if the kernel hasn't taken any of a full ring
+static struct io_uring_sqe* ringSqe(Ring *ring) {
+    unsigned tail = *ring->sqTail;
+    struct io_uring_sqe *sqe;
+    if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->entries) {
+        ringEnter(ring, FALSE, 0);
+        if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->entries) {
+            return NULL;
+        }
+    }
+    sqe = &ring->sqes[tail & *ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// hand the sqe from ringSqe to the kernel with the next enter
+static void ringPush(Ring *ring) {
+    unsigned tail = *ring->sqTail;
+    ring->sqArray[tail & *ring->sqMask] = tail & *ring->sqMask;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++ring->toSubmit;
+}
+
+static struct io_uring_cqe* ringPeek(Ring *ring) {
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cqMask];
+}
+
+static void ringSeen(Ring *ring) {
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+// page aligned, as the buffer ring has to be
+static void* mapPages(size_t len) {
+    void *pages = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    return pages == MAP_FAILED ? NULL : pages;
+}
+
+// a provided buffer goes back to the kernel once its packet is copied out
+static void recycleBuffer(UINT16 bid) {
+    UINT16 tail = bufRing->tail;
+    struct io_uring_buf *buf = &bufRing->bufs[tail & (TUN_RECV_BUFS - 1)];
+    buf->addr = (UINT64)(uintptr_t)(recvBufs + (size_t)bid * bufSize);
+    buf->len = bufSize;
+    buf->bid = bid;
+    __atomic_store_n(&bufRing->tail, (UINT16)(tail + 1), __ATOMIC_RELEASE);
+}
+
+static BOOL armRead(int side) {
+    struct io_uring_sqe *sqe = ringSqe(&recvRing);
+    if (sqe == NULL) {
+        return FALSE;
+    }
+    sqe->opcode = multishot[side] ? TUN_OP_READ_MULTISHOT : IORING_OP_READ;
+    sqe->fd = side; // registered file index
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->buf_group = TUN_BUFFER_GROUP;
+    sqe->len = multishot[side] ? 0 : bufSize;
+    sqe->user_data = (UINT64)side;
+    ringPush(&recvRing);
+    return TRUE;
+}
+
+static int ifaceIoctl(const char *name, unsigned long request, struct ifreq *ifr) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0), ret;
+    if (fd < 0) {
+        return -1;
+    }
+    strncpy(ifr->ifr_name, name, IFNAMSIZ - 1);
+    ret = ioctl(fd, request, ifr);
+    close(fd);
+    return ret;
+}
+
+// create the interface or attach to it, then set it persistent and up. runs
+// in whatever namespace the thread is in at the time
+static int openTun(const char *name, int mtu, char buf[]) {
+    struct ifreq ifr;
+    int fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        sprintf(buf, "Failed to open /dev/net/tun (%d)%s", errno, errno == EACCES ? ", run as root" : "");
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) != 0) {
+        sprintf(buf, "Failed to attach tun %s (%d)%s", name, errno,
+            errno == EBUSY ? ", in use by another process" : errno == EINVAL ? ", not a tun interface" : "");
+        close(fd);
+        return -1;
+    }
+    ioctl(fd, TUNSETPERSIST, 1);
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_mtu = mtu;
+    if (ifaceIoctl(name, SIOCSIFMTU, &ifr) != 0) {
+        LOG("tun failed to set mtu %d on %s (%d)", mtu, name, errno);
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_qlen = TUN_TXQUEUE_LEN;
+    ifaceIoctl(name, SIOCSIFTXQLEN, &ifr);
+    memset(&ifr, 0, sizeof(ifr));
+    if (ifaceIoctl(name, SIOCGIFFLAGS, &ifr) == 0) {
+        ifr.ifr_flags |= IFF_UP;
+        ifaceIoctl(name, SIOCSIFFLAGS, &ifr);
+    }
+    return fd;
+}
+
+static int openTunIn(const char *name, const char *netns, int mtu, char buf[]) {
+    char path[MSG_BUFSIZE];
+    int home, target, fd;
+    if (netns == NULL) {
+        return openTun(name, mtu, buf);
+    }
+    snprintf(path, sizeof(path), "/run/netns/%s", netns);
+    home = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+    target = open(path, O_RDONLY | O_CLOEXEC);
+    if (home < 0 || target < 0 || setns(target, CLONE_NEWNET) != 0) {
+        sprintf(buf, "Failed to enter network namespace %s (%d), create it with ip netns add", netns, errno);
+        fd = -1;
+    } else {
+        fd = openTun(name, mtu, buf);
+        if (setns(home, CLONE_NEWNET) != 0) {
+            LOG("tun failed to return to the original network namespace (%d)", errno);
+        }
+    }
+    if (home >= 0) {
+        close(home);
+    }
+    if (target >= 0) {
+        close(target);
+    }
+    return fd;
+}
+
+// drop what the last run left behind, its read loop may have been waiting on
+// the ring when it was closed
+static void tunRelease() {
+    int side;
+    ringFree(&recvRing);
+    ringFree(&sendRing);
+    for (side = 0; side < 2; ++side) {
+        if (tunFds[side] >= 0) {
+            close(tunFds[side]);
+            tunFds[side] = -1;
+        }
+    }
+    if (bufRing) {
+        munmap(bufRing, sizeof(struct io_uring_buf) * TUN_RECV_BUFS);
+        bufRing = NULL;
+    }
+    if (recvBufs) {
+        munmap(recvBufs, (size_t)bufSize * TUN_RECV_BUFS);
+        recvBufs = NULL;
+    }
+    if (sendBufs) {
+        munmap(sendBufs, (size_t)bufSize * TUN_SEND_SLOTS);
+        sendBufs = NULL;
+    }
+}
+
+static BOOL tunOpen(const char *filter, char buf[]) {
+    const char *nameA = getArg("tun-a"), *nameB = getArg("tun-b"), *netns = getArg("tun-b-netns");
+    const char *value = getArg("tun-mtu");
+    int mtu = value ? atoi(value) : TUN_MTU_DEFAULT, ret, side;
+    struct io_uring_buf_reg reg;
+    struct iovec iov;
+    UINT ix;
+
+    UNREFERENCED_PARAMETER(filter);
+    tunRelease();
+    if (mtu < TUN_MTU_MIN || mtu > MAX_PACKETSIZE) {
+        sprintf(buf, "--tun-mtu must be in [%d, %d]", TUN_MTU_MIN, MAX_PACKETSIZE);
+        return FALSE;
+    }
+    // buffers keep packets 64 byte aligned
+    bufSize = ((UINT)mtu + 63) & ~63u;
+    tunFds[0] = openTun(nameA ? nameA : TUN_A_DEFAULT, mtu, buf);
+    if (tunFds[0] < 0) {
+        goto FAIL;
+    }
+    tunFds[1] = openTunIn(nameB ? nameB : TUN_B_DEFAULT, netns, mtu, buf);
+    if (tunFds[1] < 0) {
+        goto FAIL;
+    }
+
+    ret = ringSetup(&recvRing, TUN_RING_ENTRIES, TUN_CQ_ENTRIES);
+    if (ret == 0) {
+        ret = ringSetup(&sendRing, TUN_RING_ENTRIES, TUN_CQ_ENTRIES);
+    }
+    if (ret != 0) {
+        sprintf(buf, "Failed to set up io_uring (%d)%s", -ret,
+            ret == -EPERM ? ", check kernel.io_uring_disabled" : ret == -EOPNOTSUPP ? ", kernel too old" : "");
+        goto FAIL;
+    }
+    if (syscall(__NR_io_uring_register, recvRing.fd, IORING_REGISTER_FILES, tunFds, 2) != 0
+        || syscall(__NR_io_uring_register, sendRing.fd, IORING_REGISTER_FILES, tunFds, 2) != 0) {
+        sprintf(buf, "Failed to register tun files with io_uring (%d)", errno);
+        goto FAIL;
+    }
+
+    // reads land in a ring of provided buffers the kernel picks from
+    recvBufs = (char*)mapPages((size_t)bufSize * TUN_RECV_BUFS);
+    sendBufs = (char*)mapPages((size_t)bufSize * TUN_SEND_SLOTS);
+    bufRing = (struct io_uring_buf_ring*)mapPages(sizeof(struct io_uring_buf) * TUN_RECV_BUFS);
+    if (recvBufs == NULL || sendBufs == NULL || bufRing == NULL) {
+        sprintf(buf, "Failed to allocate tun buffers");
+        goto FAIL;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (UINT64)(uintptr_t)bufRing;
+    reg.ring_entries = TUN_RECV_BUFS;
+    reg.bgid = TUN_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, recvRing.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        sprintf(buf, "Failed to register io_uring buffer ring (%d), needs linux 5.19", errno);
+        goto FAIL;
+    }
+    bufRing->tail = 0;
+    for (ix = 0; ix < TUN_RECV_BUFS; ++ix) {
+        recycleBuffer((UINT16)ix);
+    }
+    // writes copy into slots of one registered buffer, no page pinning per write
+    iov.iov_base = sendBufs;
+    iov.iov_len = (size_t)bufSize * TUN_SEND_SLOTS;
+    if (syscall(__NR_io_uring_register, sendRing.fd, IORING_REGISTER_BUFFERS, &iov, 1) != 0) {
+        sprintf(buf, "Failed to register io_uring send buffer (%d)", errno);
+        goto FAIL;
+    }
+    for (ix = 0; ix < TUN_SEND_SLOTS; ++ix) {
+        freeSlots[ix] = TUN_SEND_SLOTS - 1 - ix;
+    }
+    freeCount = TUN_SEND_SLOTS;
+
+    for (side = 0; side < 2; ++side) {
+        multishot[side] = TRUE;
+        armRead(side);
+    }
+    ringEnter(&recvRing, FALSE, 0);
+    overruns = truncated = sendErrors = directWrites = 0;
+    tunClosed = 0;
+    LOG("tun backend between %s and %s%s%s, mtu %d", nameA ? nameA : TUN_A_DEFAULT, nameB ? nameB : TUN_B_DEFAULT,
+        netns ? " in " : "", netns ? netns : "", mtu);
+    return TRUE;
+
+FAIL:
+    tunRelease();
+    return FALSE;
+}
+
+static int tunRecv(char *buf, UINT bufLen, UINT *readLen, WINDIVERT_ADDRESS *addr) {
+    struct io_uring_cqe *cqe;
+    int side, res, ret;
+    UINT flags;
+    UINT16 bid;
+    for (;;) {
+        if (tunClosed) {
+            return RECV_STATUS_CLOSED;
+        }
+        cqe = ringPeek(&recvRing);
+        if (cqe == NULL) {
+            ret = ringEnter(&recvRing, TRUE, TUN_RECV_TIMEOUT_MS);
+            if (ret == -ETIME || ret == -EINTR) {
+                return RECV_STATUS_RETRY;
+            }
+            if (ret < 0 && ret != -EBUSY) {
+                LOG("tun io_uring wait failed (%d)", -ret);
+                return RECV_STATUS_RETRY;
+            }
+            continue;
+        }
+        side = (int)cqe->user_data;
+        res = cqe->res;
+        flags = cqe->flags;
+        ringSeen(&recvRing);
+        if (res < 0) {
+            if (res == -EINVAL && multishot[side]) {
+                LOG("tun multishot reads not supported, reading one shot");
+                multishot[side] = FALSE;
+            } else if (res == -ENOBUFS) {
+                // every buffer is waiting on the engine, the kernel queue takes the slack
+                ++overruns;
+            } else if (res != -ECANCELED) {
+                LOG("tun read failed (%d)", -res);
+            }
+        } else if (flags & IORING_CQE_F_BUFFER) {
+            bid = (UINT16)(flags >> IORING_CQE_BUFFER_SHIFT);
+            if ((UINT)res > bufLen) {
+                ++truncated;
+                res = (int)bufLen;
+            }
+            memcpy(buf, recvBufs + (size_t)bid * bufSize, res);
+            recycleBuffer(bid);
+        }
+        if (!(flags & IORING_CQE_F_MORE) && !tunClosed) {
+            armRead(side);
+        }
+        if (res <= 0 || !(flags & IORING_CQE_F_BUFFER)) {
+            continue;
+        }
+        *readLen = (UINT)res;
+        memset(addr, 0, sizeof(WINDIVERT_ADDRESS));
+        addr->Outbound = side == 0;
+        addr->IPv6 = (buf[0] & 0xF0) == 0x60;
+        return RECV_STATUS_OK;
+    }
+}
+
+static void reapSends() {
+    struct io_uring_cqe *cqe;
+    while ((cqe = ringPeek(&sendRing)) != NULL) {
+        if (cqe->res < 0) {
+            ++sendErrors;
+        }
+        freeSlots[freeCount++] = (UINT)cqe->user_data;
+        ringSeen(&sendRing);
+    }
+}
+
+static short tunSend(PacketNode *pnode) {
+    struct io_uring_sqe *sqe;
+    int side = pnode->addr.Outbound ? 1 : 0, ret;
+    UINT slot;
+    reapSends();
+    // all slots in flight, wait for the oldest writes
+    while (freeCount == 0) {
+        ret = ringEnter(&sendRing, TRUE, 0);
+        if (ret < 0 && ret != -EINTR) {
+            break;
+        }
+        reapSends();
+    }
+    sqe = freeCount ? ringSqe(&sendRing) : NULL;
+    if (sqe == NULL || pnode->packetLen > bufSize) {
+        ++directWrites;
+        return write(tunFds[side], pnode->packet, pnode->packetLen) == (ssize_t)pnode->packetLen
+            ? SEND_STATUS_SEND : SEND_STATUS_FAIL;
+    }
+    slot = freeSlots[--freeCount];
+    memcpy(sendBufs + (size_t)slot * bufSize, pnode->packet, pnode->packetLen);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = side;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (UINT64)(uintptr_t)(sendBufs + (size_t)slot * bufSize);
+    sqe->len = pnode->packetLen;
+    sqe->buf_index = 0;
+    sqe->user_data = slot;
+    ringPush(&sendRing);
+    return SEND_STATUS_SEND;
+}
+
+static void tunFlush() {
+    if (sendRing.toSubmit) {
+        ringEnter(&sendRing, FALSE, 0);
+    }
+}
+
+// the last sends are flushed and waited for, the rest stays for the next open
+static void tunClose() {
+    InterlockedExchange16(&tunClosed, 1);
+    tunFlush();
+    reapSends();
+    while (freeCount < TUN_SEND_SLOTS && ringEnter(&sendRing, TRUE, TUN_RECV_TIMEOUT_MS) >= 0) {
+        reapSends();
+    }
+    LOG("tun closed, %llu read overruns, %llu truncated, %llu failed writes, %llu written directly",
+        (unsigned long long)overruns, (unsigned long long)truncated,
+        (unsigned long long)sendErrors, (unsigned long long)directWrites);
+}
+
+Backend tunBackend = {
+    "tun",
+    tunOpen,
+    tunRecv,
+    tunSend,
+    tunClose,
+    0,
+    0,
+    NULL,
+    tunFlush,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+#endif
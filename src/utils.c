@@ -1,7 +1,13 @@
 #include <stdlib.h>
-#include <Windows.h>
-#include "iup.h"
+#include <string.h>
+#include <ctype.h>
 #include "common.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 short calcChance(short chance) {
     // notice that here we made a copy of chance, so even though it's volatile it is still ok
@@ -25,7 +31,85 @@ void endTimePeriod() {
     }
 }
 
+// engine clock. a virtual clock starts where the real one was at clockStart
+// and only moves when the engine's driver advances it, so both kinds of
+// readings stay comparable with anything taken before the start.
+static volatile short clockVirtual;
+static LONGLONG clockBaseTick, clockFrequency;
+static DWORD clockBaseMs;
+static UINT64 virtualUs; // only written by the driver thread
+static BOOL wakePending;
+static UINT64 wakeUs;
 
+void clockStart(BOOL virtualClock) {
+    LARGE_INTEGER tick;
+    QueryPerformanceFrequency(&tick);
+    clockFrequency = tick.QuadPart;
+    QueryPerformanceCounter(&tick);
+    clockBaseTick = tick.QuadPart;
+    clockBaseMs = timeGetTime();
+    virtualUs = 0;
+    wakePending = FALSE;
+    InterlockedExchange16(&clockVirtual, (short)virtualClock);
+}
+
+BOOL clockIsVirtual() {
+    return clockVirtual;
+}
+
+DWORD clockMs() {
+    if (clockVirtual) {
+        return clockBaseMs + (DWORD)(virtualUs / 1000);
+    }
+    return timeGetTime();
+}
+
+LONGLONG clockTicks() {
+    LARGE_INTEGER now;
+    if (clockVirtual) {
+        return clockBaseTick + (LONGLONG)(virtualUs / 1000000) * clockFrequency
+            + (LONGLONG)(virtualUs % 1000000) * clockFrequency / 1000000;
+    }
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+UINT64 clockVirtualUs() {
+    return virtualUs;
+}
+
+void clockAdvance(UINT64 us) {
+    if (us > virtualUs) {
+        virtualUs = us;
+    }
+}
+
+// a module holding packets tells when clockMs() needs to have reached ms for
+// it to release some. ignored by the real clock, which steps on its own
+void clockWakeAt(DWORD ms) {
+    LONG ahead;
+    UINT64 us;
+    if (!clockVirtual) {
+        return;
+    }
+    ahead = (LONG)(ms - clockMs());
+    us = ahead > 0 ? (virtualUs / 1000 + ahead) * 1000 : virtualUs;
+    if (!wakePending || us < wakeUs) {
+        wakeUs = us;
+        wakePending = TRUE;
+    }
+}
+
+// earliest wake up asked for since the last call, in virtual microseconds
+BOOL clockTakeWake(UINT64 *us) {
+    BOOL pending = wakePending;
+    *us = wakeUs;
+    wakePending = FALSE;
+    return pending;
+}
+
+
+#ifndef CLUMSY_HEADLESS
 // shared callbacks
 int uiSyncChance(Ihandle *ih) {
     char valueBuf[8];
@@ -75,6 +159,7 @@ int uiSyncInt32(Ihandle *ih) {
 int uiSyncToggle(Ihandle *ih, int state) {
     short *togglePtr = (short*)IupGetAttribute(ih, SYNCED_VALUE);
     InterlockedExchange16(togglePtr, I2S(state));
+    MODULES_CHANGED();
     return IUP_DEFAULT;
 }
 
@@ -128,6 +213,7 @@ int uiSyncFixed(Ihandle *ih) {
     InterlockedExchange16(fixedPointer, fixValue);
     return IUP_DEFAULT;
 }
+#endif
 
 
 // indicator icon, generated from scripts/im2carr.py
@@ -142,10 +228,37 @@ const unsigned char icon8x8[8*8] = {
     0, 0, 1, 1, 1, 1, 0, 0,
 };
 
+// "--key value" options, later entries win
+#define ARGS_MAX 128
+static const char *argKeys[ARGS_MAX], *argValues[ARGS_MAX];
+static int argCount = 0;
+
+static BOOL storeArg(const char *key, const char *value) {
+    if (argCount >= ARGS_MAX) {
+        return 0;
+    }
+    argKeys[argCount] = key;
+    argValues[argCount] = value;
+    ++argCount;
+    LOG("option: %s : %s", key, value);
+    return 1;
+}
+
+const char* getArg(const char *key) {
+    int ix;
+    for (ix = argCount - 1; ix >= 0; --ix) {
+        if (strcmp(argKeys[ix], key) == 0) {
+            return argValues[ix];
+        }
+    }
+    return NULL;
+}
+
+#ifndef CLUMSY_HEADLESS
 typedef int (*IstateCallback)(Ihandle *ih, int state);
 // parameterized setter
 void setFromParameter(Ihandle *ih, const char *field, const char *key) {
-    char* val = IupGetGlobal(key);
+    const char* val = getArg(key);
     Icallback cb;
     IstateCallback scb;
     // FIXME there should be a way to trigger handler
@@ -170,6 +283,7 @@ void setFromParameter(Ihandle *ih, const char *field, const char *key) {
         }
     }
 }
+#endif
 
 // parse arguments and set globals
 // only checks for argument style, no extra validation is done
@@ -190,9 +304,93 @@ BOOL parseArgs(int argc, char* argv[]) {
             return 0;
         }
         value = argv[ix];
-        IupStoreGlobal(key, value);
-        LOG("option: %s : %s", key, value);
+        if (!storeArg(key, value)) {
+            return 0;
+        }
     }
 
     return 1;
 }
+
+// profile file holds the same options as the command line, one "key: value" per line
+// and '#' for comments. options already given on the command line take precedence.
+BOOL loadProfile(const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[MSG_BUFSIZE];
+    if (!f) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *key = line, *value, *end;
+        while (isspace((unsigned char)*key)) ++key;
+        if (*key == '#' || *key == '\0') {
+            continue;
+        }
+        value = strchr(key, ':');
+        if (!value) {
+            continue;
+        }
+        // trim both sides of key and value
+        for (end = value; end > key && isspace((unsigned char)end[-1]); --end);
+        *end = '\0';
+        ++value;
+        while (isspace((unsigned char)*value)) ++value;
+        for (end = value + strlen(value); end > value && isspace((unsigned char)end[-1]); --end);
+        *end = '\0';
+        if (getArg(key) == NULL) {
+            storeArg(_strdup(key), _strdup(value));
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+// map a whole file read only. pages are faulted in as they're read so long
+// files cost address space rather than memory
+const char* mapFileRead(const char *path, size_t *len) {
+#ifdef _WIN32
+    HANDLE file, mapping;
+    LARGE_INTEGER size;
+    const char *data = NULL;
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0 && (UINT64)size.QuadPart <= (SIZE_T)-1) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL) {
+            // the view keeps the mapping alive
+            data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        *len = (size_t)size.QuadPart;
+    }
+    CloseHandle(file);
+    return data;
+#else
+    struct stat st;
+    void *data = MAP_FAILED;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+        }
+        *len = (size_t)st.st_size;
+    }
+    close(fd);
+    return data == MAP_FAILED ? NULL : (const char*)data;
+#endif
+}
+
+void unmapFile(const char *data, size_t len) {
+#ifdef _WIN32
+    UNREFERENCED_PARAMETER(len);
+    UnmapViewOfFile(data);
+#else
+    munmap((void*)data, len);
+#endif
+}
@@ -0,0 +1,722 @@
+// linux af_xdp backend for line rate tests. clumsy bridges two interfaces,
+// typically the host ends of two veth pairs whose other ends sit in network
+// namespaces, and forwards each side's frames out of the other:
+//   --xdp-a       near side, packets read from it are outbound
+//   --xdp-b       far side, packets read from it are inbound
+//   --xdp-queues  rx queues bound on each side, default 1. a veth has as many
+//                 as it was created with, numrxqueues n numtxqueues n
+//   --xdp-frames  2KB umem frames, default 32768. frames modules hold, e.g.
+//                 under lag, come out of these, size it for rate times delay
+//   --xdp-checksums on|off, default on. veths pass on tcp and udp checksums
+//                 left for offload to finish, which clumsy then does on send
+//                 as WinDivert would. off for traffic from real nics
+// a small xdp program hands each queue's frames to its socket. all sockets
+// share one umem and the engine works on the frames in place, a packet read on
+// one side goes out the other from the same frame. only packets made up by
+// modules are copied, or packets read while the engine holds so many frames
+// the kernel would run short. frames other than ip, like arp, are passed
+// across as they are, so both sides share one link layer. the capture filter
+// is ignored, all ip frames of both interfaces are taken:
+//   ip link add xa type veth peer name xa1 netns n1
+//   ip link add xb type veth peer name xb1 netns n2
+//   ip -n n1 addr add 10.8.0.1/24 dev xa1, ip -n n2 addr add 10.8.0.2/24 dev xb1
+//   clumsy-cli --backend xdp --xdp-a xa --xdp-b xb
+// all queues are serviced by the engine's read loop, which is what takes the
+// engine lock anyway. ring statistics come with the engine's stats.
+#ifdef __linux__
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_packet.h>
+#include <linux/if_xdp.h>
+#include "common.h"
+
+#define XDP_FRAME_SIZE 2048
+#define XDP_FRAMES_DEFAULT 32768
+#define XDP_QUEUES_MAX 16
+#define XDP_RING_SIZE 2048 // each of a socket's four rings, a power of 2
+#define XDP_TX_SHARE 8 // 1 in this many frames is kept for copies sent by the engine
+#define XDP_LOW_SHARE 8 // copy packets once free rx frames drop under 1 in this many
+#define XDP_POLL_MS 100
+// sendto calls one kick makes at most, copy mode sends 32 descriptors a call
+#define XDP_KICK_TRIES (XDP_RING_SIZE / 32 * 2)
+
+typedef struct {
+    UINT32 *producer, *consumer, *flags;
+    void *descs;
+    UINT32 mask;
+    void *map;
+    size_t mapLen;
+} XskRing;
+
+typedef struct {
+    int fd;
+    int side;
+    XskRing fill, comp, rx, tx;
+    UINT txPending; // descriptors queued since the last kick
+} Xsk;
+
+static Xsk xsks[2 * XDP_QUEUES_MAX];
+static int xskCount, queueCount, nextXsk;
+static struct pollfd pollFds[2 * XDP_QUEUES_MAX];
+static int ifIndexes[2], mapFds[2] = { -1, -1 }, progFds[2] = { -1, -1 }, linkFds[2] = { -1, -1 };
+static int bridgeFd = -1;
+static BOOL zeroCopyMode, driverMode, fixChecksums;
+static char *umem;
+static UINT frameCount, rxFrames;
+// references to each rx frame held by the engine and by the tx ring, frames
+// only go back to the kernel once both let go. engine side, under the lock
+static UINT8 *refs;
+static UINT32 *txFree;
+static UINT txFreeCount;
+// frames the engine is done with, for the read loop to give back to the kernel
+static UINT32 *returned, returnedMask;
+static volatile UINT32 returnedHead, returnedTail;
+// read loop side, free rx frames not in any fill ring
+static UINT32 *spare;
+static UINT spareCount;
+// link layer header of the last frame from each side, for packets modules
+// make up. the read loop writes it without the lock, a torn read only mixes
+// up addresses both sides already use
+static char lastEth[2][ETH_ALEN * 2];
+static volatile short xdpClosed;
+static UINT64 rxCopied, bridged, txZeroCopy, txCopied, txFull, txTooBig;
+
+static UINT32 ringReady(XskRing *ring) {
+    return __atomic_load_n(ring->producer, __ATOMIC_ACQUIRE) - *ring->consumer;
+}
+
+static UINT32 ringRoom(XskRing *ring) {
+    return ring->mask + 1 - (*ring->producer - __atomic_load_n(ring->consumer, __ATOMIC_ACQUIRE));
+}
+
+static void ringProduce(XskRing *ring, UINT32 count) {
+    __atomic_store_n(ring->producer, *ring->producer + count, __ATOMIC_RELEASE);
+}
+
+static void ringConsume(XskRing *ring, UINT32 count) {
+    __atomic_store_n(ring->consumer, *ring->consumer + count, __ATOMIC_RELEASE);
+}
+
+static BOOL mapRing(int fd, XskRing *ring, struct xdp_ring_offset *off, size_t entrySize, off_t pgoff) {
+    char *map;
+    ring->mapLen = off->desc + XDP_RING_SIZE * entrySize;
+    map = (char*)mmap(NULL, ring->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (map == MAP_FAILED) {
+        ring->map = NULL;
+        return FALSE;
+    }
+    ring->map = map;
+    ring->producer = (UINT32*)(map + off->producer);
+    ring->consumer = (UINT32*)(map + off->consumer);
+    ring->flags = (UINT32*)(map + off->flags);
+    ring->descs = map + off->desc;
+    ring->mask = XDP_RING_SIZE - 1;
+    return TRUE;
+}
+
+static void unmapRing(XskRing *ring) {
+    if (ring->map) {
+        munmap(ring->map, ring->mapLen);
+        ring->map = NULL;
+    }
+}
+
+// the first socket registers the umem, the others share it with their own
+// fill and completion rings
+static BOOL openXsk(Xsk *xsk, int side, int queue, char buf[]) {
+    struct xdp_umem_reg reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp addr;
+    socklen_t optlen = sizeof(off);
+    int size = XDP_RING_SIZE;
+    BOOL first = xsk == &xsks[0];
+
+    memset(xsk, 0, sizeof(Xsk));
+    xsk->side = side;
+    xsk->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (xsk->fd < 0) {
+        sprintf(buf, "Failed to open af_xdp socket (%d)%s", errno, errno == EPERM ? ", run as root" : "");
+        return FALSE;
+    }
+    if (first) {
+        memset(&reg, 0, sizeof(reg));
+        reg.addr = (UINT64)(uintptr_t)umem;
+        reg.len = (UINT64)frameCount * XDP_FRAME_SIZE;
+        reg.chunk_size = XDP_FRAME_SIZE;
+        if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) != 0) {
+            sprintf(buf, "Failed to register umem of %u frames (%d)", frameCount, errno);
+            return FALSE;
+        }
+    }
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) != 0
+        || setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) != 0
+        || setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) != 0
+        || setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) != 0
+        || getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) != 0) {
+        sprintf(buf, "Failed to set up af_xdp rings (%d)", errno);
+        return FALSE;
+    }
+    if (!mapRing(xsk->fd, &xsk->fill, &off.fr, sizeof(UINT64), XDP_UMEM_PGOFF_FILL_RING)
+        || !mapRing(xsk->fd, &xsk->comp, &off.cr, sizeof(UINT64), XDP_UMEM_PGOFF_COMPLETION_RING)
+        || !mapRing(xsk->fd, &xsk->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING)
+        || !mapRing(xsk->fd, &xsk->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING)) {
+        sprintf(buf, "Failed to map af_xdp rings (%d)", errno);
+        return FALSE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = ifIndexes[side];
+    addr.sxdp_queue_id = queue;
+    if (first) {
+        // drivers without zero copy, veth among them, take copy mode
+        addr.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_ZEROCOPY;
+        zeroCopyMode = bind(xsk->fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        if (!zeroCopyMode) {
+            addr.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+        }
+    } else {
+        addr.sxdp_flags = XDP_SHARED_UMEM;
+        addr.sxdp_shared_umem_fd = xsks[0].fd;
+    }
+    if (!(first && zeroCopyMode) && bind(xsk->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        sprintf(buf, "Failed to bind af_xdp socket to queue %d of side %c (%d)%s", queue, 'a' + side, errno,
+            errno == EINVAL ? ", check --xdp-queues against the interface's queues" : "");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int bpfCall(int cmd, union bpf_attr *attr) {
+    return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+// xsks[rx_queue_index], or the kernel stack when no socket is bound there
+static BOOL attachProgram(int side, char buf[]) {
+    struct bpf_insn insns[] = {
+        { BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, rx_queue_index), 0 },
+        { BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, 0 },
+        { 0, 0, 0, 0, 0 },
+        { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS },
+        { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map },
+        { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 },
+    };
+    static const char license[] = "Dual MIT/GPL";
+    union bpf_attr attr;
+    int ix, key, fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(int);
+    attr.value_size = sizeof(int);
+    attr.max_entries = queueCount;
+    mapFds[side] = bpfCall(BPF_MAP_CREATE, &attr);
+    if (mapFds[side] < 0) {
+        sprintf(buf, "Failed to create xsk map (%d)", errno);
+        return FALSE;
+    }
+    for (ix = 0; ix < xskCount; ++ix) {
+        if (xsks[ix].side != side) {
+            continue;
+        }
+        key = ix % queueCount;
+        fd = xsks[ix].fd;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = mapFds[side];
+        attr.key = (UINT64)(uintptr_t)&key;
+        attr.value = (UINT64)(uintptr_t)&fd;
+        if (bpfCall(BPF_MAP_UPDATE_ELEM, &attr) != 0) {
+            sprintf(buf, "Failed to add af_xdp socket to xsk map (%d)", errno);
+            return FALSE;
+        }
+    }
+
+    insns[1].imm = mapFds[side];
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = (UINT64)(uintptr_t)insns;
+    attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+    attr.license = (UINT64)(uintptr_t)license;
+    progFds[side] = bpfCall(BPF_PROG_LOAD, &attr);
+    if (progFds[side] < 0) {
+        sprintf(buf, "Failed to load xdp program (%d)", errno);
+        return FALSE;
+    }
+    // driver mode where the interface has it, generic otherwise. the link
+    // detaches the program when closed, even if clumsy dies
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = progFds[side];
+    attr.link_create.target_ifindex = ifIndexes[side];
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+    linkFds[side] = bpfCall(BPF_LINK_CREATE, &attr);
+    if (linkFds[side] < 0) {
+        attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+        linkFds[side] = bpfCall(BPF_LINK_CREATE, &attr);
+        driverMode = FALSE;
+    }
+    if (linkFds[side] < 0) {
+        sprintf(buf, "Failed to attach xdp program to side %c (%d)%s", 'a' + side, errno,
+            errno == EBUSY ? ", another program is attached" : "");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void closeFd(int *fd) {
+    if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+// drop what the last run left behind, its read loop may have been in poll
+// when it was closed
+static void xdpRelease() {
+    int ix;
+    for (ix = 0; ix < 2; ++ix) {
+        closeFd(&linkFds[ix]);
+        closeFd(&progFds[ix]);
+        closeFd(&mapFds[ix]);
+    }
+    for (ix = 0; ix < xskCount; ++ix) {
+        unmapRing(&xsks[ix].fill);
+        unmapRing(&xsks[ix].comp);
+        unmapRing(&xsks[ix].rx);
+        unmapRing(&xsks[ix].tx);
+        closeFd(&xsks[ix].fd);
+    }
+    xskCount = 0;
+    closeFd(&bridgeFd);
+    if (umem) {
+        munmap(umem, (size_t)frameCount * XDP_FRAME_SIZE);
+        umem = NULL;
+    }
+    free(refs);
+    free(txFree);
+    free(returned);
+    free(spare);
+    refs = NULL;
+    txFree = returned = spare = NULL;
+}
+
+// give the kernel every spare frame its fill rings have room for
+static void refill() {
+    UINT32 head = returnedHead, tail = __atomic_load_n(&returnedTail, __ATOMIC_ACQUIRE), room, ix;
+    Xsk *xsk;
+    int x;
+    while (head != tail) {
+        spare[spareCount++] = returned[head++ & returnedMask];
+    }
+    __atomic_store_n(&returnedHead, head, __ATOMIC_RELEASE);
+    for (x = 0; x < xskCount && spareCount; ++x) {
+        xsk = &xsks[x];
+        room = ringRoom(&xsk->fill);
+        if (room < XDP_RING_SIZE / 4) {
+            continue;
+        }
+        for (ix = 0; ix < room && spareCount; ++ix) {
+            ((UINT64*)xsk->fill.descs)[(*xsk->fill.producer + ix) & xsk->fill.mask] =
+                (UINT64)spare[--spareCount] * XDP_FRAME_SIZE;
+        }
+        ringProduce(&xsk->fill, ix);
+        if (*xsk->fill.flags & XDP_RING_NEED_WAKEUP) {
+            recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+        }
+    }
+}
+
+// frames that aren't ip go straight across, by copy, they're few
+static void bridgeFrame(int side, char *data, UINT len) {
+    struct sockaddr_ll to;
+    memset(&to, 0, sizeof(to));
+    to.sll_family = AF_PACKET;
+    to.sll_ifindex = ifIndexes[1 - side];
+    if (sendto(bridgeFd, data, len, MSG_DONTWAIT, (struct sockaddr*)&to, sizeof(to)) == (ssize_t)len) {
+        ++bridged;
+    }
+}
+
+static int xdpRecvFrame(char *buf, UINT bufLen, char **frame, UINT *readLen, WINDIVERT_ADDRESS *addr) {
+    struct xdp_desc *desc;
+    Xsk *xsk = NULL;
+    char *data;
+    UINT32 idx, len, idle;
+    UINT16 type;
+    int tries;
+    *frame = NULL;
+    for (;;) {
+        if (xdpClosed) {
+            return RECV_STATUS_CLOSED;
+        }
+        refill();
+        for (tries = 0; tries < xskCount; ++tries) {
+            xsk = &xsks[nextXsk];
+            nextXsk = (nextXsk + 1) % xskCount;
+            if (ringReady(&xsk->rx)) {
+                break;
+            }
+        }
+        if (tries == xskCount) {
+            if (poll(pollFds, xskCount, XDP_POLL_MS) <= 0) {
+                return RECV_STATUS_RETRY;
+            }
+            continue;
+        }
+        desc = &((struct xdp_desc*)xsk->rx.descs)[*xsk->rx.consumer & xsk->rx.mask];
+        data = umem + desc->addr;
+        len = desc->len;
+        idx = (UINT32)(desc->addr / XDP_FRAME_SIZE);
+        ringConsume(&xsk->rx, 1);
+
+        type = len >= ETH_HLEN ? ntohs(*(UINT16*)(data + ETH_ALEN * 2)) : 0;
+        if (type != ETH_P_IP && type != ETH_P_IPV6) {
+            if (len >= ETH_HLEN) {
+                bridgeFrame(xsk->side, data, len);
+            }
+            spare[spareCount++] = idx;
+            continue;
+        }
+        memcpy(lastEth[xsk->side], data, sizeof(lastEth[0]));
+        memset(addr, 0, sizeof(WINDIVERT_ADDRESS));
+        addr->Outbound = xsk->side == 0;
+        addr->IPv6 = type == ETH_P_IPV6;
+        addr->Network.IfIdx = ifIndexes[xsk->side];
+        *readLen = len - ETH_HLEN;
+
+        // modules hold most frames, keep the rest for the kernel
+        idle = spareCount + (__atomic_load_n(&returnedTail, __ATOMIC_ACQUIRE) - returnedHead);
+        if (idle >= rxFrames / XDP_LOW_SHARE) {
+            refs[idx] = 1;
+            *frame = data + ETH_HLEN;
+        } else {
+            if (*readLen > bufLen) {
+                *readLen = bufLen;
+            }
+            memcpy(buf, data + ETH_HLEN, *readLen);
+            spare[spareCount++] = idx;
+            ++rxCopied;
+        }
+        return RECV_STATUS_OK;
+    }
+}
+
+static int xdpRecv(char *buf, UINT bufLen, UINT *readLen, WINDIVERT_ADDRESS *addr) {
+    char *frame;
+    int status = xdpRecvFrame(buf, bufLen, &frame, readLen, addr);
+    if (frame) {
+        if (*readLen > bufLen) {
+            *readLen = bufLen;
+        }
+        memcpy(buf, frame, *readLen);
+        refs[(frame - umem) / XDP_FRAME_SIZE] = 0;
+        spare[spareCount++] = (UINT32)((frame - umem) / XDP_FRAME_SIZE);
+    }
+    return status;
+}
+
+static void unref(UINT32 idx) {
+    if (--refs[idx] == 0) {
+        returned[returnedTail & returnedMask] = idx;
+        __atomic_store_n(&returnedTail, returnedTail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void xdpReleaseFrame(char *frame) {
+    unref((UINT32)((frame - umem) / XDP_FRAME_SIZE));
+}
+
+static void reapCompletions() {
+    Xsk *xsk;
+    UINT32 count, ix, idx;
+    int x;
+    for (x = 0; x < xskCount; ++x) {
+        xsk = &xsks[x];
+        count = ringReady(&xsk->comp);
+        for (ix = 0; ix < count; ++ix) {
+            idx = (UINT32)(((UINT64*)xsk->comp.descs)[(*xsk->comp.consumer + ix) & xsk->comp.mask] / XDP_FRAME_SIZE);
+            if (idx >= rxFrames) {
+                txFree[txFreeCount++] = idx;
+            } else {
+                unref(idx);
+            }
+        }
+        if (count) {
+            ringConsume(&xsk->comp, count);
+        }
+    }
+}
+
+static BOOL txDrained(Xsk *xsk) {
+    return __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE) == *xsk->tx.producer;
+}
+
+static void kick(Xsk *xsk) {
+    int tries;
+    if (!xsk->txPending) {
+        return;
+    }
+    // zero copy drivers send on their own, they say when they need waking
+    if (zeroCopyMode) {
+        if (*xsk->tx.flags & XDP_RING_NEED_WAKEUP) {
+            sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+        }
+        xsk->txPending = 0;
+        return;
+    }
+    // copy mode only sends from the syscall, a batch at a time, and says
+    // EAGAIN while there's more. pending stays set if the device won't take
+    // it all, the next kick carries on
+    for (tries = 0; tries < XDP_KICK_TRIES && !txDrained(xsk); ++tries) {
+        if (sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0
+            && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+            LOG("xdp tx kick failed (%d)", errno);
+            break;
+        }
+    }
+    if (txDrained(xsk)) {
+        xsk->txPending = 0;
+    }
+}
+
+// same flow, same queue, so a flow isn't reordered across queues
+static Xsk* txSocket(PacketNode *pnode, int side) {
+    UINT32 hash = 0;
+    UINT ix, from = pnode->addr.IPv6 ? 8 : 12, to = pnode->addr.IPv6 ? 40 : 20;
+    if (queueCount > 1 && pnode->packetLen >= to) {
+        for (ix = from; ix < to; ++ix) {
+            hash = hash * 31 + (UINT8)pnode->packet[ix];
+        }
+    }
+    return &xsks[side * queueCount + hash % queueCount];
+}
+
+static short xdpSend(PacketNode *pnode) {
+    int side = pnode->addr.Outbound ? 1 : 0;
+    Xsk *xsk = txSocket(pnode, side);
+    struct xdp_desc *desc;
+    UINT64 offset = (UINT64)(pnode->packet - umem);
+    UINT32 idx;
+    char *base;
+    BOOL lent = pnode->packet >= umem + ETH_HLEN && offset < (UINT64)rxFrames * XDP_FRAME_SIZE;
+
+    if (ringRoom(&xsk->tx) == 0 || (!lent && txFreeCount == 0)) {
+        kick(xsk);
+        reapCompletions();
+        if (ringRoom(&xsk->tx) == 0 || (!lent && txFreeCount == 0)) {
+            ++txFull;
+            return SEND_STATUS_FAIL;
+        }
+    }
+    desc = &((struct xdp_desc*)xsk->tx.descs)[*xsk->tx.producer & xsk->tx.mask];
+    if (lent) {
+        // out the other side from the frame it came in, link header and all
+        idx = (UINT32)(offset / XDP_FRAME_SIZE);
+        ++refs[idx];
+        desc->addr = offset - ETH_HLEN;
+        ++txZeroCopy;
+    } else {
+        if (pnode->packetLen + ETH_HLEN > XDP_FRAME_SIZE) {
+            ++txTooBig;
+            return SEND_STATUS_FAIL;
+        }
+        idx = txFree[--txFreeCount];
+        base = umem + (size_t)idx * XDP_FRAME_SIZE;
+        memcpy(base, lastEth[1 - side], sizeof(lastEth[0]));
+        *(UINT16*)(base + ETH_ALEN * 2) = htons(pnode->addr.IPv6 ? ETH_P_IPV6 : ETH_P_IP);
+        memcpy(base + ETH_HLEN, pnode->packet, pnode->packetLen);
+        desc->addr = (UINT64)idx * XDP_FRAME_SIZE;
+        ++txCopied;
+    }
+    if (fixChecksums) {
+        WinDivertHelperCalcChecksums(umem + desc->addr + ETH_HLEN, pnode->packetLen, NULL,
+            WINDIVERT_HELPER_NO_IP_CHECKSUM);
+    }
+    desc->len = pnode->packetLen + ETH_HLEN;
+    desc->options = 0;
+    ringProduce(&xsk->tx, 1);
+    ++xsk->txPending;
+    return SEND_STATUS_SEND;
+}
+
+static void xdpFlush() {
+    int x;
+    for (x = 0; x < xskCount; ++x) {
+        kick(&xsks[x]);
+    }
+    reapCompletions();
+}
+
+// every tx ring taken by the kernel and every copy completed
+static BOOL xdpSent() {
+    int x;
+    for (x = 0; x < xskCount; ++x) {
+        if (!txDrained(&xsks[x])) {
+            return FALSE;
+        }
+    }
+    return txFreeCount == frameCount - rxFrames;
+}
+
+static BOOL xdpOpen(const char *filter, char buf[]) {
+    const char *names[2] = { getArg("xdp-a"), getArg("xdp-b") }, *value;
+    UINT ix, txFrames;
+    int side, queue;
+
+    UNREFERENCED_PARAMETER(filter);
+    xdpRelease();
+    for (side = 0; side < 2; ++side) {
+        if (names[side] == NULL || (ifIndexes[side] = (int)if_nametoindex(names[side])) == 0) {
+            sprintf(buf, "xdp backend needs --xdp-a and --xdp-b naming existing interfaces");
+            return FALSE;
+        }
+    }
+    value = getArg("xdp-queues");
+    queueCount = value ? atoi(value) : 1;
+    value = getArg("xdp-checksums");
+    fixChecksums = value == NULL || strcmp(value, "off") != 0;
+    value = getArg("xdp-frames");
+    frameCount = value ? (UINT)strtoul(value, NULL, 10) : XDP_FRAMES_DEFAULT;
+    if (queueCount < 1 || queueCount > XDP_QUEUES_MAX) {
+        sprintf(buf, "--xdp-queues must be in [1, %d]", XDP_QUEUES_MAX);
+        return FALSE;
+    }
+    txFrames = frameCount / XDP_TX_SHARE;
+    rxFrames = frameCount - txFrames;
+    // full fill rings may take up to half of the rx frames, the rest is the engine's
+    if (rxFrames < (UINT)queueCount * 2 * XDP_RING_SIZE * 2 || frameCount > 0xFFFFFF) {
+        sprintf(buf, "--xdp-frames must be in [%u, %u] for %d queues",
+            (UINT)queueCount * 2 * XDP_RING_SIZE * 2 * XDP_TX_SHARE / (XDP_TX_SHARE - 1) + 1, 0xFFFFFF, queueCount);
+        return FALSE;
+    }
+
+    umem = (char*)mmap(NULL, (size_t)frameCount * XDP_FRAME_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    for (returnedMask = 1; returnedMask < rxFrames; returnedMask <<= 1);
+    refs = (UINT8*)calloc(rxFrames, sizeof(UINT8));
+    txFree = (UINT32*)malloc(sizeof(UINT32) * txFrames);
+    returned = (UINT32*)malloc(sizeof(UINT32) * returnedMask);
+    spare = (UINT32*)malloc(sizeof(UINT32) * rxFrames);
+    --returnedMask;
+    if (umem == MAP_FAILED || !refs || !txFree || !returned || !spare) {
+        umem = NULL;
+        sprintf(buf, "Failed to allocate %u xdp frames", frameCount);
+        goto FAIL;
+    }
+
+    driverMode = TRUE;
+    for (side = 0; side < 2; ++side) {
+        for (queue = 0; queue < queueCount; ++queue) {
+            if (!openXsk(&xsks[xskCount++], side, queue, buf)) {
+                goto FAIL;
+            }
+            pollFds[xskCount - 1].fd = xsks[xskCount - 1].fd;
+            pollFds[xskCount - 1].events = POLLIN;
+        }
+    }
+    bridgeFd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (bridgeFd < 0) {
+        LOG("xdp can't pass non ip frames across (%d)", errno);
+    }
+
+    spareCount = 0;
+    for (ix = 0; ix < rxFrames; ++ix) {
+        spare[spareCount++] = rxFrames - 1 - ix;
+    }
+    for (ix = 0; ix < txFrames; ++ix) {
+        txFree[ix] = rxFrames + ix;
+    }
+    txFreeCount = txFrames;
+    returnedHead = returnedTail = 0;
+    nextXsk = 0;
+    memset(lastEth, 0, sizeof(lastEth));
+    refill();
+    // frames start coming once the programs are in
+    for (side = 0; side < 2; ++side) {
+        if (!attachProgram(side, buf)) {
+            goto FAIL;
+        }
+    }
+    rxCopied = bridged = txZeroCopy = txCopied = txFull = txTooBig = 0;
+    xdpClosed = 0;
+    LOG("xdp backend between %s and %s, %d queues, %u frames, %s mode, %s", names[0], names[1], queueCount,
+        frameCount, zeroCopyMode ? "zero copy" : "copy", driverMode ? "driver" : "generic");
+    return TRUE;
+
+FAIL:
+    xdpRelease();
+    return FALSE;
+}
+
+// the last sends are flushed and waited for, sockets stay for the next open.
+// without the programs frames go to the interfaces' own stacks again
+static void xdpClose() {
+    int side, waits;
+    InterlockedExchange16(&xdpClosed, 1);
+    xdpFlush();
+    // copy mode sends what's left only as it's kicked
+    for (waits = 0; waits < XDP_POLL_MS && !xdpSent(); ++waits) {
+        Sleep(1);
+        xdpFlush();
+    }
+    for (side = 0; side < 2; ++side) {
+        closeFd(&linkFds[side]);
+    }
+}
+
+static void xdpStats(char *buf, size_t bufLen) {
+    struct xdp_statistics total, one;
+    socklen_t optlen;
+    int x;
+    memset(&total, 0, sizeof(total));
+    for (x = 0; x < xskCount; ++x) {
+        optlen = sizeof(one);
+        if (getsockopt(xsks[x].fd, SOL_XDP, XDP_STATISTICS, &one, &optlen) == 0) {
+            total.rx_dropped += one.rx_dropped;
+            total.rx_invalid_descs += one.rx_invalid_descs;
+            total.tx_invalid_descs += one.tx_invalid_descs;
+            total.rx_ring_full += one.rx_ring_full;
+            total.rx_fill_ring_empty_descs += one.rx_fill_ring_empty_descs;
+            total.tx_ring_empty_descs += one.tx_ring_empty_descs;
+        }
+    }
+    snprintf(buf, bufLen, "xdp_zero_copy=%d xdp_driver_mode=%d xdp_rx_dropped=%llu xdp_rx_ring_full=%llu xdp_fill_ring_empty=%llu"
+        " xdp_rx_invalid=%llu xdp_tx_invalid=%llu xdp_rx_copied=%llu xdp_tx_zero_copy=%llu xdp_tx_copied=%llu"
+        " xdp_tx_full=%llu xdp_tx_too_big=%llu xdp_bridged=%llu",
+        zeroCopyMode ? 1 : 0, driverMode ? 1 : 0,
+        (unsigned long long)total.rx_dropped, (unsigned long long)total.rx_ring_full,
+        (unsigned long long)total.rx_fill_ring_empty_descs, (unsigned long long)total.rx_invalid_descs,
+        (unsigned long long)total.tx_invalid_descs, (unsigned long long)rxCopied,
+        (unsigned long long)txZeroCopy, (unsigned long long)txCopied, (unsigned long long)txFull,
+        (unsigned long long)txTooBig, (unsigned long long)bridged);
+}
+
+Backend xdpBackend = {
+    "xdp",
+    xdpOpen,
+    xdpRecv,
+    xdpSend,
+    xdpClose,
+    0,
+    0,
+    NULL,
+    xdpFlush,
+    xdpRecvFrame,
+    xdpReleaseFrame,
+    xdpStats,
+    NULL
+};
+#endif